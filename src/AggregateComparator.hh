@@ -1,4 +1,7 @@
 /*
+ * Key order of the version 1 format, only catchdb-migrate still opens
+ * databases with it; keys are memcmp-ordered since version 2.
+ *
  * Custom comparator that aggregate records of same type and same instance.
  * Because LevelDB store records in order, records with adjacent keys will 
  * be stored adjacently.
@@ -14,6 +17,8 @@
 
 #include <cstdint>
 #include <cstring>
+#include <string>
+#include <algorithm>
 #include "leveldb/comparator.h"
 
 namespace catchdb
@@ -21,81 +26,42 @@ namespace catchdb
 
 class AggregateComparator : public leveldb::Comparator
 {
+public:
     //   if a < b: negative result
     //   if a > b: positive result
     //   else: zero result
+    //
+    // Keys of a container compare by name size, name, then by what follows
+    // the name, so the records of a container are contiguous and every key
+    // starting with the container's prefix sorts inside that range.
     int Compare(const leveldb::Slice& a, const leveldb::Slice& b) const
     {
-        if (a[0] != b[0])
-            return a[0] - b[0];
+        if (a.empty() || b.empty() || a[0] != b[0])
+            return a.compare(b);
 
+        leveldb::Slice ra, rb;
+        int ret;
         switch (a[0]) {
-            case 'K':
-                return a.compare(b);
-            case 'H': {
-                uint16_t sizea = *((uint16_t*)(a.data() + 1));
-                uint16_t sizeb = *((uint16_t*)(b.data() + 1));
-                if (sizea != sizeb)
-                    return sizea - sizeb;
-                if (a.size() != b.size())
-                    return a.size() - b.size();
-                return memcmp(a.data() + 3 + sizea,
-                              b.data() + 3 + sizea,
-                              a.size() - 3 - sizea);
-            }
-            case 'Q': {
-                uint16_t sizea = *((uint16_t*)(a.data() + 1));
-                uint16_t sizeb = *((uint16_t*)(b.data() + 1));
-                if (sizea != sizeb)
-                    return sizea - sizeb;
-                return memcmp(a.data() + 3, b.data() + 3, 8);
-            }
-            case 'Z': {
-                // check name first
-                if (a.size() < 4 || b.size() < 4)
-                    return a.compare(b);
-
-                uint16_t sizea = *((uint16_t*)(a.data() + 2));
-                uint16_t sizeb = *((uint16_t*)(b.data() + 2));
-                if (sizea != sizeb)
-                    return sizea - sizeb;
-                
-                int ret = memcmp(a.data() + 4, b.data() + 4, sizea);
-                if (ret != 0) {
+            case 'H':
+                if ((ret = CompareName(a, b, 1, &ra, &rb)) != 0)
+                    return ret;
+                return ra.compare(rb);
+            case 'Q':
+                if ((ret = CompareName(a, b, 1, &ra, &rb)) != 0)
+                    return ret;
+                // sequence
+                if ((ret = CompareNumber<uint64_t>(&ra, &rb)) != 0)
+                    return ret;
+                return ra.compare(rb);
+            case 'Z':
+                if ((ret = CompareName(a, b, 2, &ra, &rb)) != 0)
                     return ret;
-                }
-
                 // Key or Score
                 if (a[1] != b[1])
-                    return a[1] - b[1];
-
-                const char *aa = a.data() + 4 + sizea;
-                const char *bb = b.data() + 4 + sizea;
-                int sizeNow = 4 + sizea;
-                if (a[1] == 'S') {
-                    if ((a.size() - sizeNow >= sizeof (int64_t)) &&
-                        (b.size() - sizeNow >= sizeof (int64_t))) {
-                        int64_t scorea = *((int64_t*)aa);
-                        int64_t scoreb = *((int64_t*)bb);
-
-                        if (scorea != scoreb)
-                            return scorea - scoreb;
-                        sizeNow += sizeof (int64_t);
-                    }
-                    if (a.size() == b.size()) {
-                        return memcmp(aa + sizeof (int64_t), 
-                                      bb + sizeof (int64_t), 
-                                      a.size() - sizeNow);
-                    }
-                    return a.size() - b.size();
-
-                } else {
-                    if (a.size() == b.size()) {
-                        return memcmp(aa, bb, a.size() - 4 - sizea);
-                    }
-                    return a.size() - b.size();
-                }
-            }
+                    return a[1] < b[1] ? -1 : 1;
+                if (a[1] == 'S' && (ret = CompareNumber<int64_t>(&ra, &rb)) != 0)
+                    return ret;
+                return ra.compare(rb);
             default:
                 return a.compare(b);
         }
@@ -103,7 +69,8 @@ class AggregateComparator : public leveldb::Comparator
 
     const char* Name() const
     {
-        return "catchdb.AggregateComparator";
+        // records used to interleave, see Compare
+        return "catchdb.AggregateComparator.v2";
     }
 
     void FindShortestSeparator(std::string* start, const leveldb::Slice& limit) const
@@ -113,6 +80,52 @@ class AggregateComparator : public leveldb::Comparator
     void FindShortSuccessor(std::string* key) const
     {
     }
+
+private:
+    // Compare the container names of @a and @b, whose 2 byte size is
+    // stored at @offset; @ra and @rb are set to what follows the names.
+    static int CompareName(const leveldb::Slice &a, const leveldb::Slice &b, size_t offset,
+                           leveldb::Slice *ra, leveldb::Slice *rb)
+    {
+        if (a.size() < offset + 2 || b.size() < offset + 2)
+            return a.compare(b);
+
+        uint16_t sizea, sizeb;
+        memcpy(&sizea, a.data() + offset, sizeof sizea);
+        memcpy(&sizeb, b.data() + offset, sizeof sizeb);
+        if (sizea != sizeb)
+            return sizea < sizeb ? -1 : 1;
+
+        // seek targets may stop inside the name
+        size_t enda = std::min<size_t>(offset + 2 + sizea, a.size());
+        size_t endb = std::min<size_t>(offset + 2 + sizeb, b.size());
+        leveldb::Slice namea(a.data() + offset + 2, enda - offset - 2);
+        leveldb::Slice nameb(b.data() + offset + 2, endb - offset - 2);
+        int ret = namea.compare(nameb);
+        if (ret != 0)
+            return ret;
+
+        *ra = leveldb::Slice(a.data() + enda, a.size() - enda);
+        *rb = leveldb::Slice(b.data() + endb, b.size() - endb);
+        return 0;
+    }
+
+    // compare the numbers @ra and @rb start with, which are then removed
+    template <typename Num>
+    static int CompareNumber(leveldb::Slice *ra, leveldb::Slice *rb)
+    {
+        if (ra->size() < sizeof (Num) || rb->size() < sizeof (Num))
+            return 0;
+
+        Num na, nb;
+        memcpy(&na, ra->data(), sizeof na);
+        memcpy(&nb, rb->data(), sizeof nb);
+        if (na != nb)
+            return na < nb ? -1 : 1;
+        ra->remove_prefix(sizeof (Num));
+        rb->remove_prefix(sizeof (Num));
+        return 0;
+    }
 };
 
 } // namespace catchdb
@@ -1,78 +1,195 @@
 #include "Buffer.h"
+#include <vector>
+#include <mutex>
+#include <algorithm>
 #include <cstring>
 #include <cassert>
 
 namespace catchdb
 {
 
-Buffer::Buffer(int size)
-    : size_(size), avail_(size), start_(0), pos_(0), accrossBuf_(false)
-{
-    buf_ = new char[size * 2];
-}
+const int Buffer::SLAB_SIZE;
 
-Buffer::~Buffer()
+namespace
 {
-    delete[] buf_;
-}
 
-int Buffer::avail()
+// free slabs kept for reuse, shared by all connections and threads
+const size_t MAX_FREE_SLABS = 4096;
+
+std::mutex slabPoolMutex;
+std::vector<char*> slabPool;
+
+} // namespace
+
+char* Buffer::AcquireSlab()
 {
-    return avail_;
+    {
+        std::lock_guard<std::mutex> lock(slabPoolMutex);
+        if (!slabPool.empty()) {
+            char *slab = slabPool.back();
+            slabPool.pop_back();
+            return slab;
+        }
+    }
+    return new char[SLAB_SIZE];
 }
 
-bool Buffer::full()
+void Buffer::ReleaseSlab(char *slab)
 {
-    return avail_ == 0;
+    {
+        std::lock_guard<std::mutex> lock(slabPoolMutex);
+        if (slabPool.size() < MAX_FREE_SLABS) {
+            slabPool.push_back(slab);
+            return;
+        }
+    }
+    delete[] slab;
 }
 
-void Buffer::reset()
+Buffer::Buffer(int maxSize)
+    : maxSize_(std::max(maxSize, SLAB_SIZE)), totalSize_(0)
+{}
+
+Buffer::~Buffer()
 {
-    start_ = 0;
-    pos_ = 0;
-    avail_ = size_;
-    accrossBuf_ = false;
+    for (auto &segment : segments_) {
+        freeSegment(segment);
+    }
 }
 
 char* Buffer::data()
 {
-    return buf_ + start_;
+    if (segments_.empty())
+        return nullptr;
+    auto &last = segments_.back();
+    return last.buf + last.start;
 }
 
 int Buffer::size()
 {
-    return size_ - avail_;
+    if (segments_.empty())
+        return 0;
+    auto &last = segments_.back();
+    return last.end - last.start;
 }
 
 char* Buffer::tail()
 {
-    return accrossBuf_ ? buf_ + size_ + pos_ : buf_ + pos_;
+    if (segments_.empty())
+        segments_.push_back(allocSegment(SLAB_SIZE));
+    auto &last = segments_.back();
+    return last.buf + last.end;
+}
+
+int Buffer::avail()
+{
+    if (segments_.empty())
+        return SLAB_SIZE;
+    auto &last = segments_.back();
+    return last.capacity - last.end;
+}
+
+bool Buffer::full()
+{
+    return avail() == 0;
 }
 
 void Buffer::incr(int len)
 {
-    assert(len <= avail_);
-    pos_ = (pos_ + len) % size_;
-    avail_ -= len;
-    if (accrossBuf_ == false && pos_ < start_ && pos_ != 0) {
-        accrossBuf_ = true; // data span accross two bufs
+    assert(!segments_.empty() && len <= avail());
+    segments_.back().end += len;
+}
+
+bool Buffer::reserve(int offset, int expected)
+{
+    if (segments_.empty())
+        return true;
+
+    auto &last = segments_.back();
+    assert(offset <= last.end - last.start);
+    int begin = last.start + offset;
+    if (last.capacity - begin >= expected && last.end < last.capacity)
+        return true;
+
+    // room for the request plus some of whatever follows it
+    int len = last.end - begin;
+    int capacity = SLAB_SIZE;
+    if (expected > SLAB_SIZE / 2)
+        capacity = expected + SLAB_SIZE;
+
+    // the old segment is dropped when only the partial request lives there
+    int retained = totalSize_ - (offset == 0 ? last.capacity : 0);
+    if (retained + capacity > maxSize_)
+        capacity = maxSize_ - retained;
+    // moving would leave no room to receive more
+    if (capacity < expected || capacity <= len)
+        return false;
+
+    Segment segment = allocSegment(capacity);
+    memcpy(segment.buf, last.buf + begin, len);
+    segment.end = len;
+
+    if (offset == 0) {
+        // nothing else lives in the old segment
+        freeSegment(last);
+        segments_.pop_back();
+    } else {
+        last.end = begin;
+    }
+    segments_.push_back(segment);
+    return true;
+}
+
+void Buffer::consume(int len)
+{
+    assert(!segments_.empty() || len == 0);
+    while (segments_.size() > 1) {
+        freeSegment(segments_.front());
+        segments_.pop_front();
+    }
+    if (segments_.empty())
+        return;
+
+    auto &last = segments_.back();
+    assert(len <= last.end - last.start);
+    last.start += len;
+    if (last.start == last.end) {
+        // idle, hand the memory back
+        freeSegment(last);
+        segments_.pop_back();
     }
 }
 
-void Buffer::decr(int len)
-{
-    assert(len <= size_ - avail_);
-    avail_ += len;
-    start_ = (start_ + len) % size_;
-    if (accrossBuf_ == true && start_ <= pos_) {
-        // now all data resides in buf2
-        memcpy(buf_, buf_ + size_ + start_, pos_ - start_);
-        pos_ -= start_;
-        start_ = 0;
-        accrossBuf_ = false;
+void Buffer::reset(int maxSize)
+{
+    for (auto &segment : segments_) {
+        freeSegment(segment);
     }
+    segments_.clear();
+    maxSize_ = std::max(maxSize, SLAB_SIZE);
 }
 
 /*********** private method ************/
 
+Buffer::Segment Buffer::allocSegment(int capacity)
+{
+    Segment segment;
+    segment.buf = (capacity == SLAB_SIZE) ? AcquireSlab() : new char[capacity];
+    segment.capacity = capacity;
+    segment.start = 0;
+    segment.end = 0;
+    totalSize_ += capacity;
+    return segment;
+}
+
+void Buffer::freeSegment(const Segment &segment)
+{
+    totalSize_ -= segment.capacity;
+    if (segment.capacity == SLAB_SIZE) {
+        ReleaseSlab(segment.buf);
+    } else {
+        delete[] segment.buf;
+    }
+}
+
 } // namespace catchdb
@@ -1,30 +1,80 @@
+/*
+ * Query buffer made of a chain of segments.
+ *
+ * Data is received into the last segment. Segments are 16 KB slabs taken
+ * from a process wide pool, or a larger allocation when a single request
+ * does not fit into a slab. A request never spans two segments: when the
+ * last segment fills up in the middle of a request, only that request is
+ * moved into a new segment sized after what the parser expects, so a
+ * large value is received straight into its final place. Earlier segments
+ * stay untouched until their requests are consumed, then every segment
+ * goes back to the pool once the buffer runs empty.
+ */
+
 #pragma once
 
+#include <deque>
+
 namespace catchdb
 {
 
 class Buffer
 {
 public:
-    Buffer(int size);
+    static const int SLAB_SIZE = 16 * 1024;
+    // the pool of SLAB_SIZE slabs, also where the io_uring loop takes the
+    // buffers the kernel receives into
+    static char* AcquireSlab();
+    static void ReleaseSlab(char *slab);
+
+    // @maxSize bounds the bytes held by all segments together
+    Buffer(int maxSize);
     ~Buffer();
 
-    bool full();
-    int avail();
-    void reset();
+    // first byte of the last segment not consumed yet
     char* data();
-    char* tail();
+    // bytes received from data() on
     int size();
+
+    // where to receive next and how much room is left there
+    char* tail();
+    int avail();
+    bool full();
     void incr(int len);
-    void decr(int len);
+
+    // Make room to receive a request that starts @offset bytes after
+    // data() and is @expected bytes long at least. If the last segment is
+    // too small, the request is moved into a new segment and data() then
+    // points at it. Returns false if this would exceed maxSize or leave
+    // no free room.
+    bool reserve(int offset, int expected);
+
+    // Consume @len bytes from data(), together with all segments before
+    // the last one. An emptied buffer returns its segments to the pool.
+    void consume(int len);
+
+    // drop everything and bound the buffer by @maxSize from now on
+    void reset(int maxSize);
+
+    // non-copyable
+    Buffer(const Buffer&) = delete;
+    Buffer& operator=(const Buffer&) = delete;
 
 private:
-    int size_;
-    int avail_;
-    int start_;
-    int pos_;
-    char *buf_;
-    bool accrossBuf_;
+    struct Segment
+    {
+        char *buf;
+        int capacity;
+        int start; // first unconsumed byte
+        int end;   // first free byte
+    };
+
+    Segment allocSegment(int capacity);
+    void freeSegment(const Segment &segment);
+
+    int maxSize_;
+    int totalSize_; // capacity of all segments
+    std::deque<Segment> segments_;
 };
 
 
@@ -1,76 +1,859 @@
 #include "CatchDB.h"
 #include "Logger.h"
-#include "AggregateComparator.hh"
+#include "Util.h"
+#include "KeyComparator.hh"
 #include "leveldb/filter_policy.h"
 #include "leveldb/cache.h"
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
 
 namespace catchdb
 {
 
-CatchDB::CatchDB(leveldb::DB *db, const std::string &name) 
-    : ldb_(db), name_(name) {}
+namespace
+{
+const KeyComparator comparator;
+
+// Next() steps tried before a dense getM seeks to the next key
+const int MAX_STEPS = 8;
+
+// a group commit stops taking writers past this many bytes
+const size_t MAX_GROUP_BYTES = 1 << 20;
+// and its leader stops waiting for more at this many writers
+const size_t MAX_GROUP_WRITERS = 256;
+
+// stripes of the coalesced counters
+const size_t NUM_COUNTER_STRIPES = 64;
+// a counter is written once incremented this many times since its last write
+const uint64_t COALESCE_LIMIT = 10000;
+
+bool IsKVKey(const leveldb::Slice &key)
+{
+    return !key.empty() && key[0] == 'K';
+}
+
+// leveldb 1.15 has no WriteBatch::Append
+class BatchCopier : public leveldb::WriteBatch::Handler
+{
+public:
+    BatchCopier(leveldb::WriteBatch *group) : group_(group), bytes_(0) {}
+
+    void Put(const leveldb::Slice &key, const leveldb::Slice &value)
+    {
+        group_->Put(key, value);
+        bytes_ += key.size() + value.size();
+    }
+
+    void Delete(const leveldb::Slice &key)
+    {
+        group_->Delete(key);
+        bytes_ += key.size();
+    }
+
+    size_t bytes() const { return bytes_; }
+
+private:
+    leveldb::WriteBatch *group_;
+    size_t bytes_;
+};
+
+// drops the keys of a batch from the row cache
+class CacheEraser : public leveldb::WriteBatch::Handler
+{
+public:
+    CacheEraser(RowCache *cache) : cache_(cache) {}
+
+    void Put(const leveldb::Slice &key, const leveldb::Slice &value)
+    {
+        cache_->erase(key);
+    }
+
+    void Delete(const leveldb::Slice &key)
+    {
+        cache_->erase(key);
+    }
+
+private:
+    RowCache *cache_;
+};
+
+// collects the KV keys of a batch
+class KVKeyCollector : public leveldb::WriteBatch::Handler
+{
+public:
+    void Put(const leveldb::Slice &key, const leveldb::Slice &value)
+    {
+        add(key);
+    }
+
+    void Delete(const leveldb::Slice &key)
+    {
+        add(key);
+    }
+
+    std::vector<std::string> keys;
+
+private:
+    void add(const leveldb::Slice &key)
+    {
+        if (IsKVKey(key))
+            keys.push_back(key.ToString());
+    }
+};
+
+// splits a batch into one batch per shard
+class BatchSplitter : public leveldb::WriteBatch::Handler
+{
+public:
+    BatchSplitter(size_t shards) : batches_(shards), used_(shards, false) {}
+
+    void Put(const leveldb::Slice &key, const leveldb::Slice &value)
+    {
+        size_t i = ShardIndex(key, batches_.size());
+        batches_[i].Put(key, value);
+        used_[i] = true;
+    }
+
+    void Delete(const leveldb::Slice &key)
+    {
+        size_t i = ShardIndex(key, batches_.size());
+        batches_[i].Delete(key);
+        used_[i] = true;
+    }
+
+    bool used(size_t i) const { return used_[i]; }
+    leveldb::WriteBatch* batch(size_t i) { return &batches_[i]; }
+
+private:
+    std::vector<leveldb::WriteBatch> batches_;
+    std::vector<bool> used_;
+};
+// Stamp a new database with the key format, refuse one of another format.
+Status CheckFormat(leveldb::DB *db, const std::string &layout)
+{
+    std::string version;
+    auto s = db->Get(leveldb::ReadOptions(), FORMAT_VERSION_KEY, &version);
+    if (s.ok()) {
+        if (version != FORMAT_VERSION) {
+            LogError("key format %s, expected %s", version.c_str(), FORMAT_VERSION);
+            return Status::Error;
+        }
+    } else if (!s.IsNotFound()) {
+        LogError(s.ToString().c_str());
+        return Status::Error;
+    } else {
+        std::unique_ptr<leveldb::Iterator> it(db->NewIterator(leveldb::ReadOptions()));
+        it->SeekToFirst();
+        if (it->Valid()) {
+            LogError("database without key format version, convert it with catchdb-migrate");
+            return Status::Error;
+        }
+        s = db->Put(leveldb::WriteOptions(), FORMAT_VERSION_KEY, FORMAT_VERSION);
+        if (!s.ok()) {
+            LogError(s.ToString().c_str());
+            return Status::Error;
+        }
+    }
+
+    // databases of a single shard predate the record
+    std::string stamped;
+    s = db->Get(leveldb::ReadOptions(), SHARD_KEY, &stamped);
+    if (s.ok()) {
+        if (stamped == layout)
+            return Status::OK;
+        LogError("database is shard %s, configured as %s", stamped.c_str(), layout.c_str());
+        return Status::Error;
+    }
+    if (!s.IsNotFound()) {
+        LogError(s.ToString().c_str());
+        return Status::Error;
+    }
+    s = db->Put(leveldb::WriteOptions(), SHARD_KEY, layout);
+    if (!s.ok()) {
+        LogError(s.ToString().c_str());
+        return Status::Error;
+    }
+    return Status::OK;
+}
+
+} // namespace
+
+struct CatchDB::Writer
+{
+    leveldb::WriteBatch *batch;
+    Durability durability;
+    Status status;
+    bool done;
+    std::condition_variable cv;
+
+    Writer(leveldb::WriteBatch *b, Durability d)
+        : batch(b), durability(d), status(Status::OK), done(false) {}
+};
+
+struct CatchDB::Shard
+{
+    leveldb::DB *ldb;
+    std::string name;
+
+    // group commit
+    std::mutex writeMutex;
+    std::condition_variable leaderCv; // more writers queued
+    std::deque<Writer*> writers; // the front one leads the next group
+    leveldb::WriteBatch group;
+    bool unsynced; // EverySec writes since the last synced group
+
+    // counters, under writeMutex
+    uint64_t writes; // batches
+    uint64_t groups; // leveldb writes
+    uint64_t syncs;  // synced leveldb writes
+
+    Shard(leveldb::DB *db, const std::string &n)
+        : ldb(db), name(n), unsynced(false), writes(0), groups(0), syncs(0) {}
+
+    ~Shard()
+    {
+        delete ldb;
+    }
+};
+
+struct CatchDB::CounterStripe
+{
+    struct Counter
+    {
+        int64_t value;
+        uint64_t increments; // since written, dirty if > 0
+        bool touched; // incremented since the last aging flush
+    };
+
+    std::mutex mutex;
+    std::unordered_map<std::string, Counter> counters;
+};
+
+Snapshot::~Snapshot()
+{
+    for (auto &shard : shards)
+        shard.first->ReleaseSnapshot(shard.second);
+    --db->snapshots_;
+}
+
+thread_local Durability CatchDB::threadDurability = Durability::Default;
+thread_local const Snapshot* CatchDB::threadSnapshot = nullptr;
+
+CatchDB::CatchDB(const std::vector<leveldb::DB*> &dbs, const std::vector<std::string> &names)
+    : window_(0), durability_(Durability::None), counterFlush_(0), counters_(0),
+      dirtyCounters_(0), snapshots_(0),
+      nextSnapshotId_(std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::system_clock::now().time_since_epoch()).count()),
+      stop_(false)
+{
+    for (size_t i = 0; i < dbs.size(); ++i)
+        shards_.push_back(std::unique_ptr<Shard>(new Shard(dbs[i], names[i])));
+    for (size_t i = 0; i < NUM_COUNTER_STRIPES; ++i)
+        counterStripes_.push_back(std::unique_ptr<CounterStripe>(new CounterStripe()));
+    syncer_ = std::thread(&CatchDB::syncLoop, this);
+}
 
 CatchDB::~CatchDB()
 {
-    if (ldb_) {
-        delete ldb_;
+    {
+        std::lock_guard<std::mutex> lock(syncMutex_);
+        stop_ = true;
     }
+    syncCv_.notify_all();
+    syncer_.join();
+    if (counterFlusher_.joinable())
+        counterFlusher_.join();
+    flushCounters();
 }
 
 Status CatchDB::get(const std::string &key, std::string *ret)
 {
-    leveldb::Status s = ldb_->Get(leveldb::ReadOptions(), key, ret);
+    // coalesced increments are not in leveldb yet
+    if (counters_ > 0 && threadSnapshot == nullptr && IsKVKey(key)) {
+        CounterStripe &stripe = counterStripeOf(key);
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+        auto it = stripe.counters.find(key);
+        if (it != stripe.counters.end()) {
+            *ret = std::to_string(it->second.value);
+            return Status::OK;
+        }
+    }
+    return read(key, ret);
+}
+
+Status CatchDB::put(const std::string &key, const leveldb::Slice &value)
+{
+    std::unique_lock<std::mutex> lock;
+    if (IsKVKey(key)) {
+        CounterStripe &stripe = counterStripeOf(key);
+        lock = std::unique_lock<std::mutex>(stripe.mutex);
+        dropCounter(&stripe, key);
+    }
+
+    leveldb::WriteBatch batch;
+    batch.Put(key, value);
+    Status s = write(shardOf(key), &batch, threadDurability);
+    if (rowCache_)
+        rowCache_->erase(key);
+    return s;
+}
+
+Status CatchDB::del(const std::string &key)
+{
+    std::unique_lock<std::mutex> lock;
+    if (IsKVKey(key)) {
+        CounterStripe &stripe = counterStripeOf(key);
+        lock = std::unique_lock<std::mutex>(stripe.mutex);
+        dropCounter(&stripe, key);
+    }
+
+    leveldb::WriteBatch batch;
+    batch.Delete(key);
+    Status s = write(shardOf(key), &batch, threadDurability);
+    if (rowCache_)
+        rowCache_->erase(key);
+    return s;
+}
+
+Status CatchDB::putM(leveldb::WriteBatch *batch)
+{
+    std::vector<std::unique_lock<std::mutex>> locks;
+    lockCounters(batch, &locks);
+    return writeBatch(batch);
+}
+
+Status CatchDB::incr(const std::string &key, int64_t delta, int64_t *value)
+{
+    CounterStripe &stripe = counterStripeOf(key);
+    std::lock_guard<std::mutex> lock(stripe.mutex);
+
+    auto it = stripe.counters.find(key);
+    int64_t current = 0;
+    if (it != stripe.counters.end()) {
+        current = it->second.value;
+    } else {
+        std::string old;
+        Status s = read(key, &old);
+        if (s == Status::OK) {
+            if (!ParseInt64(old, &current))
+                return Status::InvalidParameter;
+        } else if (s != Status::NotFound) {
+            return s;
+        }
+    }
+    if (__builtin_add_overflow(current, delta, value))
+        return Status::InvalidParameter;
+
+    Durability durability = threadDurability;
+    if (durability == Durability::Default)
+        durability = durability_;
+
+    // written through, the counter if any is clean then
+    if (counterFlush_.count() == 0 || durability == Durability::Always) {
+        leveldb::WriteBatch batch;
+        batch.Put(key, std::to_string(*value));
+        Status s = write(shardOf(key), &batch, durability);
+        if (rowCache_)
+            rowCache_->erase(key);
+        if (s != Status::OK)
+            return s;
+        if (it != stripe.counters.end()) {
+            it->second.value = *value;
+            if (it->second.increments > 0) {
+                it->second.increments = 0;
+                --dirtyCounters_;
+            }
+        }
+        return Status::OK;
+    }
+
+    if (it == stripe.counters.end()) {
+        it = stripe.counters.emplace(key, CounterStripe::Counter{0, 0, false}).first;
+        ++counters_;
+    }
+    CounterStripe::Counter &counter = it->second;
+    // the increment reaching the limit is written with those before it,
+    // and the counter advanced only then, so a failed write loses none
+    if (counter.increments + 1 >= COALESCE_LIMIT) {
+        leveldb::WriteBatch batch;
+        batch.Put(key, std::to_string(*value));
+        Status s = writeBatch(&batch);
+        if (s != Status::OK)
+            return s;
+        counter.value = *value;
+        counter.touched = true;
+        if (counter.increments > 0) {
+            counter.increments = 0;
+            --dirtyCounters_;
+        }
+        return Status::OK;
+    }
+    counter.value = *value;
+    counter.touched = true;
+    if (counter.increments++ == 0)
+        ++dirtyCounters_;
+    return Status::OK;
+}
+
+Status CatchDB::getM(const std::vector<std::string> &keys, bool dense,
+                     std::vector<std::string> *values, std::vector<bool> *found,
+                     const Snapshot *snapshot)
+{
+    // read at one snapshot, coalesced counters are written out first
+    if (dirtyCounters_ > 0 && snapshot == nullptr && threadSnapshot == nullptr &&
+        std::any_of(keys.begin(), keys.end(),
+                    [](const std::string &key) { return IsKVKey(key); }))
+        flushCounters();
+
+    // by shard, then by key
+    std::vector<size_t> shardOfKey(keys.size());
+    std::vector<size_t> order(keys.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        shardOfKey[i] = ShardIndex(keys[i], shards_.size());
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&keys, &shardOfKey](size_t a, size_t b) {
+        if (shardOfKey[a] != shardOfKey[b])
+            return shardOfKey[a] < shardOfKey[b];
+        return leveldb::Slice(keys[a]).compare(keys[b]) < 0;
+    });
+    values->assign(keys.size(), std::string());
+    found->assign(keys.size(), false);
+
+    size_t begin = 0;
+    while (begin < order.size()) {
+        size_t shard = shardOfKey[order[begin]];
+        size_t end = begin + 1;
+        while (end < order.size() && shardOfKey[order[end]] == shard)
+            ++end;
+        Status s = getShard(shard, keys, &order[begin], end - begin, dense, values,
+                            found, snapshot);
+        if (s != Status::OK)
+            return s;
+        begin = end;
+    }
+    return Status::OK;
+}
+
+Iterator* CatchDB::newIterator(const std::string &prefix,
+                               Iterator::Direction direction)
+{
+    std::vector<leveldb::DB*> dbs;
+    std::vector<const leveldb::Snapshot*> snapshots;
+    if (dirtyCounters_ > 0 && threadSnapshot == nullptr &&
+        (prefix.empty() || IsKVKey(prefix)))
+        flushCounters();
+    // the records of a container lie on one shard, KV pairs on all
+    if (ContainerHeaderSize(prefix) > 0) {
+        size_t shard = ShardIndex(prefix, shards_.size());
+        dbs.push_back(shards_[shard]->ldb);
+        snapshots.push_back(threadSnapshotOf(shard));
+    } else {
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            dbs.push_back(shards_[i]->ldb);
+            snapshots.push_back(threadSnapshotOf(i));
+        }
+    }
+    return new Iterator(dbs, snapshots, prefix, direction);
+}
+
+SnapshotPtr CatchDB::snapshot()
+{
+    if (dirtyCounters_ > 0)
+        flushCounters();
+    SnapshotPtr snapshot(new Snapshot());
+    snapshot->db = shared_from_this();
+    snapshot->id = nextSnapshotId_++;
+    ++snapshots_;
+    for (auto &shard : shards_)
+        snapshot->shards.push_back(std::make_pair(shard->ldb, shard->ldb->GetSnapshot()));
+    return snapshot;
+}
+
+void CatchDB::info(std::vector<std::string> *out)
+{
+    if (rowCache_) {
+        out->push_back("row_cache.capacity");
+        out->push_back(std::to_string(rowCache_->capacity()));
+        out->push_back("row_cache.bytes");
+        out->push_back(std::to_string(rowCache_->bytes()));
+        out->push_back("row_cache.hits");
+        out->push_back(std::to_string(rowCache_->hits()));
+        out->push_back("row_cache.misses");
+        out->push_back(std::to_string(rowCache_->misses()));
+    }
+
+    out->push_back("snapshots");
+    out->push_back(std::to_string(snapshots_.load()));
+    out->push_back("counters.cached");
+    out->push_back(std::to_string(counters_.load()));
+    out->push_back("counters.dirty");
+    out->push_back(std::to_string(dirtyCounters_.load()));
+
+    out->push_back("shards");
+    out->push_back(std::to_string(shards_.size()));
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        auto &shard = shards_[i];
+        std::string name = "shard" + std::to_string(i) + ".";
+
+        out->push_back(name + "path");
+        out->push_back(shard->name);
+
+        uint64_t size;
+        leveldb::Range all("", "\xff");
+        shard->ldb->GetApproximateSizes(&all, 1, &size);
+        out->push_back(name + "approximate_bytes");
+        out->push_back(std::to_string(size));
+
+        // tables per level
+        std::string files, value;
+        for (int level = 0; level < 7; ++level) {
+            if (!shard->ldb->GetProperty("leveldb.num-files-at-level" + std::to_string(level),
+                                         &value))
+                break;
+            if (level > 0)
+                files.append(1, ' ');
+            files.append(value);
+        }
+        out->push_back(name + "files_per_level");
+        out->push_back(files);
+
+        std::lock_guard<std::mutex> lock(shard->writeMutex);
+        out->push_back(name + "writes");
+        out->push_back(std::to_string(shard->writes));
+        out->push_back(name + "write_groups");
+        out->push_back(std::to_string(shard->groups));
+        out->push_back(name + "synced_groups");
+        out->push_back(std::to_string(shard->syncs));
+    }
+}
+
+bool CatchDB::ParseDurability(const std::string &name, Durability *durability)
+{
+    if (name == "none")
+        *durability = Durability::None;
+    else if (name == "everysec")
+        *durability = Durability::EverySec;
+    else if (name == "always")
+        *durability = Durability::Always;
+    else if (name == "default")
+        *durability = Durability::Default;
+    else
+        return false;
+    return true;
+}
+
+/***************** private ***********************/
+
+Status CatchDB::read(const std::string &key, std::string *ret)
+{
+    // the row cache holds the latest values only
+    RowCache *cache = threadSnapshot == nullptr ? rowCache_.get() : nullptr;
+    uint64_t ticket = 0;
+    if (cache && cache->lookup(key, ret, &ticket))
+        return Status::OK;
+
+    size_t shard = ShardIndex(key, shards_.size());
+    leveldb::ReadOptions options;
+    options.snapshot = threadSnapshotOf(shard);
+    leveldb::Status s = shards_[shard]->ldb->Get(options, key, ret);
     if (s.IsNotFound()) {
         return Status::NotFound;
     } else if (!s.ok()) {
         LogError(s.ToString().c_str());
         return Status::Error;
     } else {
+        if (cache)
+            cache->insert(key, *ret, ticket);
         return Status::OK;
     }
 }
 
-Status CatchDB::put(const std::string &key, const std::string &value)
+Status CatchDB::writeBatch(leveldb::WriteBatch *batch)
 {
-    leveldb::Status s = ldb_->Put(leveldb::WriteOptions(), key, value);
-    if (s.ok()) {
-        return Status::OK;
+    Status ret = Status::OK;
+    if (shards_.size() == 1) {
+        ret = write(shards_[0].get(), batch, threadDurability);
     } else {
-        return Status::Error;
+        BatchSplitter splitter(shards_.size());
+        batch->Iterate(&splitter);
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            if (!splitter.used(i))
+                continue;
+            Status s = write(shards_[i].get(), splitter.batch(i), threadDurability);
+            if (s != Status::OK)
+                ret = s;
+        }
     }
+
+    // once written, see RowCache
+    if (rowCache_) {
+        CacheEraser eraser(rowCache_.get());
+        batch->Iterate(&eraser);
+    }
+    return ret;
 }
 
-Status CatchDB::del(const std::string &key)
+CatchDB::Shard* CatchDB::shardOf(const leveldb::Slice &key)
 {
-    leveldb::Status s = ldb_->Delete(leveldb::WriteOptions(), key);
-    if (s.ok()) {
-        return Status::OK;
-    } else {
-        return Status::Error;
+    return shards_[ShardIndex(key, shards_.size())].get();
+}
+
+const leveldb::Snapshot* CatchDB::threadSnapshotOf(size_t shard) const
+{
+    if (threadSnapshot == nullptr)
+        return nullptr;
+    return threadSnapshot->shards[shard].second;
+}
+
+CatchDB::CounterStripe& CatchDB::counterStripeOf(const leveldb::Slice &key)
+{
+    return *counterStripes_[Hash64(key.data(), key.size()) % NUM_COUNTER_STRIPES];
+}
+
+void CatchDB::lockCounters(leveldb::WriteBatch *batch,
+                           std::vector<std::unique_lock<std::mutex>> *locks)
+{
+    KVKeyCollector collector;
+    batch->Iterate(&collector);
+    if (collector.keys.empty())
+        return;
+
+    // in stripe order, against writers locking the same stripes
+    std::vector<std::pair<CounterStripe*, const std::string*>> keys;
+    for (auto &key : collector.keys)
+        keys.push_back(std::make_pair(&counterStripeOf(key), &key));
+    std::sort(keys.begin(), keys.end());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        if (i == 0 || keys[i].first != keys[i - 1].first)
+            locks->push_back(std::unique_lock<std::mutex>(keys[i].first->mutex));
+        dropCounter(keys[i].first, *keys[i].second);
     }
 }
 
-Status CatchDB::putM(leveldb::WriteBatch *batch)
+void CatchDB::dropCounter(CounterStripe *stripe, const std::string &key)
 {
-   leveldb::Status s = ldb_->Write(leveldb::WriteOptions(), batch);
-    if (s.ok()) {
-        return Status::OK;
+    auto it = stripe->counters.find(key);
+    if (it == stripe->counters.end())
+        return;
+    if (it->second.increments > 0)
+        --dirtyCounters_;
+    stripe->counters.erase(it);
+    --counters_;
+}
+
+Status CatchDB::flushCounters(CounterStripe *stripe, bool age)
+{
+    leveldb::WriteBatch batch;
+    bool dirty = false;
+    for (auto &counter : stripe->counters) {
+        if (counter.second.increments > 0) {
+            batch.Put(counter.first, std::to_string(counter.second.value));
+            dirty = true;
+        }
+    }
+    Status s = dirty ? writeBatch(&batch) : Status::OK;
+
+    for (auto it = stripe->counters.begin(); it != stripe->counters.end(); ) {
+        if (s == Status::OK && it->second.increments > 0) {
+            it->second.increments = 0;
+            --dirtyCounters_;
+        }
+        if (!age) {
+            ++it;
+        } else if (it->second.increments == 0 && !it->second.touched) {
+            it = stripe->counters.erase(it);
+            --counters_;
+        } else {
+            it->second.touched = false;
+            ++it;
+        }
+    }
+    return s;
+}
+
+void CatchDB::flushCounters(bool age)
+{
+    for (auto &stripe : counterStripes_) {
+        std::lock_guard<std::mutex> lock(stripe->mutex);
+        if (!stripe->counters.empty())
+            (void) flushCounters(stripe.get(), age);
+    }
+}
+
+void CatchDB::counterLoop()
+{
+    std::unique_lock<std::mutex> lock(syncMutex_);
+    while (!stop_) {
+        syncCv_.wait_for(lock, counterFlush_);
+        if (stop_)
+            break;
+        lock.unlock();
+        flushCounters(true);
+        lock.lock();
+    }
+}
+
+Status CatchDB::getShard(size_t index, const std::vector<std::string> &keys,
+                         const size_t *order, size_t count, bool dense,
+                         std::vector<std::string> *values, std::vector<bool> *found,
+                         const Snapshot *snapshot)
+{
+    Shard *shard = shards_[index].get();
+    leveldb::ReadOptions options;
+    options.snapshot = snapshot ? snapshot->shards[index].second : threadSnapshotOf(index);
+    bool own = options.snapshot == nullptr;
+    if (own)
+        options.snapshot = shard->ldb->GetSnapshot();
+    Status ret = Status::OK;
+
+    if (dense) {
+        std::unique_ptr<leveldb::Iterator> it(shard->ldb->NewIterator(options));
+        for (size_t i = 0; i < count; ++i) {
+            const std::string &key = keys[order[i]];
+            if (i == 0) {
+                it->Seek(key);
+            } else {
+                for (int n = 0; n < MAX_STEPS && it->Valid() &&
+                     it->key().compare(key) < 0; ++n)
+                    it->Next();
+                if (it->Valid() && it->key().compare(key) < 0)
+                    it->Seek(key);
+            }
+            if (!it->Valid())
+                break;
+            if (it->key() == key) {
+                (*values)[order[i]] = it->value().ToString();
+                (*found)[order[i]] = true;
+            }
+        }
+        if (!it->status().ok()) {
+            LogError(it->status().ToString().c_str());
+            ret = Status::Error;
+        }
     } else {
+        for (size_t i = 0; i < count; ++i) {
+            leveldb::Status s = shard->ldb->Get(options, keys[order[i]], &(*values)[order[i]]);
+            if (s.ok()) {
+                (*found)[order[i]] = true;
+            } else if (!s.IsNotFound()) {
+                LogError(s.ToString().c_str());
+                ret = Status::Error;
+                break;
+            }
+        }
+    }
+
+    if (own)
+        shard->ldb->ReleaseSnapshot(options.snapshot);
+    return ret;
+}
+
+Status CatchDB::write(Shard *shard, leveldb::WriteBatch *batch, Durability durability)
+{
+    if (durability == Durability::Default)
+        durability = durability_;
+
+    Writer w(batch, durability);
+    std::unique_lock<std::mutex> lock(shard->writeMutex);
+    shard->writers.push_back(&w);
+    shard->leaderCv.notify_one();
+    while (!w.done && &w != shard->writers.front())
+        w.cv.wait(lock);
+    if (w.done)
+        return w.status;
+
+    // leading a group; let writers on other threads join it first
+    if (window_.count() > 0) {
+        shard->leaderCv.wait_for(lock, window_, [shard] {
+            return shard->writers.size() >= MAX_GROUP_WRITERS;
+        });
+    }
+
+    Writer *last = &w;
+    leveldb::WriteBatch *toWrite = w.batch;
+    Durability strictest = durability;
+    if (shard->writers.size() > 1) {
+        shard->group.Clear();
+        BatchCopier copier(&shard->group);
+        for (auto writer : shard->writers) {
+            if (writer != &w && copier.bytes() >= MAX_GROUP_BYTES)
+                break;
+            writer->batch->Iterate(&copier);
+            strictest = std::max(strictest, writer->durability);
+            last = writer;
+        }
+        toWrite = &shard->group;
+    }
+    leveldb::WriteOptions options;
+    options.sync = strictest == Durability::Always;
+
+    // writers arriving meanwhile queue up for the next group
+    lock.unlock();
+    leveldb::Status s = shard->ldb->Write(options, toWrite);
+    lock.lock();
+
+    ++shard->groups;
+    Status ret = Status::OK;
+    if (!s.ok()) {
         LogError(s.ToString().c_str());
-        return Status::Error;
+        ret = Status::Error;
+    } else if (options.sync) {
+        // the log is synced up to here
+        ++shard->syncs;
+        shard->unsynced = false;
+    } else if (strictest == Durability::EverySec) {
+        shard->unsynced = true;
+    }
+
+    // release the group, replies go out only now
+    while (true) {
+        Writer *writer = shard->writers.front();
+        shard->writers.pop_front();
+        ++shard->writes;
+        if (writer != &w) {
+            writer->status = ret;
+            writer->done = true;
+            writer->cv.notify_one();
+        }
+        if (writer == last)
+            break;
     }
+    if (!shard->writers.empty())
+        shard->writers.front()->cv.notify_one();
+
+    return ret;
 }
 
-Iterator* CatchDB::newIterator(const std::string &prefix, 
-                               const std::string &exclude)
+void CatchDB::syncLoop()
 {
-    return new Iterator(ldb_, prefix, exclude);
+    std::unique_lock<std::mutex> lock(syncMutex_);
+    while (!stop_) {
+        syncCv_.wait_for(lock, std::chrono::seconds(1));
+        if (stop_)
+            break;
+
+        for (auto &shard : shards_) {
+            bool unsynced;
+            {
+                std::lock_guard<std::mutex> writeLock(shard->writeMutex);
+                unsynced = shard->unsynced;
+            }
+            // a synced write, even an empty one, syncs the whole log
+            if (unsynced) {
+                leveldb::WriteBatch empty;
+                (void) write(shard.get(), &empty, Durability::Always);
+            }
+        }
+    }
 }
 
 CatchDBPtr CatchDB::Open(const ConfigPtr &config)
 {
     leveldb::Options options;
     options.create_if_missing = true;
+    options.comparator = &comparator;
     options.filter_policy = leveldb::NewBloomFilterPolicy(10);
     options.block_cache = leveldb::NewLRUCache(config->cacheSize * 1048576);
     options.block_size = config->blockSize * 1024;
@@ -80,15 +863,44 @@ CatchDBPtr CatchDB::Open(const ConfigPtr &config)
     } else {
         options.compression = leveldb::kNoCompression;
     }
-    options.comparator = new AggregateComparator;
 
-    std::string dbName = config->dbPath + config->dbName;
-    leveldb::DB *db;
-    auto status = leveldb::DB::Open(options, dbName, &db);
-    if (!status.ok())
-        return nullptr;
+    // a single shard keeps the plain database name
+    std::vector<leveldb::DB*> dbs;
+    std::vector<std::string> names;
+    for (int i = 0; i < config->shards; ++i) {
+        std::string dbName = config->dbPath + config->dbName;
+        if (config->shards > 1)
+            dbName += "." + std::to_string(i);
+        std::string layout = std::to_string(i) + "/" + std::to_string(config->shards);
+
+        leveldb::DB *db = nullptr;
+        auto status = leveldb::DB::Open(options, dbName, &db);
+        if (!status.ok()) {
+            // databases of the AggregateComparator era fail here
+            LogError("%s; convert databases of an older key format with catchdb-migrate",
+                     status.ToString().c_str());
+        } else if (CheckFormat(db, layout) != Status::OK) {
+            delete db;
+            db = nullptr;
+        }
+        if (db == nullptr) {
+            for (auto opened : dbs)
+                delete opened;
+            return nullptr;
+        }
+        dbs.push_back(db);
+        names.push_back(dbName);
+    }
 
-    return CatchDBPtr(new CatchDB(db, dbName));
+    CatchDBPtr catchdb(new CatchDB(dbs, names));
+    catchdb->window_ = std::chrono::microseconds(config->groupCommitWindow);
+    if (config->rowCache > 0)
+        catchdb->rowCache_.reset(new RowCache(config->rowCache * 1048576UL));
+    ParseDurability(config->durability, &catchdb->durability_);
+    catchdb->counterFlush_ = std::chrono::milliseconds(config->counterFlush);
+    if (config->counterFlush > 0)
+        catchdb->counterFlusher_ = std::thread(&CatchDB::counterLoop, catchdb.get());
+    return catchdb;
 }
 
 } // namespace catchdb
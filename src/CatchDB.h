@@ -2,10 +2,19 @@
 
 #include <memory>
 #include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <thread>
+#include <atomic>
 #include "leveldb/db.h"
+#include "leveldb/write_batch.h"
 #include "Status.h"
 #include "Config.h"
 #include "Iterator.h"
+#include "RowCache.h"
 
 namespace catchdb
 {
@@ -13,28 +22,162 @@ namespace catchdb
 class CatchDB;
 typedef std::shared_ptr<CatchDB> CatchDBPtr;
 
-class CatchDB
+// One point in time of every shard, released with the last reference.
+// Shards are snapshotted one after another, so it is one point in time
+// per shard; writes never span shards atomically either.
+struct Snapshot
+{
+    CatchDBPtr db; // keeps the shards open
+    std::vector<std::pair<leveldb::DB*, const leveldb::Snapshot*>> shards;
+    // unique, also across restarts, so a size record can name the base
+    // snapshot of its blind writes
+    uint64_t id;
+
+    ~Snapshot();
+};
+typedef std::shared_ptr<Snapshot> SnapshotPtr;
+
+// The record holding the version of the key format. Keys order under
+// memcmp (KeyComparator) since version 2, version 1 databases
+// (AggregateComparator) are converted by catchdb-migrate.
+const char FORMAT_VERSION_KEY[] = "V";
+const char FORMAT_VERSION[] = "2";
+// The record holding "<shard>/<shards>", which shard of how many a
+// database is; records are routed by a hash that depends on the count.
+const char SHARD_KEY[] = "S";
+
+// when a write reaches the disk
+enum class Durability
+{
+    Default,  // the configured mode
+    None,     // whenever the OS flushes it
+    EverySec, // within about a second
+    Always    // before the write returns
+};
+
+// The keyspace is split over one or more leveldb instances (shards), each
+// with its own memtable, log, compaction thread and group commit queue.
+// All records of a container live on one shard, chosen by a hash of the
+// container's name, KV records by a hash of the key. Commands on one
+// container touch one shard; KV commands on many keys and KV scans visit
+// every shard, without a snapshot or an atomic write across them.
+class CatchDB : public std::enable_shared_from_this<CatchDB>
 {
 public:
-    CatchDB(leveldb::DB *db, const std::string &name);
+    CatchDB(const std::vector<leveldb::DB*> &dbs, const std::vector<std::string> &names);
     ~CatchDB();
 
     static CatchDBPtr Open(const ConfigPtr &config);
 
+    // "none", "everysec", "always" or "default"; false if unknown
+    static bool ParseDurability(const std::string &name, Durability *durability);
+
+    // Durability of the writes the calling thread issues; Client sets it
+    // for each command from the connection's choice.
+    static thread_local Durability threadDurability;
+
+    // Snapshot the reads of the calling thread see, null for the latest
+    // data; Client sets it for read commands of a connection holding one.
+    static thread_local const Snapshot *threadSnapshot;
+
     CatchDB(const CatchDB&) = delete;
     CatchDB& operator=(const CatchDB&) = delete;
 
+    // served from the row cache when enabled and the key is in it,
+    // unless read at a snapshot
     Status get(const std::string &key, std::string *ret);
-    Status put(const std::string &key, const std::string &value);
+    Status put(const std::string &key, const leveldb::Slice &value);
     Status del(const std::string &key);
+    // Writes from concurrent threads are merged into groups, each one
+    // leveldb write, synced if any of them needs Always; a call returns
+    // once the group holding its write is done. A batch spanning shards
+    // is one write per shard.
     Status putM(leveldb::WriteBatch *batch);
 
-    Iterator* newIterator(const std::string &prefix, 
-                          const std::string &exclude="");
+    // Read @keys from one snapshot per shard, @snapshot or threadSnapshot
+    // if set, in key order. Set
+    // (*values)[i] to the value of keys[i] and (*found)[i] to whether it
+    // exists. With @dense one iterator walks the sorted keys, which beats
+    // a Get per key when few other records lie between them.
+    Status getM(const std::vector<std::string> &keys, bool dense,
+                std::vector<std::string> *values, std::vector<bool> *found,
+                const Snapshot *snapshot = nullptr);
+
+    // Add @delta to the integer in the value of KV record @key, 0 if none,
+    // and set @value to the sum; InvalidParameter if the value is no
+    // integer or the sum overflows. Increments are atomic, also against
+    // other writes of the key. With counter_flush they are coalesced in
+    // memory, unless the write is Always durable; get() reads them there,
+    // multi-key reads, KV cursors and snapshot() write them out first.
+    Status incr(const std::string &key, int64_t delta, int64_t *value);
+
+    // cursor over the records whose keys start with @prefix, at
+    // threadSnapshot if set
+    Iterator* newIterator(const std::string &prefix,
+                          Iterator::Direction direction = Iterator::Direction::Forward);
+
+    // name and value pairs describing each shard
+    void info(std::vector<std::string> *out);
+
+    // the current state of the database, kept readable while referenced
+    SnapshotPtr snapshot();
+
 private:
+    friend struct Snapshot;
+    struct Writer;
+    struct Shard;
+    struct CounterStripe;
+
+    Shard* shardOf(const leveldb::Slice &key);
+    // the snapshot of @shard in threadSnapshot, null if none
+    const leveldb::Snapshot* threadSnapshotOf(size_t shard) const;
+    Status getShard(size_t shard, const std::vector<std::string> &keys,
+                    const size_t *order, size_t count, bool dense,
+                    std::vector<std::string> *values, std::vector<bool> *found,
+                    const Snapshot *snapshot);
+    Status write(Shard *shard, leveldb::WriteBatch *batch, Durability durability);
+    // syncs the logs once a second while EverySec writes are unsynced
+    void syncLoop();
+
+    // get() past the counters
+    Status read(const std::string &key, std::string *ret);
+    // putM() with the counter stripes of its keys locked
+    Status writeBatch(leveldb::WriteBatch *batch);
+    CounterStripe& counterStripeOf(const leveldb::Slice &key);
+    // Lock the stripes of the KV keys in @batch and drop their counters,
+    // which @batch overwrites; held until the batch is written.
+    void lockCounters(leveldb::WriteBatch *batch,
+                      std::vector<std::unique_lock<std::mutex>> *locks);
+    void dropCounter(CounterStripe *stripe, const std::string &key);
+    // Write the coalesced counters of @stripe, under its mutex. With @age
+    // forget those not incremented since the last aging flush.
+    Status flushCounters(CounterStripe *stripe, bool age);
+    void flushCounters(bool age = false);
+    // flushes the counters every counter_flush ms
+    void counterLoop();
+
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::unique_ptr<RowCache> rowCache_; // null if disabled
+
+    // group commit
+    std::chrono::microseconds window_;
+    Durability durability_;
+
+    std::vector<std::unique_ptr<CounterStripe>> counterStripes_;
+    std::chrono::milliseconds counterFlush_; // 0 writes every increment
+    std::atomic<size_t> counters_; // in memory
+    std::atomic<size_t> dirtyCounters_; // not written yet
+    // Snapshots alive, of connections and of blind writes; leveldb keeps
+    // the versions they see through compactions.
+    std::atomic<size_t> snapshots_;
+    // from the clock at open, see Snapshot::id
+    std::atomic<uint64_t> nextSnapshotId_;
 
-    leveldb::DB *ldb_;
-    std::string name_;
+    bool stop_;
+    std::mutex syncMutex_;
+    std::condition_variable syncCv_;
+    std::thread syncer_;
+    std::thread counterFlusher_;
 };
 
 } // namespace catchdb
@@ -3,124 +3,290 @@
 #include "Networking.h"
 #include "Util.h"
 #include "KV.h"
+#include "Registry.h"
+#include "Logger.h"
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <cassert>
 #include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <utility>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 namespace catchdb
 {
 
-std::map<int, ClientPtr>  Client::clients;
-
-ClientPtr Client::CreateClient(int fd, const std::string &ipstr, uint16_t port)
+namespace
 {
-    if (clients.find(fd) != clients.end()) {
-        return clients[fd];
-    }
+std::unique_ptr<Registry<HashMap>> hashMaps;
+std::unique_ptr<Registry<Queue>> queues;
+std::unique_ptr<Registry<ZSet>> zsets;
+
+// folds idle blind writes every foldAge, see InitContainers
+std::thread folder;
+std::mutex folderMutex;
+std::condition_variable folderCv;
+bool folderStop = false;
+
+// container objects of each kind a connection keeps for its snapshot
+const size_t MAX_SNAPSHOT_OBJECTS = 16;
+
+// The object of container @name in @objects, created when missing. It
+// follows the shared object in @registry, if cached, for the blind writes
+// pending at the snapshot.
+template <typename T>
+std::shared_ptr<T> SnapshotObject(std::map<std::string, std::shared_ptr<T>> *objects,
+                                  Registry<T> *registry, const CatchDBPtr &db,
+                                  const std::string &name)
+{
+    auto it = objects->find(name);
+    if (it != objects->end())
+        return it->second;
+    if (objects->size() >= MAX_SNAPSHOT_OBJECTS)
+        objects->clear();
+    std::shared_ptr<T> obj(new T(db, name));
+    obj->follow(registry->find(name));
+    (*objects)[name] = obj;
+    return obj;
+}
+} // namespace
 
-    clients[fd] = ClientPtr(new Client(fd, ipstr, port));
+Client *Client::slab_ = nullptr;
+int Client::slabSize_ = 0;
+std::atomic<int> Client::numClients_(0);
 
-    return clients[fd];
+void Client::InitClients(int maxfds)
+{
+    assert(slab_ == nullptr);
+    slab_ = new Client[maxfds];
+    slabSize_ = maxfds;
 }
 
-void Client:: DestroyClient(int fd)
+Client* Client::CreateClient(int fd, const std::string &ipstr, uint16_t port,
+                             int maxQueryBuffer, void *context)
 {
-    clients.erase(fd);
+    if (fd < 0 || fd >= slabSize_)
+        return nullptr;
+
+    Client *client = &slab_[fd];
+    assert(client->fd_ == -1);
+    client->open(fd, ipstr, port, maxQueryBuffer, context);
+    ++numClients_;
+    return client;
 }
 
-ClientPtr Client::GetClient(int fd)
+void Client::DestroyClient(Client *client)
 {
-    return clients[fd];
+    client->close();
+    --numClients_;
 }
 
 int Client::NumberOfClients()
 {
-    return clients.size();
+    return numClients_;
 }
 
-Status Client::processQuery()
+void Client::InitContainers(size_t capacity, std::chrono::milliseconds foldAge)
 {
-    int len = read();
-    if (len == -2) {
-        return Status::Progress;
-    } else if (len == 0) {
-        return Status::Close;
-    } else if (len == -1) {
-        return Status::Error;
+    hashMaps.reset(new Registry<HashMap>(capacity));
+    queues.reset(new Registry<Queue>(capacity));
+    zsets.reset(new Registry<ZSet>(capacity));
+
+    if (foldAge == std::chrono::milliseconds::zero())
+        return;
+    folder = std::thread([foldAge]() {
+        std::unique_lock<std::mutex> lock(folderMutex);
+        while (!folderStop) {
+            folderCv.wait_for(lock, foldAge);
+            if (folderStop)
+                break;
+            lock.unlock();
+            FoldContainers(foldAge);
+            lock.lock();
+        }
+    });
+}
+
+void Client::ReleaseContainers()
+{
+    {
+        std::lock_guard<std::mutex> lock(folderMutex);
+        folderStop = true;
     }
+    folderCv.notify_all();
+    if (folder.joinable())
+        folder.join();
+
+    FoldContainers(std::chrono::steady_clock::duration::zero());
+    hashMaps.reset();
+    queues.reset();
+    zsets.reset();
+}
 
-    int size = queryBuf_.size();
-    req_ = Request::ParseRequest(queryBuf_.data(), &size, req_);
-    queryBuf_.decr(size);
+void Client::FoldContainers(std::chrono::steady_clock::duration age)
+{
+    // queues make no blind writes
+    hashMaps->forEach([age](HashMap &h) { (void) h.foldOlder(age); });
+    zsets->forEach([age](ZSet &z) { (void) z.foldOlder(age); });
+}
 
-    switch (req_->state) {
-        case Request::State::Complete: {
-            queryBuf_.reset();
-            return Status::OK;
+Status Client::processQuery()
+{
+    while (true) {
+        if (queryBuf_.full()) {
+            // execute what we have first and come back for the rest
+            if (numRequests_ > 0)
+                break;
+
+            if (!growQuery())
+                return Status::Error;
+        }
+
+        int len = read();
+        if (len == -2) {
+            break;
+        } else if (len == 0) {
+            return Status::Close;
+        } else if (len == -1) {
+            return Status::Error;
         }
-        case Request::State::Partial: {
-            return Status::Progress;
+
+        if (parseQuery() != Status::OK)
+            return Status::Error;
+
+        // read() stops short of a full buffer only when the socket is drained
+        if (!queryBuf_.full())
+            break;
+    }
+
+    return numRequests_ == 0 ? Status::Progress : Status::OK;
+}
+
+Status Client::takeQuery(const char *data, int len, int *taken)
+{
+    *taken = 0;
+    while (*taken < len) {
+        if (queryBuf_.full()) {
+            if (numRequests_ > 0)
+                break;
+            if (!growQuery())
+                return Status::Error;
         }
-        case Request::State::Error:
+
+        int n = std::min(queryBuf_.avail(), len - *taken);
+        memcpy(queryBuf_.tail(), data + *taken, n);
+        queryBuf_.incr(n);
+        *taken += n;
+        if (parseQuery() != Status::OK)
             return Status::Error;
     }
+
+    return numRequests_ == 0 ? Status::Progress : Status::OK;
 }
 
 Status Client::executeCommand(const CatchDBPtr db)
 {
-    // guarantee that executeCommand is called after processQuery
-    assert(req_ != nullptr);
-    assert(req_->state != Request::State::Error);
+    // guarantee that executeCommand is called after processQuery;
+    // replies of all pipelined requests are appended in order
+    for (size_t i = 0; i < numRequests_; ++i) {
+        execute(db, requests_[i]);
+        requests_[i]->reset();
+    }
+
+    // the partial request, if any, moves to the front
+    std::swap(requests_[0], requests_[numRequests_]);
+    numRequests_ = 0;
+
+    queryBuf_.consume(parsedBytes_);
+    parsedBytes_ = 0;
+    return Status::OK;
+}
+
+size_t Client::affinity() const
+{
+    // a pipelined batch runs as a whole, keyed by its first command
+    if (numRequests_ == 0 || requests_[0]->blocks.size() < 2)
+        return fd_;
+
+    auto &req = requests_[0];
+    auto it = cmdMap.find(req->blocks[0].ToString());
+    if (it == cmdMap.end() || it->second.category == Category::KV ||
+        it->second.category == Category::Server)
+        return fd_;
+    return std::hash<std::string>()(req->blocks[1].ToString());
+}
 
-    if (req_->state == Request::State::Partial)
-        return Status::Progress; // harmless
+Status Client::writeResult()
+{
+    return reply_.send(fd_);
+}
 
-    std::string cmd = req_->blocks[0];
-    if (cmdMap.find(cmd) == cmdMap.end()) {
+/***************** private ***********************/
+
+void Client::execute(const CatchDBPtr &db, const RequestPtr &req)
+{
+    assert(req->state == Request::State::Complete);
+
+    if (req->blocks.empty()) {
+        addResponse(ResponseStatus::ClientError, "Empty request");
+        return;
+    }
+
+    auto cmd = cmdMap.find(req->blocks[0].ToString());
+    if (cmd == cmdMap.end()) {
         addResponse(ResponseStatus::ClientError, "Unknown command");
-        req_ = nullptr;
-        return Status::OK;
+        return;
     } 
 
-    if (!BeginWith(req_->blocks[0], "multi_") &&
-        req_->blocks.size() != cmdMap[cmd].numReqBlks) {
+    bool multi = req->blocks[0].starts_with("multi_");
+    if ((!multi && req->blocks.size() != cmd->second.numReqBlks) ||
+        (multi && req->blocks.size() < cmd->second.numReqBlks)) {
         addResponse(ResponseStatus::ClientError, "Wrong number of arguments");
-        req_ = nullptr;
-        return Status::OK;
+        return;
     }
 
     Response resp;
-    Status s;
-    switch (cmdMap[cmd].category) {
+    Status s = Status::NotImplemented;
+    CatchDB::threadDurability = durability_;
+    // Reads of a connection holding a snapshot see it, through container
+    // objects of their own, kept until the snapshot goes: the shared ones
+    // cache the latest metadata.
+    // Writes always apply to the latest data.
+    bool atSnapshot = snapshot_ && cmd->second.property == Property::Read;
+    CatchDB::threadSnapshot = atSnapshot ? snapshot_.get() : nullptr;
+    switch (cmd->second.category) {
         case Category::KV: {
-            s = KV::process(db, req_, &resp);
+            s = KV::process(db, req, &resp);
             break;
         }
         case Category::HashMap: {
-            auto name = req_->blocks[1];
-            if (hashMaps_.find(name) == hashMaps_.end()) {
-                hashMaps_[name] =  HashMapPtr(new HashMap(db, name));
-            }
-            s = hashMaps_[name]->process(req_, &resp);
+            auto name = req->blocks[1].ToString();
+            auto hashMap = atSnapshot ? SnapshotObject(&snapshotHashMaps_, hashMaps.get(), db, name)
+                                      : hashMaps->get(db, name);
+            s = hashMap->process(req, &resp);
             break;
         }
         case Category::Queue: {
-            auto key = req_->blocks[1];
-            if (queues_.find(key) == queues_.end()) {
-                queues_[key] =  QueuePtr(new Queue(db, key));
-            }
-            s = queues_[key]->process(req_, &resp);
+            auto name = req->blocks[1].ToString();
+            auto queue = atSnapshot ? SnapshotObject(&snapshotQueues_, queues.get(), db, name)
+                                    : queues->get(db, name);
+            s = queue->process(req, &resp);
             break;
         }
         case Category::ZSet: {
-            auto name = req_->blocks[1];
-            if (zsets_.find(name) == zsets_.end()) {
-                zsets_[name] =  ZSetPtr(new ZSet(db, name));
-            }
-            s = zsets_[name]->process(req_, &resp);
+            auto name = req->blocks[1].ToString();
+            auto zset = atSnapshot ? SnapshotObject(&snapshotZSets_, zsets.get(), db, name)
+                                   : zsets->get(db, name);
+            s = zset->process(req, &resp);
+            break;
+        }
+        case Category::Server: {
+            s = executeServer(db, req, &resp);
             break;
-
         }
     }
     ResponseStatus rs;
@@ -154,38 +320,82 @@ Status Client::executeCommand(const CatchDBPtr db)
             rs = ResponseStatus::Error;
             break;
     }
-    addResponse(rs, resp);
-
-    req_ = nullptr;
-    return Status::OK;
+    addResponse(rs, std::move(resp));
 }
 
-Status Client::writeResult()
+
+Status Client::executeServer(const CatchDBPtr &db, const RequestPtr &req, ResponsePtr resp)
 {
-    int toSend = replyBuf_.size() - writePos_;
-    int sent = ::send(fd_, replyBuf_.data() + writePos_, toSend, 0);
-    if (sent < 0) {
-        return Status::Error;
-    } else if (sent < toSend) {
-        return Status::Progress;
-    } else {
-        replyBuf_.clear();
+    if (req->blocks[0] == "durability") {
+        if (!CatchDB::ParseDurability(req->blocks[1].ToString(), &durability_)) {
+            resp->push_back("durability is none, everysec, always or default");
+            return Status::InvalidParameter;
+        }
+        return Status::OK;
+    }
+    if (req->blocks[0] == "info") {
+        db->info(resp);
+        return Status::OK;
+    }
+    if (req->blocks[0] == "snapshot") {
+        // a second one replaces the first
+        releaseSnapshot();
+        CatchDB::threadSnapshot = nullptr; // pointed at the one released
+        snapshot_ = db->snapshot();
+        return Status::OK;
+    }
+    if (req->blocks[0] == "release") {
+        releaseSnapshot();
         return Status::OK;
     }
+    return Status::NotImplemented;
 }
 
-/***************** private ***********************/
+bool Client::growQuery()
+{
+    // a single request outgrew its segment
+    if (!queryBuf_.reserve(parsedBytes_, requests_[0]->expected())) {
+        LogError("request from %s:%d exceeds max_query_buffer",
+                 ipstr_.c_str(), port_);
+        return false;
+    }
+    return true;
+}
+
+Status Client::parseQuery()
+{
+    // pipelining: take every complete request in the buffer, a trailing
+    // partial one is resumed on the next read. Requests are parsed in
+    // place, the buffer is consumed once they have been executed.
+    while (true) {
+        if (numRequests_ == requests_.size())
+            requests_.push_back(RequestPtr(new Request));
+
+        auto &req = requests_[numRequests_];
+        auto state = req->parse(queryBuf_.data() + parsedBytes_,
+                                queryBuf_.size() - parsedBytes_);
+        if (state == Request::State::Error)
+            return Status::Error;
+        if (state == Request::State::Partial)
+            return Status::OK;
+
+        parsedBytes_ += req->length;
+        ++numRequests_;
+    }
+}
 
 int Client::read()
 {
-    int ret = -2; // progress
+    int ret = 0;
 
+    readable_ = true;
     while (!queryBuf_.full()) {
         int len = ::recv(fd_, queryBuf_.tail(), queryBuf_.avail(), 0);
         if (len == -1) {
             if (errno == EINTR) {
                 continue;
             } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                readable_ = false;
                 break;
             } else {
                 return -1;
@@ -197,7 +407,7 @@ int Client::read()
             queryBuf_.incr(len);
         }
     }
-    return ret;
+    return ret > 0 ? ret : -2; // -2: nothing new yet
 }
 
 std::array<const char*, 5> Client::statusDesc = {
@@ -206,45 +416,79 @@ std::array<const char*, 5> Client::statusDesc = {
 
 void Client::addResponse(ResponseStatus status, const std::string &resp)
 {
-    replyBuf_.append(statusDesc[static_cast<size_t>(status)]);
-    if (!resp.empty()) {
-        replyBuf_.append(std::to_string(resp.size()));
-        replyBuf_.append(1, '\n');
-        replyBuf_.append(resp);
-        replyBuf_.append(1, '\n');
-    }
-    replyBuf_.append(1, '\n');
+    const char *desc = statusDesc[static_cast<size_t>(status)];
+    reply_.appendStatic(desc, strlen(desc));
+    if (!resp.empty())
+        reply_.appendBlock(leveldb::Slice(resp));
+    reply_.appendStatic("\n", 1);
 }
 
-void Client::addResponse(ResponseStatus status, const Response &resp)
+void Client::addResponse(ResponseStatus status, Response &&resp)
 {
-    replyBuf_.append(statusDesc[static_cast<size_t>(status)]);
-    if (!resp.empty()) {
-        for (auto &s : resp) {
-            replyBuf_.append(std::to_string(s.size()));
-            replyBuf_.append(1, '\n');
-            replyBuf_.append(s);
-            replyBuf_.append(1, '\n');
-        }
-    }
-    replyBuf_.append(1, '\n');
+    const char *desc = statusDesc[static_cast<size_t>(status)];
+    reply_.appendStatic(desc, strlen(desc));
+    for (auto &s : resp)
+        reply_.appendBlock(std::move(s));
+    reply_.appendStatic("\n", 1);
 }
 
 
-Client::Client(int fd, const std::string &ipstr, uint16_t port)
-    : fd_(fd), ipstr_(ipstr), port_(port), 
-      queryBuf_(QUERY_BUF_SIZE),
-      req_(nullptr), 
-      writePos_(0)
+Client::Client()
+    : fd_(-1), context_(nullptr), port_(0),
+      queryBuf_(0),
+      numRequests_(0),
+      parsedBytes_(0),
+      readable_(true),
+      durability_(Durability::Default)
 {}
 
 
 Client::~Client()
 {
-    if (fd_) {
-        close(fd_);
+    if (fd_ >= 0) {
+        ::close(fd_);
     }
 }
 
+void Client::open(int fd, const std::string &ipstr, uint16_t port, int maxQueryBuffer,
+                  void *context)
+{
+    fd_ = fd;
+    context_ = context;
+    ipstr_ = ipstr;
+    port_ = port;
+    queryBuf_.reset(maxQueryBuffer);
+    numRequests_ = 0;
+    parsedBytes_ = 0;
+    readable_ = true;
+    durability_ = Durability::Default;
+    releaseSnapshot();
+}
+
+void Client::close()
+{
+    ::close(fd_);
+    fd_ = -1;
+    context_ = nullptr;
+
+    // keep what the slot allocated for its next connection, except
+    // buffered data
+    queryBuf_.reset(0);
+    for (auto &req : requests_)
+        req->reset();
+    numRequests_ = 0;
+    parsedBytes_ = 0;
+    reply_.clear();
+    releaseSnapshot();
+}
+
+void Client::releaseSnapshot()
+{
+    snapshotHashMaps_.clear();
+    snapshotQueues_.clear();
+    snapshotZSets_.clear();
+    snapshot_.reset();
+}
+
 
 } // namespace catchdb
@@ -2,85 +2,152 @@
 
 #include <string>
 #include <map>
+#include <vector>
 #include <array>
 #include <tuple>
 #include <memory>
+#include <atomic>
+#include <chrono>
 #include "HashMap.h"
 #include "ZSet.h"
 #include "Queue.h"
 #include "Protocol.h"
 #include "Status.h"
 #include "Buffer.h"
+#include "Reply.h"
 #include "CatchDB.h"
 
 namespace catchdb
 {
 
-namespace 
-{
-const int QUERY_BUF_SIZE = 8 * 1024;
-const int REPLY_BUF_SIZE = 16 * 1024;
-} // namespace
-
-class Client;
-typedef std::shared_ptr<Client> ClientPtr;
-
 class Client
 {
 public:
-    Client(int fd, const std::string &ipstr, uint16_t port);
+    // a free slot
+    Client();
 
     ~Client();
 
-    // fd serves as identifier of the clients
-    static ClientPtr CreateClient(int fd, const std::string &ipstr, uint16_t port);
+    // Preallocate a slot per fd below @maxfds, the fd indexes them. Called
+    // once before any event loop starts; every loop takes slots for the
+    // fds it accepts, so no lookup or lock is needed later on.
+    static void InitClients(int maxfds);
 
-    static void  DestroyClient(int fd);
+    // Take the slot of @fd, nullptr if fd is beyond the slab. @context
+    // is kept for the event handlers.
+    // @maxQueryBuffer bounds the size of received but unexecuted requests
+    static Client* CreateClient(int fd, const std::string &ipstr, uint16_t port,
+                                int maxQueryBuffer, void *context);
 
-    static ClientPtr GetClient(int fd);
+    // close the connection and recycle the slot
+    static void DestroyClient(Client *client);
 
     static int NumberOfClients();
 
-    static std::map<int, ClientPtr>  clients;
+    // Container objects are shared by all clients, at most @capacity of
+    // each kind are kept. Blind writes are folded in the background once
+    // their base snapshot is @foldAge old, never if zero. Called once
+    // before any event loop starts.
+    static void InitContainers(size_t capacity, std::chrono::milliseconds foldAge);
 
+    // stops the background folding, folds what is left and drops the
+    // objects, once the event loops are done
+    static void ReleaseContainers();
+
+    // folds the blind writes of the shared container objects whose base
+    // snapshot is older than @age, so no snapshot stays pinned while idle
+    static void FoldContainers(std::chrono::steady_clock::duration age);
+
+    int getFd() const { return fd_; }
+    void* context() const { return context_; }
     std::string getRemoteIPString() const { return ipstr_; }
     uint16_t getRemotePort() const { return port_; }
 
+    // read and parse every complete request available, returns OK when
+    // at least one is ready to be executed
     Status processQuery();
 
+    // Like processQuery, on @len bytes at @data the caller received: takes
+    // as many as the query buffer holds, *@taken tells how many. The rest
+    // is for a call once the requests parsed have been executed.
+    Status takeQuery(const char *data, int len, int *taken);
+
+    // execute all parsed requests, replies are queued in order
     Status executeCommand(CatchDBPtr db);
 
+    // commands on the same container share an affinity, so a worker
+    // pool keeps them in order
+    size_t affinity() const;
+
     Status writeResult();
 
+    // the reply not written yet, for a caller that writes it itself, and
+    // how many bytes of it were
+    const struct iovec* pendingResult(size_t *count) const { return reply_.pending(count); }
+    void resultWritten(size_t len) { reply_.advance(len); }
+
+    // false once a read found the socket drained
+    bool readable() const { return readable_; }
+
     // non-copyable
     Client(const Client&) = delete;
     Client& operator=(const Client&) = delete;
 
 private:
+    void open(int fd, const std::string &ipstr, uint16_t port, int maxQueryBuffer,
+              void *context);
+    void close();
+
     int read();
+    // Make room in a full query buffer for the request being received,
+    // false if it exceeds max_query_buffer.
+    bool growQuery();
+    // parse the requests received, in place
+    Status parseQuery();
+
+    void execute(const CatchDBPtr &db, const RequestPtr &req);
+    // Category::Server commands
+    Status executeServer(const CatchDBPtr &db, const RequestPtr &req, ResponsePtr resp);
+    // drop snapshot_ and the container objects reading at it
+    void releaseSnapshot();
 
     enum class ResponseStatus { OK = 0, NotFound = 1, Error = 2, Fail = 3, ClientError = 4 };
     static std::array<const char*, 5> statusDesc;
 
     void addResponse(ResponseStatus status, const std::string &resp);
 
-    void addResponse(ResponseStatus status, const Response &resp);
+    // blocks of @resp are moved into the reply
+    void addResponse(ResponseStatus status, Response &&resp);
+
+    static Client *slab_;
+    static int slabSize_;
+    static std::atomic<int> numClients_;
 
-    int fd_;
+    int fd_; // -1: the slot is free
+    void *context_;
 
     // peer end addr and port 
     std::string ipstr_;
     uint16_t port_;
 
     Buffer queryBuf_;
-    RequestPtr req_;
-    std::string replyBuf_;
-    int writePos_;
-
-// add some expire or lru mechanism
-    std::map<std::string, QueuePtr> queues_;
-    std::map<std::string, HashMapPtr> hashMaps_;
-    std::map<std::string, ZSetPtr> zsets_;
+    // requests parsed in place, reused across queries: the first
+    // numRequests_ are complete, the next one may be partial
+    std::vector<RequestPtr> requests_;
+    size_t numRequests_;
+    int parsedBytes_; // bytes of queryBuf_ the complete requests span
+    bool readable_;
+    ReplyBuffer reply_;
+    // of this connection's writes, set by the durability command
+    Durability durability_;
+    // what the reads of this connection see, set by the snapshot command
+    // and dropped by release or when the connection closes
+    SnapshotPtr snapshot_;
+    // Container objects of the reads at snapshot_, by name, so a run of
+    // reads on a container loads its metadata once.
+    std::map<std::string, HashMapPtr> snapshotHashMaps_;
+    std::map<std::string, QueuePtr> snapshotQueues_;
+    std::map<std::string, ZSetPtr> snapshotZSets_;
 };
 
 
@@ -1,17 +1,114 @@
 #include "Config.h"
+#include <fstream>
+#include <sstream>
 
 namespace catchdb
 {
 
+namespace
+{
+
+bool ParseBool(const std::string &value)
+{
+    return value == "yes" || value == "true" || value == "1";
+}
+
+} // namespace
+
+// Config file consists of "key value" lines, '#' starts a comment.
+// A missing file leaves every option at its default.
 ConfigPtr Config::load(const std::string &configFileName)
 {
-    // not implemented yet, just for test purpose
-    (void) configFileName;
     ConfigPtr config(new Config());
     config->cacheSize = 500;
     config->blockSize = 32;
     config->writeBufferSize = 64;
 
+    std::ifstream in(configFileName);
+    if (!in.is_open())
+        return config;
+
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream ss(line);
+        std::string key, value;
+        if (!(ss >> key) || key[0] == '#')
+            continue;
+        if (!(ss >> value))
+            return nullptr;
+
+        try {
+            if (key == "dbname") {
+                config->dbName = value;
+            } else if (key == "dbpath") {
+                config->dbPath = value;
+            } else if (key == "logfile") {
+                config->logFile = value;
+            } else if (key == "loglevel") {
+                config->logLevel = Logger::getLevelFromString(value.c_str());
+            } else if (key == "pidfile") {
+                config->pidFile = value;
+            } else if (key == "port") {
+                config->port = value;
+            } else if (key == "bind") {
+                config->bindAddresses.push_back(value);
+            } else if (key == "backlog") {
+                config->backlog = std::stoi(value);
+            } else if (key == "max_clients") {
+                config->maxClients = std::stoi(value);
+            } else if (key == "cache_size") {
+                config->cacheSize = std::stoi(value);
+            } else if (key == "block_size") {
+                config->blockSize = std::stoi(value);
+            } else if (key == "write_buffer_size") {
+                config->writeBufferSize = std::stoi(value);
+            } else if (key == "compaction_speed") {
+                config->compactionSpeed = std::stoi(value);
+            } else if (key == "compression") {
+                config->compression = ParseBool(value);
+            } else if (key == "shards") {
+                config->shards = std::stoi(value);
+            } else if (key == "row_cache") {
+                config->rowCache = std::stoi(value);
+            } else if (key == "io_threads") {
+                config->ioThreads = std::stoi(value);
+            } else if (key == "worker_threads") {
+                config->workerThreads = std::stoi(value);
+            } else if (key == "max_query_buffer") {
+                config->maxQueryBuffer = std::stoi(value);
+            } else if (key == "edge_triggered") {
+                config->edgeTriggered = ParseBool(value);
+            } else if (key == "event_backend") {
+                if (value != "epoll" && value != "io_uring")
+                    return nullptr;
+                config->eventBackend = value;
+            } else if (key == "container_cache") {
+                config->containerCache = std::stoi(value);
+            } else if (key == "fold_age") {
+                config->foldAge = std::stoi(value);
+            } else if (key == "group_commit_window") {
+                config->groupCommitWindow = std::stoi(value);
+            } else if (key == "durability") {
+                if (value != "none" && value != "everysec" && value != "always")
+                    return nullptr;
+                config->durability = value;
+            } else if (key == "counter_flush") {
+                config->counterFlush = std::stoi(value);
+            } else {
+                return nullptr;
+            }
+        } catch(...) {
+            return nullptr;
+        }
+    }
+
+    if (config->ioThreads < 1 || config->workerThreads < 0 ||
+        config->maxQueryBuffer < 1 || config->maxQueryBuffer > 2047 ||
+        config->containerCache < 1 || config->groupCommitWindow < 0 ||
+        config->shards < 1 || config->rowCache < 0 || config->counterFlush < 0 ||
+        config->foldAge < 0)
+        return nullptr;
+
     return config;
 }
 
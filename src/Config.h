@@ -22,6 +22,17 @@ const int DEFAULT_CACHE_SIZE = 8;
 const int DEFAULT_BLOCK_SIZE = 4;
 const int DEFAULT_WRITE_BUFFER_SIZE = 4;
 const int DEFAULT_COMPACTION_SPEED = 1000;
+const int DEFAULT_IO_THREADS = 1;
+const int DEFAULT_WORKER_THREADS = 0;
+const int DEFAULT_MAX_QUERY_BUFFER = 64;
+const std::string DEFAULT_EVENT_BACKEND = "epoll";
+const int DEFAULT_CONTAINER_CACHE = 10000;
+const int DEFAULT_FOLD_AGE = 1000;
+const int DEFAULT_GROUP_COMMIT_WINDOW = 0;
+const std::string DEFAULT_DURABILITY = "none";
+const int DEFAULT_SHARDS = 1;
+const int DEFAULT_ROW_CACHE = 0;
+const int DEFAULT_COUNTER_FLUSH = 0;
 
 } // namespace
 
@@ -44,6 +55,27 @@ struct Config
     int writeBufferSize; // MB
     int compactionSpeed; // MB
     bool compression;
+    // leveldb instances the keyspace is hashed over
+    int shards;
+    int rowCache; // MB of hot records in front of leveldb, 0 disables
+    // number of event loops, each with its own SO_REUSEPORT listener
+    int ioThreads;
+    // threads executing commands, 0 executes them on the event loops
+    int workerThreads;
+    int maxQueryBuffer; // MB, per connection
+    // register client sockets once, edge triggered
+    bool edgeTriggered;
+    std::string eventBackend; // epoll or io_uring
+    // hashmaps, queues and zsets, each, whose metadata is kept in memory
+    int containerCache;
+    // ms blind writes of a container may stay unfolded, 0 leaves them
+    int foldAge;
+    // microseconds a group commit leader waits for more writers
+    int groupCommitWindow;
+    // none, everysec or always, see catchdb.conf
+    std::string durability;
+    // ms increments of a KV counter may stay in memory, 0 writes each one
+    int counterFlush;
 
     std::vector<std::string> bindAddresses;
 
@@ -61,7 +93,19 @@ struct Config
           blockSize(DEFAULT_BLOCK_SIZE),
           writeBufferSize(DEFAULT_WRITE_BUFFER_SIZE),
           compactionSpeed(DEFAULT_COMPACTION_SPEED),
-          compression(false)
+          compression(false),
+          shards(DEFAULT_SHARDS),
+          rowCache(DEFAULT_ROW_CACHE),
+          ioThreads(DEFAULT_IO_THREADS),
+          workerThreads(DEFAULT_WORKER_THREADS),
+          maxQueryBuffer(DEFAULT_MAX_QUERY_BUFFER),
+          edgeTriggered(false),
+          eventBackend(DEFAULT_EVENT_BACKEND),
+          containerCache(DEFAULT_CONTAINER_CACHE),
+          foldAge(DEFAULT_FOLD_AGE),
+          groupCommitWindow(DEFAULT_GROUP_COMMIT_WINDOW),
+          durability(DEFAULT_DURABILITY),
+          counterFlush(DEFAULT_COUNTER_FLUSH)
     {}
 };
 
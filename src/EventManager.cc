@@ -4,10 +4,13 @@
 #include <algorithm>
 #include <errno.h>
 #include <cstdlib>
+#include <unistd.h>
 
 namespace catchdb
 {
 
+const int EventManager::MAX_FIRED_EVENTS;
+
 EventManager::EventManager(int maxSize)
     : maxSize_(maxSize), maxfd_(-1)
 {
@@ -17,21 +20,25 @@ EventManager::EventManager(int maxSize)
         exit(EXIT_FAILURE);
     }
 
-    epollEvents_ = new epoll_event[maxSize_];
+    // several event loops may run in one process, so memory is only
+    // committed for the fds a loop has actually seen
+    epollEvents_ = new epoll_event[MAX_FIRED_EVENTS];
 
     events_.clear();
-    events_.resize(maxSize_);
 }
 
 EventManager::~EventManager()
 {
-    delete epollEvents_;
+    delete[] epollEvents_;
+    close(epollfd_);
 }
 
 Status EventManager::addEvent(int fd, const Event &event)
 {
     if (fd >= maxSize_)
         return Status::OutOfRange;
+    if (fd >= static_cast<int>(events_.size()))
+        events_.resize(std::min(maxSize_, std::max(fd + 1, 2 * static_cast<int>(events_.size()))));
     int op = (events_[fd].flag == EVENT_NONE) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
 
     if (events_[fd].flag == EVENT_NONE) {
@@ -49,13 +56,25 @@ Status EventManager::addEvent(int fd, const Event &event)
     }
 
     struct epoll_event e;
-    e.events = 0;
-    if (event.flag & EVENT_IN) e.events |= EPOLLIN;
-    if (event.flag & EVENT_OUT) e.events |= EPOLLOUT;
     e.data.fd = fd;
+    if (events_[fd].flag & EVENT_EDGE) {
+        if (op == EPOLL_CTL_MOD) {
+            // an edge may have been reported while the direction was off
+            if (events_[fd].ready & event.flag)
+                pending_.push_back(fd);
+            return Status::OK;
+        }
+        e.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    } else {
+        e.events = 0;
+        if (event.flag & EVENT_IN) e.events |= EPOLLIN;
+        if (event.flag & EVENT_OUT) e.events |= EPOLLOUT;
+    }
 
     if (epoll_ctl(epollfd_, op, fd, &e) == -1) {
         LogDebug("epoll_ctl: %s", ErrorDescription(errno));
+        if (op == EPOLL_CTL_ADD)
+            events_[fd] = Event();
         return Status::Error;
     }
     return Status::OK;
@@ -63,11 +82,13 @@ Status EventManager::addEvent(int fd, const Event &event)
 
 void EventManager::delEvent(int fd, int flag)
 {
-    if (events_[fd].flag == EVENT_NONE)
+    if (fd >= static_cast<int>(events_.size()) || events_[fd].flag == EVENT_NONE)
         return;
 
     events_[fd].flag &= ~flag;
-    if (events_[fd].flag != EVENT_NONE) {
+    if (events_[fd].flag & EVENT_EDGE) {
+        return;
+    } else if (events_[fd].flag != EVENT_NONE) {
         struct epoll_event e;
         e.events = 0;
         if (events_[fd].flag & EVENT_IN) e.events |= EPOLLIN;
@@ -77,6 +98,7 @@ void EventManager::delEvent(int fd, int flag)
         epoll_ctl(epollfd_, EPOLL_CTL_MOD, fd, &e);
     } else {
         epoll_ctl(epollfd_, EPOLL_CTL_DEL, fd, nullptr);
+        events_[fd].ready = EVENT_NONE;
 
         if (fd == maxfd_) {
             int i = fd;
@@ -86,10 +108,20 @@ void EventManager::delEvent(int fd, int flag)
     }
 }
 
+void EventManager::clearReady(int fd, int flag)
+{
+    if (fd < static_cast<int>(events_.size()))
+        events_[fd].ready &= ~flag;
+}
+
 void EventManager::run()
 {
+    std::vector<int> pending;
     while (true) {
-        int num = epoll_wait(epollfd_, epollEvents_, maxfd_ + 1, -1);
+        // don't block while some fds are known to be ready
+        int timeout = pending_.empty() ? -1 : 0;
+        int num = epoll_wait(epollfd_, epollEvents_,
+                             std::min(maxfd_ + 1, MAX_FIRED_EVENTS), timeout);
         if (num == -1) {
             if (errno == EINTR)
                 continue;
@@ -101,6 +133,17 @@ void EventManager::run()
             int fd = epollEvents_[i].data.fd;
             Event &e = events_[fd];
             int flag = epollEvents_[i].events;
+
+            if (e.flag & EVENT_EDGE) {
+                // a hang up or an error is found out by reading
+                if (flag & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                    e.ready |= EVENT_IN;
+                if (flag & EPOLLOUT)
+                    e.ready |= EVENT_OUT;
+                dispatch(fd);
+                continue;
+            }
+
             bool fired = false;
             if (flag & EPOLLIN) {
                 e.inHandler(*this, fd, e.data); 
@@ -112,7 +155,32 @@ void EventManager::run()
             }
             // ignore EPOLL_ERR and EPOLL_HUP
         }
+
+        // fds queued again meanwhile are handled in the next round,
+        // after the events fired by then
+        pending.swap(pending_);
+        for (auto fd : pending)
+            dispatch(fd);
+        pending.clear();
     }
 }
 
+/***************** private ***********************/
+
+void EventManager::dispatch(int fd)
+{
+    Event &e = events_[fd];
+    int ready = e.flag & e.ready;
+    if (ready & EVENT_IN)
+        e.inHandler(*this, fd, e.data);
+    else if (ready & EVENT_OUT)
+        e.outHandler(*this, fd, e.data);
+    else
+        return;
+
+    // the handler may have closed fd, or left data unread
+    if ((events_[fd].flag & EVENT_EDGE) && (events_[fd].flag & events_[fd].ready))
+        pending_.push_back(fd);
+}
+
 } // namespace catchdb
@@ -14,7 +14,11 @@ enum EventFlag
     EVENT_NONE = 0,
     EVENT_IN = 1,
     EVENT_OUT = 2,
-    EVENT_ALL = 3
+    // register the fd once for both directions, edge triggered. Adding or
+    // deleting EVENT_IN/EVENT_OUT afterwards is bookkeeping only, handlers
+    // must call clearReady once a read or write hit EAGAIN.
+    EVENT_EDGE = 4,
+    EVENT_ALL = 7
 };
 
 class EventManager;
@@ -24,13 +28,14 @@ typedef void (*EventHandler) (EventManager&, int, void*);
 struct Event
 {
     int flag;
+    int ready; // EVENT_EDGE only: directions reported and not drained yet
     EventHandler inHandler;
     EventHandler outHandler;
     void *data;
 
-    Event() : flag(EVENT_NONE), data(nullptr) {}
+    Event() : flag(EVENT_NONE), ready(EVENT_NONE), data(nullptr) {}
 
-    Event(int f, EventHandler handler, void *d) : flag(f), data(d)
+    Event(int f, EventHandler handler, void *d) : flag(f), ready(EVENT_NONE), data(d)
     {
         if (flag & EVENT_IN) inHandler = handler;
         if (flag & EVENT_OUT) outHandler = handler;
@@ -46,6 +51,9 @@ public:
     Status addEvent(int fd, const Event &event);
     void delEvent(int fd, int flag);
 
+    // the last read or write on an EVENT_EDGE fd returned EAGAIN
+    void clearReady(int fd, int flag);
+
     void run();
 
     // non-copyable
@@ -53,12 +61,22 @@ public:
     EventManager& operator=(const EventManager&) = delete;
 
 private:
+    // upper bound of events returned by one epoll_wait
+    static const int MAX_FIRED_EVENTS = 1024;
+
+    // call the handler of an EVENT_EDGE fd that is enabled and ready
+    void dispatch(int fd);
+
     int maxSize_;
     int epollfd_;
     int maxfd_;
     struct epoll_event *epollEvents_;
 
-    std::vector<Event> events_; // fd -> Event
+    std::vector<Event> events_; // fd -> Event, grown on demand up to maxSize_
+
+    // EVENT_EDGE fds still ready after their handler ran, or ready when a
+    // direction was enabled; no new edge will be reported for them
+    std::vector<int> pending_;
 };
 
 } // namespace catchdb
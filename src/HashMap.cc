@@ -9,6 +9,7 @@
 #include <limits>
 #include <stdexcept>
 #include <map>
+#include <utility>
 #include <memory>
 #include <cstdio>
 
@@ -18,56 +19,71 @@ namespace catchdb
 namespace
 {
 const char HASHMAP_TYPE_INDENTIFIRE = 'H';
+
+// multi_hget walks an iterator once it asks for 1/DENSE_RATIO of the fields
+const size_t DENSE_RATIO = 8;
+
+// blind writes fold in their fields once this many are pending
+const size_t MAX_PENDING = 4096;
 } // namespace
 
+const std::map<std::string, HashMap::proc_t> HashMap::procMap = {
+    { "hsize", &HashMap::size },
+    { "hset", &HashMap::set },
+    { "hmod", &HashMap::mod },
+    { "hincr", &HashMap::incr },
+    { "hdecr", &HashMap::decr },
+    { "multi_hset", &HashMap::setM },
+    { "hget", &HashMap::get },
+    { "multi_hget", &HashMap::getM },
+    { "hdel", &HashMap::del },
+    { "hexists", &HashMap::exists },
+    { "hkeys", &HashMap::keys },
+    { "hgetall", &HashMap::getall },
+    { "hclear", &HashMap::clear },
+    { "hscan", &HashMap::scan },
+    { "hrscan", &HashMap::rscan }
+};
+
 HashMap::HashMap(const CatchDBPtr db, const std::string &hashMapName)
-    : db_(db), name_(hashMapName), size_(0)
+    : db_(db), name_(hashMapName), size_(0), stale_(false), loaded_(false)
 {
-    procMap = { { "hsize", &HashMap::size },
-                { "hset", &HashMap::set },
-                { "hmod", &HashMap::mod },
-                { "multi_hset", &HashMap::setM },
-                { "hget", &HashMap::get },
-                { "hdel", &HashMap::del },
-                { "hexists", &HashMap::exists },
-                { "hkeys", &HashMap::keys },
-                { "hgetall", &HashMap::getall },
-                { "hclear", &HashMap::clear } };
-
-
-    keyTemplate_.append(1, HASHMAP_TYPE_INDENTIFIRE);
-    uint16_t keySize = static_cast<uint16_t>(hashMapName.size());
-    keyTemplate_.append((char *)&keySize, sizeof (uint16_t));
-    keyTemplate_.append(hashMapName.data(), keySize);
-
-    Response resp;
-    (void) size(nullptr, &resp); // do not care whether succeed
+    EncodeName(&keyTemplate_, HASHMAP_TYPE_INDENTIFIRE, hashMapName);
 }
 
 Status HashMap::process(const RequestPtr req, ResponsePtr resp)
 {
-    std::string &cmd = req->blocks[0];
-    if (procMap.find(cmd) == procMap.end())
+    auto it = procMap.find(req->blocks[0].ToString());
+    if (it == procMap.end())
         return Status::NotImplemented;
-    auto func = procMap[cmd];
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!loaded_ && load() != Status::OK)
+        return Status::Error;
+    auto func = it->second;
     return (this->*func)(req, resp);
 }
 
+Status HashMap::foldOlder(std::chrono::steady_clock::duration age)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!base_ || std::chrono::steady_clock::now() - baseTime_ < age)
+        return Status::OK;
+    return fold();
+}
 
-Status HashMap::size(const RequestPtr req, ResponsePtr resp)
+void HashMap::follow(const std::shared_ptr<HashMap> &shared)
 {
-    if (size_ == 0) {
-        std::string val;
-        auto s = db_->get(keyTemplate_, &val);
-        if (s == Status::OK) {
-            size_ = *((uint64_t*) val.data());
-        } else if (s == Status::NotFound){
-            size_ = 0;
-        } else {
-            return Status::Error;
-        }
-    }
+    shared_ = shared;
+}
 
+
+Status HashMap::size(const RequestPtr req, ResponsePtr resp)
+{
+    (void) req;
+    auto s = fold();
+    if (s != Status::OK)
+        return s;
     resp->push_back(std::to_string(size_));
     return Status::OK;
 }
@@ -81,33 +97,25 @@ bool HashMap::empty()
 // or mod
 Status HashMap::mod(const RequestPtr req, ResponsePtr resp)
 {
-    auto key = encodeKey(req->blocks[2]);
-    return db_->put(key, req->blocks[3]);
+    return set(req, resp);
 }
 
 Status HashMap::set(const RequestPtr req, ResponsePtr resp)
 {
     auto key = encodeKey(req->blocks[2]);
-    std::string val;
-    auto s = db_->get(key, &val);
-    uint64_t size;
-    if (s == Status::NotFound) {
-        size = size_ + 1;
-    } else if (s == Status::OK) {
-        size = size_;
-    } else {
-        return s;
-    }
-
     leveldb::WriteBatch batch;
     batch.Put(key, req->blocks[3]);
-    batch.Put(keyTemplate_, NumberToString(size));
-    s = db_->putM(&batch);
-    if (s == Status::OK) {
-        size_ = size;
-        return Status::OK;
-    }
-    return Status::Error;
+    return putBlind(&batch, {key});
+}
+
+Status HashMap::incr(const RequestPtr req, ResponsePtr resp)
+{
+    return incr_(req, resp, false);
+}
+
+Status HashMap::decr(const RequestPtr req, ResponsePtr resp)
+{
+    return incr_(req, resp, true);
 }
 
 Status HashMap::setM(const RequestPtr req, ResponsePtr resp)
@@ -118,33 +126,18 @@ Status HashMap::setM(const RequestPtr req, ResponsePtr resp)
         return Status::InvalidParameter;
     }
 
-    std::map<std::string, std::string> kvs; // to remove duplicate in a multi_set
+    std::map<std::string, leveldb::Slice> kvs; // to remove duplicate in a multi_set
     for (int i = 2; i < size; i += 2) {
-        kvs[req->blocks[i]] = req->blocks[i + 1];
+        kvs[req->blocks[i].ToString()] = req->blocks[i + 1];
     }
 
-    int kvSize = 0;
+    std::vector<std::string> keys;
     leveldb::WriteBatch batch;
     for (auto &kv : kvs) {
-        auto key = encodeKey(kv.first);
-        std::string val;
-        auto s = db_->get(key, &val);
-        if (s == Status::NotFound) {
-            ++kvSize;
-        } else if (s != Status::OK) {
-            return s;
-        }
-        batch.Put(key, kv.second);
+        keys.push_back(encodeKey(kv.first));
+        batch.Put(keys.back(), kv.second);
     }
-
-    batch.Put(keyTemplate_, NumberToString(size_ + kvSize));
-    Status s = db_->putM(&batch);
-    if (s == Status::OK) {
-        size_ += kvSize;
-        return Status::OK;
-    }
-    return Status::Error;
-
+    return putBlind(&batch, keys);
 }
 
 Status HashMap::get(const RequestPtr req, ResponsePtr resp)
@@ -152,34 +145,53 @@ Status HashMap::get(const RequestPtr req, ResponsePtr resp)
     auto key = encodeKey(req->blocks[2]);
     std::string val;
     auto s = db_->get(key, &val);
-    resp->push_back(val);
+    resp->push_back(std::move(val));
     return s;
 }
 
-Status HashMap::getall(const RequestPtr req, ResponsePtr resp)
+Status HashMap::getM(const RequestPtr req, ResponsePtr resp)
 {
-    std::unique_ptr<Iterator> it(db_->newIterator(keyTemplate_, keyTemplate_));
-    auto kvs = it->range(keyTemplate_, "", 0);
-    if (it->status() != Status::OK)
-        return Status::Error;
+    std::vector<std::string> keys;
+    keys.reserve(req->blocks.size() - 2);
+    for (size_t i = 2; i < req->blocks.size(); ++i)
+        keys.push_back(encodeKey(req->blocks[i]));
+
+    std::vector<std::string> values;
+    std::vector<bool> found;
+    bool dense = keys.size() * DENSE_RATIO >= size_;
+    auto s = db_->getM(keys, dense, &values, &found);
+    if (s != Status::OK)
+        return s;
 
-    for (auto &kv : kvs) {
-        resp->push_back(decodeKey(kv.key));
-        resp->push_back(kv.value);
+    for (size_t i = 0; i < values.size(); ++i) {
+        if (!found[i])
+            continue;
+        resp->push_back(req->blocks[i + 2].ToString());
+        resp->push_back(std::move(values[i]));
     }
     return Status::OK;
 }
 
-Status HashMap::keys(const RequestPtr req, ResponsePtr resp)
+Status HashMap::getall(const RequestPtr req, ResponsePtr resp)
 {
-    std::unique_ptr<Iterator> it(db_->newIterator(keyTemplate_, keyTemplate_));
-    auto keys = it->keys(keyTemplate_, "", 0);
+    std::unique_ptr<Iterator> it(db_->newIterator(keyTemplate_));
+    for (it->seek(); it->valid(); it->next()) {
+        resp->push_back(it->field().ToString());
+        resp->push_back(it->value().ToString());
+    }
     if (it->status() != Status::OK)
         return Status::Error;
+    return Status::OK;
+}
 
-    for (auto &key : keys) {
-        resp->push_back(decodeKey(key));
+Status HashMap::keys(const RequestPtr req, ResponsePtr resp)
+{
+    std::unique_ptr<Iterator> it(db_->newIterator(keyTemplate_));
+    for (it->seek(); it->valid(); it->next()) {
+        resp->push_back(it->field().ToString());
     }
+    if (it->status() != Status::OK)
+        return Status::Error;
     return Status::OK;
 }
 
@@ -207,55 +219,242 @@ Status HashMap::del(const RequestPtr req, ResponsePtr resp)
 
     leveldb::WriteBatch batch;
     batch.Delete(key);
-    if (size_ == 1) {
-        batch.Delete(keyTemplate_);
-    } else {
-        batch.Put(keyTemplate_, NumberToString(size_ - 1));
-    }
-
-    s = db_->putM(&batch);
-    if (s == Status::OK) {
-        --size_;
-        return Status::OK;
-    }
-    return Status::Error;
+    return putCounted(&batch, key, true, false);
 }
 
 Status HashMap::clear(const RequestPtr req, ResponsePtr resp)
 {
     (void) resp;
 
-    std::unique_ptr<Iterator> it(db_->newIterator(keyTemplate_, keyTemplate_));
-    auto keys = it->keys(keyTemplate_, "", 0);
-    if (it->status() != Status::OK)
-        return Status::Error;
-
     leveldb::WriteBatch batch;
-    for (auto &key : keys) {
-        batch.Delete(key);
+    std::unique_ptr<Iterator> it(db_->newIterator(keyTemplate_));
+    for (it->seek(); it->valid(); it->next()) {
+        batch.Delete(it->key());
     }
+    if (it->status() != Status::OK)
+        return Status::Error;
     batch.Delete(keyTemplate_);
 
     auto s = db_->putM(&batch);
     if (s == Status::OK) {
         size_ = 0;
+        pending_.clear();
+        base_.reset();
+        stale_ = false;
     }
     return s;
 }
 
+Status HashMap::scan(const RequestPtr req, ResponsePtr resp)
+{
+    return scan_(req, resp, Iterator::Direction::Forward);
+}
+
+Status HashMap::rscan(const RequestPtr req, ResponsePtr resp)
+{
+    return scan_(req, resp, Iterator::Direction::Reverse);
+}
+
 
 /*************** private member functions *******************/
 
-std::string HashMap::encodeKey(const std::string &key)
+Status HashMap::load()
 {
-    std::string newKey(keyTemplate_);
-    newKey.append(key);
-    return newKey;
+    std::string val;
+    uint64_t base = 0;
+    auto s = db_->get(keyTemplate_, &val);
+    if (s == Status::OK) {
+        if (!DecodeSize(val, &size_, &stale_, &base))
+            return Status::Error;
+    } else if (s == Status::NotFound){
+        size_ = 0;
+    } else {
+        return Status::Error;
+    }
+    // left stale by blind writes that were never folded, or still pending
+    if (stale_ && CatchDB::threadSnapshot != nullptr && takePending(base) != Status::OK)
+        return Status::Error;
+    if (fold() != Status::OK)
+        return Status::Error;
+    loaded_ = true;
+    return Status::OK;
+}
+
+Status HashMap::takePending(uint64_t base)
+{
+    auto shared = shared_.lock();
+    if (!shared)
+        return Status::OK;
+    {
+        std::lock_guard<std::mutex> lock(shared->mutex_);
+        if (!shared->base_ || shared->base_->id != base)
+            return Status::OK;
+        base_ = shared->base_;
+        pending_ = shared->pending_;
+    }
+
+    // whether they exist at the snapshot, fold() compares with base_
+    std::vector<std::string> keys;
+    for (auto &p : pending_)
+        keys.push_back(p.first);
+    std::vector<std::string> values;
+    std::vector<bool> found;
+    bool dense = keys.size() * DENSE_RATIO >= size_;
+    if (db_->getM(keys, dense, &values, &found) != Status::OK)
+        return Status::Error;
+    size_t i = 0;
+    for (auto &p : pending_)
+        p.second = found[i++];
+    return Status::OK;
+}
+
+Status HashMap::putBlind(leveldb::WriteBatch *batch, const std::vector<std::string> &keys)
+{
+    // the first blind write marks the size record, so a restart knows
+    // to count
+    if (!stale_) {
+        base_ = db_->snapshot();
+        baseTime_ = std::chrono::steady_clock::now();
+        batch->Put(keyTemplate_, EncodeSize(size_, true, base_->id));
+    }
+    if (db_->putM(batch) != Status::OK) {
+        if (!stale_)
+            base_.reset();
+        return Status::Error;
+    }
+
+    stale_ = true;
+    for (auto &key : keys)
+        pending_[key] = true;
+    if (pending_.size() >= MAX_PENDING)
+        return fold();
+    return Status::OK;
 }
 
-std::string HashMap::decodeKey(const std::string &codedKey)
+Status HashMap::putCounted(leveldb::WriteBatch *batch, const std::string &key,
+                           bool existed, bool exists)
 {
-    return codedKey.substr(keyTemplate_.size(), std::string::npos);
+    uint64_t size = size_ + exists - existed;
+    if (!stale_ && exists != existed) {
+        if (size == 0)
+            batch->Delete(keyTemplate_);
+        else
+            batch->Put(keyTemplate_, EncodeSize(size, false));
+    }
+    if (db_->putM(batch) != Status::OK)
+        return Status::Error;
+
+    if (stale_) {
+        pending_[key] = exists;
+        if (pending_.size() >= MAX_PENDING)
+            return fold();
+    } else {
+        size_ = size;
+    }
+    return Status::OK;
+}
+
+Status HashMap::fold()
+{
+    if (!stale_)
+        return Status::OK;
+
+    // a pending field counts by whether it exists now and did at base_
+    uint64_t size = size_;
+    if (base_) {
+        std::vector<std::string> keys;
+        for (auto &p : pending_)
+            keys.push_back(p.first);
+        std::vector<std::string> values;
+        std::vector<bool> found;
+        bool dense = keys.size() * DENSE_RATIO >= size_;
+        if (db_->getM(keys, dense, &values, &found, base_.get()) != Status::OK)
+            return Status::Error;
+        size_t i = 0;
+        for (auto &p : pending_) {
+            if (p.second && !found[i])
+                ++size;
+            else if (!p.second && found[i])
+                --size;
+            ++i;
+        }
+    } else {
+        size = 0;
+        std::unique_ptr<Iterator> it(db_->newIterator(keyTemplate_));
+        for (it->seek(); it->valid(); it->next())
+            ++size;
+        if (it->status() != Status::OK)
+            return Status::Error;
+    }
+
+    // reads at a snapshot use the count but must not write it
+    if (CatchDB::threadSnapshot == nullptr) {
+        auto s = size == 0 ? db_->del(keyTemplate_)
+                           : db_->put(keyTemplate_, EncodeSize(size, false));
+        if (s != Status::OK)
+            return Status::Error;
+    }
+    size_ = size;
+    pending_.clear();
+    base_.reset();
+    stale_ = false;
+    return Status::OK;
+}
+
+// The object's mutex makes the read and the write one step.
+Status HashMap::incr_(const RequestPtr req, ResponsePtr resp, bool negate)
+{
+    int64_t delta;
+    if (!ParseInt64(req->blocks[3].ToString(), &delta) ||
+        (negate && delta == INT64_MIN)) {
+        resp->push_back("delta should be an integer");
+        return Status::InvalidParameter;
+    }
+    if (negate)
+        delta = -delta;
+
+    auto key = encodeKey(req->blocks[2]);
+    std::string val;
+    int64_t value = 0;
+    auto s = db_->get(key, &val);
+    if (s != Status::OK && s != Status::NotFound)
+        return s;
+    if ((s == Status::OK && !ParseInt64(val, &value)) ||
+        __builtin_add_overflow(value, delta, &value)) {
+        resp->push_back("value is not an integer or out of range");
+        return Status::InvalidParameter;
+    }
+
+    leveldb::WriteBatch batch;
+    batch.Put(key, std::to_string(value));
+    auto w = putCounted(&batch, key, s == Status::OK, true);
+    if (w != Status::OK)
+        return w;
+    resp->push_back(std::to_string(value));
+    return Status::OK;
+}
+
+Status HashMap::scan_(const RequestPtr req, ResponsePtr resp,
+                      Iterator::Direction direction)
+{
+    size_t limit;
+    if (!Iterator::ParseLimit(req->blocks[4], &limit)) {
+        resp->push_back("limit should be a positive integer");
+        return Status::InvalidParameter;
+    }
+
+    std::unique_ptr<Iterator> it(db_->newIterator(keyTemplate_, direction));
+    it->page(req->blocks[2], req->blocks[3], limit, resp);
+    if (it->status() != Status::OK)
+        return Status::Error;
+    return Status::OK;
+}
+
+std::string HashMap::encodeKey(const leveldb::Slice &key)
+{
+    std::string newKey(keyTemplate_);
+    newKey.append(key.data(), key.size());
+    return newKey;
 }
 
 } // namespace catchdb
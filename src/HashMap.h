@@ -5,10 +5,15 @@
 #include <utility>
 #include <tuple>
 #include <memory>
+#include <mutex>
+#include <map>
 #include <cstdint>
+#include <chrono>
 #include "CatchDB.h"
+#include "Iterator.h"
 #include "Status.h"
 #include "Protocol.h"
+#include "leveldb/write_batch.h"
 
 namespace catchdb
 {
@@ -17,18 +22,31 @@ class HashMap
 {
 public:
     HashMap(const CatchDBPtr db, const std::string &hashMapName);
-    ~HashMap() {}
 
     Status process(const RequestPtr req, ResponsePtr resp);
 
+    // Fold the blind writes if their base snapshot is older than @age, so
+    // a container left idle does not keep old versions from compaction.
+    Status foldOlder(std::chrono::steady_clock::duration age);
+
+    // Make this object, reading at a snapshot, take the blind writes still
+    // pending there from @shared, the object of the latest data, rather
+    // than recount the container when it finds them, see load().
+    void follow(const std::shared_ptr<HashMap> &shared);
+
     Status size(const RequestPtr req, ResponsePtr resp);
     bool empty();
 
     Status set(const RequestPtr req, ResponsePtr resp);
     Status setM(const RequestPtr req, ResponsePtr resp);
     Status mod(const RequestPtr req, ResponsePtr resp);
+    // hincr name field delta -> the new value, from 0 if field does not exist
+    Status incr(const RequestPtr req, ResponsePtr resp);
+    Status decr(const RequestPtr req, ResponsePtr resp);
 
     Status get(const RequestPtr req, ResponsePtr resp);
+    // multi_hget name field ... -> field value ..., for the fields that exist
+    Status getM(const RequestPtr req, ResponsePtr resp);
 
     Status del(const RequestPtr req, ResponsePtr resp);
 
@@ -37,6 +55,9 @@ public:
     Status keys(const RequestPtr req, ResponsePtr resp);
     Status getall(const RequestPtr req, ResponsePtr resp);
     Status clear(const RequestPtr req, ResponsePtr resp);
+    // hscan name cursor end limit -> cursor field value ...
+    Status scan(const RequestPtr req, ResponsePtr resp);
+    Status rscan(const RequestPtr req, ResponsePtr resp);
 
     // non-copyable
     HashMap(const HashMap&) = delete;
@@ -44,17 +65,48 @@ public:
 
 private:
     typedef Status (HashMap::*proc_t) (const RequestPtr, ResponsePtr);
-    std::map<std::string, proc_t> procMap;
-
-    std::string encodeKey(const std::string &key);
-    std::string decodeKey(const std::string &codedKey);
+    static const std::map<std::string, proc_t> procMap;
+
+    std::string encodeKey(const leveldb::Slice &key);
+    Status scan_(const RequestPtr req, ResponsePtr resp, Iterator::Direction direction);
+    Status incr_(const RequestPtr req, ResponsePtr resp, bool negate);
+
+    // read the metadata record, once per object
+    Status load();
+    // Write @batch, which puts the fields @keys without looking whether
+    // they exist; fold() adds the new ones to size_.
+    Status putBlind(leveldb::WriteBatch *batch, const std::vector<std::string> &keys);
+    // Write @batch, which makes field @key exist or not, known to have
+    // existed or not, with the size it makes; the size is left to fold()
+    // while blind writes are pending.
+    Status putCounted(leveldb::WriteBatch *batch, const std::string &key,
+                      bool existed, bool exists);
+    // make size_ exact and store it, unless reading at a snapshot
+    Status fold();
+    // At a snapshot, take base_ and the pending fields from shared_ if its
+    // blind writes are those of the size record, from snapshot @base.
+    Status takePending(uint64_t base);
 
     CatchDBPtr db_;
     std::string name_;
     std::string keyTemplate_;
     uint64_t size_;
+    // Fields written since the first blind write after size_ was exact,
+    // whether they exist now, and the database just before that write,
+    // where fold() looks which ones existed. Without base_, e.g. after a
+    // restart, fold() counts the fields.
+    std::map<std::string, bool> pending_;
+    SnapshotPtr base_;
+    std::chrono::steady_clock::time_point baseTime_;
+    bool stale_; // the size record is marked stale
+    // not owned, so snapshot objects never keep a shared one from eviction
+    std::weak_ptr<HashMap> shared_;
+
+    // one object per container is shared by all connections, see Registry
+    std::mutex mutex_;
+    bool loaded_;
 };
 
-typedef std::unique_ptr<HashMap> HashMapPtr;
+typedef std::shared_ptr<HashMap> HashMapPtr;
 
 } // namespace catchdb
@@ -0,0 +1,204 @@
+#include "IoUring.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+namespace catchdb
+{
+
+namespace
+{
+
+int Setup(unsigned entries, struct io_uring_params *p)
+{
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+}
+
+int Enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, toSubmit, minComplete,
+                                    flags, nullptr, 0));
+}
+
+int Register(int fd, unsigned opcode, void *arg, unsigned nrArgs)
+{
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs));
+}
+
+template <typename T>
+T* At(void *base, uint32_t offset)
+{
+    return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+}
+
+} // namespace
+
+IoUring::IoUring()
+    : fd_(-1), ring_(MAP_FAILED), ringSize_(0), sqes_(nullptr), sqesSize_(0),
+      sqHead_(nullptr), sqTail_(nullptr), sqMask_(0), sqEntries_(0),
+      sqLocalTail_(0), toSubmit_(0),
+      cqHead_(nullptr), cqTail_(nullptr), cqMask_(0), cqes_(nullptr),
+      bufRing_(nullptr), bufRingSize_(0), bufMask_(0), bufTail_(0), bufSize_(0)
+{}
+
+IoUring::~IoUring()
+{
+    if (fd_ >= 0)
+        close(fd_);
+    if (bufRing_ != nullptr)
+        munmap(bufRing_, bufRingSize_);
+    if (sqes_ != nullptr)
+        munmap(sqes_, sqesSize_);
+    if (ring_ != MAP_FAILED)
+        munmap(ring_, ringSize_);
+}
+
+bool IoUring::init(unsigned entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof p);
+    // multishot recv may post many completions per SQE
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN |
+              IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = 4 * entries;
+    fd_ = Setup(entries, &p);
+    if (fd_ < 0)
+        return false;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) {
+        errno = ENOSYS;
+        return false;
+    }
+
+    ringSize_ = std::max<size_t>(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+                                 p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+    ring_ = mmap(nullptr, ringSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 fd_, IORING_OFF_SQ_RING);
+    if (ring_ == MAP_FAILED)
+        return false;
+    sqesSize_ = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+        return false;
+    sqes_ = static_cast<struct io_uring_sqe*>(sqes);
+
+    sqHead_ = At<unsigned>(ring_, p.sq_off.head);
+    sqTail_ = At<unsigned>(ring_, p.sq_off.tail);
+    sqMask_ = *At<unsigned>(ring_, p.sq_off.ring_mask);
+    sqEntries_ = p.sq_entries;
+    sqLocalTail_ = *sqTail_;
+    // slot i of the SQ always holds SQE i
+    unsigned *array = At<unsigned>(ring_, p.sq_off.array);
+    for (unsigned i = 0; i < sqEntries_; ++i)
+        array[i] = i;
+
+    cqHead_ = At<unsigned>(ring_, p.cq_off.head);
+    cqTail_ = At<unsigned>(ring_, p.cq_off.tail);
+    cqMask_ = *At<unsigned>(ring_, p.cq_off.ring_mask);
+    cqes_ = At<struct io_uring_cqe>(ring_, p.cq_off.cqes);
+    return true;
+}
+
+struct io_uring_sqe* IoUring::getSqe()
+{
+    if (sqLocalTail_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) >= sqEntries_ &&
+        !submit(0))
+        return nullptr;
+    struct io_uring_sqe *sqe = &sqes_[sqLocalTail_ & sqMask_];
+    memset(sqe, 0, sizeof *sqe);
+    ++sqLocalTail_;
+    ++toSubmit_;
+    return sqe;
+}
+
+bool IoUring::reserve(unsigned n)
+{
+    if (sqLocalTail_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) + n <= sqEntries_)
+        return true;
+    return submit(0);
+}
+
+bool IoUring::submit(unsigned waitNr)
+{
+    __atomic_store_n(sqTail_, sqLocalTail_, __ATOMIC_RELEASE);
+    unsigned flags = waitNr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    while (true) {
+        int n = Enter(fd_, toSubmit_, waitNr, flags);
+        if (n >= 0) {
+            toSubmit_ -= std::min<unsigned>(n, toSubmit_);
+            return true;
+        }
+        if (errno == EINTR)
+            continue;
+        // completions to reap first, the caller does before it comes back
+        if (errno == EBUSY || errno == EAGAIN)
+            return true;
+        return false;
+    }
+}
+
+struct io_uring_cqe* IoUring::peek()
+{
+    unsigned head = *cqHead_;
+    if (head == __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE))
+        return nullptr;
+    return &cqes_[head & cqMask_];
+}
+
+void IoUring::seen()
+{
+    __atomic_store_n(cqHead_, *cqHead_ + 1, __ATOMIC_RELEASE);
+}
+
+bool IoUring::provideBuffers(uint16_t group, const std::vector<char*> &bufs, unsigned size)
+{
+    bufRingSize_ = bufs.size() * sizeof(struct io_uring_buf);
+    void *ring = mmap(nullptr, bufRingSize_, PROT_READ | PROT_WRITE,
+                      MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ring == MAP_FAILED)
+        return false;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+    reg.ring_entries = bufs.size();
+    reg.bgid = group;
+    if (Register(fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(ring, bufRingSize_);
+        return false;
+    }
+
+    bufRing_ = static_cast<struct io_uring_buf_ring*>(ring);
+    bufMask_ = bufs.size() - 1;
+    bufs_ = bufs;
+    bufSize_ = size;
+    for (size_t bid = 0; bid < bufs_.size(); ++bid)
+        recycleBuffer(bid);
+    return true;
+}
+
+int IoUring::bufferOf(unsigned flags)
+{
+    if (!(flags & IORING_CQE_F_BUFFER))
+        return -1;
+    return flags >> IORING_CQE_BUFFER_SHIFT;
+}
+
+void IoUring::recycleBuffer(int bid)
+{
+    // not bufRing_->bufs, which C++ places after the empty struct that
+    // __DECLARE_FLEX_ARRAY puts in front of it
+    struct io_uring_buf *buf = reinterpret_cast<struct io_uring_buf*>(bufRing_) +
+                               (bufTail_ & bufMask_);
+    buf->addr = reinterpret_cast<uint64_t>(bufs_[bid]);
+    buf->len = bufSize_;
+    buf->bid = bid;
+    ++bufTail_;
+    // the tail shares its place with the reserved field of bufs[0]
+    __atomic_store_n(&bufRing_->tail, bufTail_, __ATOMIC_RELEASE);
+}
+
+} // namespace catchdb
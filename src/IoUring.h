@@ -0,0 +1,89 @@
+/*
+ * A minimal io_uring on the raw system calls, liburing is not a
+ * dependency: the submission and completion rings mapped once, and one
+ * ring of provided buffers the kernel takes receive buffers from.
+ *
+ * Set up with IORING_SETUP_DEFER_TASKRUN, which came with Linux 6.1 after
+ * everything else used here (multishot accept and recv, buffer rings), so
+ * init() failing is the one check that the kernel is recent enough.
+ * Completions are only posted while submit() waits for them, by the
+ * thread that called init(); each event loop sets up its own.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <linux/io_uring.h>
+
+namespace catchdb
+{
+
+class IoUring
+{
+public:
+    IoUring();
+    ~IoUring();
+
+    // false, with errno set, if the kernel lacks io_uring or a feature
+    // used here
+    bool init(unsigned entries);
+
+    // a cleared SQE to fill, the queue is submitted first when full
+    struct io_uring_sqe* getSqe();
+    // Submit first unless @n SQEs are free, so a chain of linked SQEs
+    // filled next is submitted at once; a chain must not be split.
+    bool reserve(unsigned n);
+
+    // Submit the SQEs filled so far and wait until @waitNr completions are
+    // there, in one system call; false on errors other than EINTR.
+    bool submit(unsigned waitNr);
+
+    // the oldest completion not seen yet, nullptr if none
+    struct io_uring_cqe* peek();
+    // hand the completion of the last peek() back to the kernel
+    void seen();
+
+    // Provide @bufs, @size bytes each and as many as a power of 2, as
+    // buffer group @group: a recv with IOSQE_BUFFER_SELECT takes one and
+    // names it in the flags of its completion, see bufferOf.
+    bool provideBuffers(uint16_t group, const std::vector<char*> &bufs, unsigned size);
+    // the buffer a completion with @flags received into, -1 if none
+    static int bufferOf(unsigned flags);
+    char* buffer(int bid) { return bufs_[bid]; }
+    // give buffer @bid back to the kernel once its data is consumed
+    void recycleBuffer(int bid);
+
+    // non-copyable
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+private:
+    int fd_;
+    void *ring_; // both rings, IORING_FEAT_SINGLE_MMAP
+    size_t ringSize_;
+    struct io_uring_sqe *sqes_;
+    size_t sqesSize_;
+
+    unsigned *sqHead_;
+    unsigned *sqTail_;
+    unsigned sqMask_;
+    unsigned sqEntries_;
+    unsigned sqLocalTail_; // SQEs filled, published by submit()
+    unsigned toSubmit_;
+
+    unsigned *cqHead_;
+    unsigned *cqTail_;
+    unsigned cqMask_;
+    struct io_uring_cqe *cqes_;
+
+    struct io_uring_buf_ring *bufRing_;
+    size_t bufRingSize_;
+    unsigned bufMask_;
+    uint16_t bufTail_;
+    std::vector<char*> bufs_;
+    unsigned bufSize_;
+};
+
+} // namespace catchdb
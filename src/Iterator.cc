@@ -1,151 +1,201 @@
 #include "Iterator.h"
-#include "Util.h"
-#include <limits>
+#include <algorithm>
+#include <stdexcept>
 
 namespace catchdb
 {
 
-Iterator::Iterator(leveldb::DB *db, 
+Iterator::Iterator(const std::vector<leveldb::DB*> &dbs,
+                   const std::vector<const leveldb::Snapshot*> &snapshots,
                    const std::string &prefix,
-                   const std::string &exclude)
-    : db_(db), prefix_(prefix), exclude_(exclude)
+                   Direction direction)
+    : prefix_(prefix), direction_(direction)
 {
     leveldb::ReadOptions options;
     options.fill_cache = false;
-    it_ = db_->NewIterator(options);
+    for (size_t i = 0; i < dbs.size(); ++i) {
+        options.snapshot = snapshots[i];
+        its_.push_back(dbs[i]->NewIterator(options));
+    }
+    it_ = its_.front();
 }
 
 Iterator::~Iterator()
 {
-    delete it_;
+    for (auto it : its_)
+        delete it;
 }
 
-std::vector<KVPair> Iterator::range(const std::string &start,
-                          const std::string &end,
-                          uint64_t limit)
+void Iterator::seek(const leveldb::Slice &start)
 {
-    std::vector<KVPair> res;
+    for (auto it : its_)
+        position(it, start);
+    pick();
+    skipPrefix();
+}
 
-    if (limit == 0) {
-        limit = std::numeric_limits<uint64_t>::max();
-    }
-    int count = 0;
-    it_->Seek(start);
-    if (end.empty()) {
-        while (it_->Valid()){
-            if (BeginWith(it_->key().ToString(), prefix_) &&
-                it_->key() != exclude_) {
-                res.push_back(KVPair(it_->key().ToString(),
-                                     it_->value().ToString()));
-                ++count;
-                if (count == limit)
-                    break;
-            }
-            it_->Next();
-        }
-    } else {
-        while (it_->Valid() && CatchDBCompare(it_->key().ToString(), end) <= 0){
-            if (BeginWith(it_->key().ToString(), prefix_) &&
-                it_->key() != exclude_) {
-                res.push_back(KVPair(it_->key().ToString(),
-                                     it_->value().ToString()));
-                ++count;
-                if (count == limit)
-                    break;
-            }
-            it_->Next();
-        }
+void Iterator::seekAfter(const leveldb::Slice &cursor)
+{
+    seek(cursor);
+    if (!cursor.empty() && valid() && field() == cursor)
+        next();
+}
 
-    }
+bool Iterator::valid() const
+{
+    return it_->Valid() && it_->key().starts_with(prefix_);
+}
 
-    return res;
+void Iterator::next()
+{
+    step();
+    skipPrefix();
 }
 
-std::vector<std::string> Iterator::keys(const std::string &start,
-                              const std::string &end,
-                              uint64_t limit)
+bool Iterator::pastEnd(const leveldb::Slice &end) const
 {
-    std::vector<std::string> res;
+    if (end.empty())
+        return false;
+    int ret = field().compare(end);
+    return direction_ == Direction::Forward ? ret > 0 : ret < 0;
+}
 
-    if (limit == 0) {
-        limit = std::numeric_limits<uint64_t>::max();
+leveldb::Slice Iterator::key() const
+{
+    return it_->key();
+}
+
+leveldb::Slice Iterator::field() const
+{
+    leveldb::Slice k = it_->key();
+    k.remove_prefix(prefix_.size());
+    return k;
+}
+
+leveldb::Slice Iterator::value() const
+{
+    return it_->value();
+}
+
+size_t Iterator::range(std::vector<KVPair> *out, size_t limit)
+{
+    size_t count = 0;
+    for (; count < limit && valid(); next(), ++count)
+        out->push_back(KVPair(field().ToString(), value().ToString()));
+    return count;
+}
+
+size_t Iterator::keys(std::vector<std::string> *out, size_t limit)
+{
+    size_t count = 0;
+    for (; count < limit && valid(); next(), ++count)
+        out->push_back(field().ToString());
+    return count;
+}
+
+size_t Iterator::values(std::vector<std::string> *out, size_t limit)
+{
+    size_t count = 0;
+    for (; count < limit && valid(); next(), ++count)
+        out->push_back(value().ToString());
+    return count;
+}
+
+void Iterator::page(const leveldb::Slice &cursor, const leveldb::Slice &end,
+                    size_t limit, ResponsePtr resp)
+{
+    resp->push_back(std::string());
+    seekAfter(cursor);
+    for (size_t i = 0; i < limit && valid() && !pastEnd(end); ++i, next()) {
+        resp->push_back(field().ToString());
+        resp->push_back(value().ToString());
     }
-    int count = 0;
-    it_->Seek(start);
-    if (end.empty()) {
-        while (it_->Valid()){
-            if (BeginWith(it_->key().ToString(), prefix_) &&
-                it_->key() != exclude_) {
-                res.push_back(it_->key().ToString());
-                ++count;
-                if (count == limit)
-                    break;
-            }
-            it_->Next();
-        }
-    } else {
-        while (it_->Valid() && CatchDBCompare(it_->key().ToString(), end) <= 0){
-            if (BeginWith(it_->key().ToString(), prefix_) &&
-                it_->key() != exclude_) {
-                res.push_back(it_->key().ToString());
-                ++count;
-                if (count == limit)
-                    break;
-            }
-            it_->Next();
-        }
+    if (resp->size() > 1 && valid() && !pastEnd(end))
+        resp->front() = (*resp)[resp->size() - 2];
+}
 
+bool Iterator::ParseLimit(const leveldb::Slice &s, size_t *limit)
+{
+    long long n;
+    try {
+        n = std::stoll(s.ToString());
+    } catch(...) {
+        return false;
     }
+    if (n <= 0)
+        return false;
+    *limit = std::min<unsigned long long>(n, CHUNK_SIZE);
+    return true;
+}
 
-    return res;
+Status Iterator::status()
+{
+    for (auto it : its_) {
+        if (!it->status().ok())
+            return Status::Error;
+    }
+    return Status::OK;
 }
 
-std::vector<std::string> Iterator::values(const std::string &start,
-                                const std::string &end,
-                                uint64_t limit)
+/***************** private ***********************/
+
+void Iterator::position(leveldb::Iterator *it, const leveldb::Slice &start)
 {
-    std::vector<std::string> res;
+    std::string target(prefix_);
+    target.append(start.data(), start.size());
 
-    if (limit == 0) {
-        limit = std::numeric_limits<uint64_t>::max();
-    }
-    int count = 0;
-    it_->Seek(start);
-    if (end.empty()) {
-        while (it_->Valid()){
-            if (BeginWith(it_->key().ToString(), prefix_) &&
-                it_->key() != exclude_) {
-                res.push_back(it_->value().ToString());
-                ++count;
-                if (count == limit)
-                    break;
-            }
-            it_->Next();
-        }
+    if (direction_ == Direction::Forward) {
+        it->Seek(target);
     } else {
-        while (it_->Valid() && CatchDBCompare(it_->key().ToString(), end) <= 0){
-            if (BeginWith(it_->key().ToString(), prefix_) &&
-                it_->key() != exclude_) {
-                res.push_back(it_->value().ToString());
-                ++count;
-                if (count == limit)
-                    break;
-            }
-            it_->Next();
+        // the last key not after target
+        if (start.empty())
+            target = PrefixSuccessor(prefix_);
+        if (target.empty()) {
+            it->SeekToLast();
+        } else {
+            it->Seek(target);
+            if (!it->Valid())
+                it->SeekToLast();
+            else if (start.empty() || it->key() != leveldb::Slice(target))
+                it->Prev();
         }
-
     }
+}
 
-    return res;
+void Iterator::step()
+{
+    if (direction_ == Direction::Forward)
+        it_->Next();
+    else
+        it_->Prev();
+    pick();
 }
 
-Status Iterator::status()
+void Iterator::skipPrefix()
 {
-    if (it_->status().ok()) {
-        return Status::OK;
-    } else {
-        return Status::Error;
+    while (it_->Valid() && it_->key() == leveldb::Slice(prefix_))
+        step();
+}
+
+void Iterator::pick()
+{
+    if (its_.size() == 1)
+        return;
+    // a key lives on one shard only, so no two iterators tie
+    leveldb::Iterator *best = nullptr;
+    for (auto it : its_) {
+        if (!it->Valid())
+            continue;
+        if (best == nullptr) {
+            best = it;
+            continue;
+        }
+        int ret = it->key().compare(best->key());
+        if (direction_ == Direction::Forward ? ret < 0 : ret > 0)
+            best = it;
     }
+    // an exhausted cursor still has some iterator to ask
+    it_ = best != nullptr ? best : its_.front();
 }
 
 } // namespace catchdb
@@ -1,12 +1,27 @@
+/*
+ * Cursor over the records of one container, or of all KV pairs.
+ *
+ * The records sharing a key prefix are contiguous in leveldb's bytewise
+ * order, so the cursor seeks into them once and stops at the first key past the
+ * prefix, in either direction; it never walks the rest of the database.
+ * Over several shards it keeps one leveldb iterator per shard and hands
+ * out the smallest of their keys, the largest for a reverse cursor.
+ * Keys equal to the prefix itself (the size record of a HashMap) are
+ * skipped. Records are exposed as Slices into the iterator, or handed out
+ * in chunks of at most @limit by range, keys and values.
+ */
+
 #pragma once
 
 #include <string>
 #include <vector>
 #include <cstdint>
+#include <utility>
 #include "leveldb/db.h"
 #include "leveldb/iterator.h"
 #include "Util.h"
 #include "Status.h"
+#include "Protocol.h"
 
 namespace catchdb
 {
@@ -15,42 +30,84 @@ struct KVPair {
     std::string key;
     std::string value;
 
-    KVPair(const std::string &k, const std::string &v)
-        : key(k), value(v) {}
+    KVPair(std::string k, std::string v)
+        : key(std::move(k)), value(std::move(v)) {}
 };
 
 class Iterator
 {
 public:
-    Iterator(leveldb::DB *db, 
-             const std::string &prefix, 
-             const std::string &exclude);
+    enum class Direction
+    {
+        Forward,
+        Reverse
+    };
+
+    // records handed out per chunk by callers with no limit of their own
+    static const size_t CHUNK_SIZE = 1024;
+
+    // @snapshots, one per db, may be null for the latest data
+    Iterator(const std::vector<leveldb::DB*> &dbs,
+             const std::vector<const leveldb::Snapshot*> &snapshots,
+             const std::string &prefix,
+             Direction direction = Direction::Forward);
 
     ~Iterator();
 
     Status status();
 
-    // Get k-v pairs from key range [start, end], limited
-    // to @limit pairs
-    std::vector<KVPair> range(const std::string &start,
-                              const std::string &end,
-                              uint64_t limit);
-    // Get keys from key range [start, end], limited
-    // to @limit pairs
-    std::vector<std::string> keys(const std::string &satrt,
-                                  const std::string &end,
-                                  uint64_t limit);
-    // Get vaules conrresponds to  key range [start, end], 
-    // limited to @limit pairs
-    std::vector<std::string> values(const std::string &start,
-                                    const std::string &end,
-                                    uint64_t limit);
+    // Position at the record with key prefix + @start, or the nearest one
+    // after it in the cursor's direction. An empty @start is the first
+    // record, the last one for a reverse cursor.
+    void seek(const leveldb::Slice &start = leveldb::Slice());
+
+    // Position at the first record past prefix + @cursor, which is
+    // usually the last key handed out, or at the first record if empty.
+    void seekAfter(const leveldb::Slice &cursor);
+
+    bool valid() const;
+    void next();
+
+    // whether field() lies past @end in the cursor's direction; an empty
+    // @end is no bound
+    bool pastEnd(const leveldb::Slice &end) const;
+
+    // valid until the cursor moves
+    leveldb::Slice key() const;
+    leveldb::Slice field() const; // key without the prefix
+    leveldb::Slice value() const;
+
+    // Append up to @limit records from the cursor on to @out and move
+    // past them, keys without the prefix. Return the number appended, 0
+    // once the records are exhausted.
+    size_t range(std::vector<KVPair> *out, size_t limit);
+    size_t keys(std::vector<std::string> *out, size_t limit);
+    size_t values(std::vector<std::string> *out, size_t limit);
+
+    // One page of a scan: push the cursor to resume from, empty once no
+    // record up to @end is left, then up to @limit fields and values from
+    // the first record after @cursor on.
+    void page(const leveldb::Slice &cursor, const leveldb::Slice &end,
+              size_t limit, ResponsePtr resp);
+
+    // parse the limit of a scan, capped to CHUNK_SIZE
+    static bool ParseLimit(const leveldb::Slice &s, size_t *limit);
+
+    // non-copyable
+    Iterator(const Iterator&) = delete;
+    Iterator& operator=(const Iterator&) = delete;
 
 private:
-    leveldb::DB *db_;
+    void position(leveldb::Iterator *it, const leveldb::Slice &start);
+    void step();
+    void skipPrefix();
+    // make it_ the shard iterator holding the next key
+    void pick();
+
     std::string prefix_;
-    std::string exclude_;
-    leveldb::Iterator *it_;
+    Direction direction_;
+    std::vector<leveldb::Iterator*> its_; // one per shard
+    leveldb::Iterator *it_; // the current one
 };
 
 } // namespace catchdb
@@ -1,8 +1,12 @@
 #include "KV.h"
 #include "Iterator.h"
+#include "Util.h"
 #include "leveldb/write_batch.h"
 #include <string>
 #include <map>
+#include <vector>
+#include <memory>
+#include <utility>
 
 namespace catchdb
 {
@@ -20,28 +24,80 @@ std::map<std::string, proc_t> procMap = {
     { "set", &set },
     { "del", &del },
     { "exists", &exists },
+    { "multi_get", &getM },
+    { "multi_exists", &existsM },
     { "multi_set", &setM },
     { "keys", &keys },
+    { "scan", &scan },
+    { "rscan", &rscan },
+    { "incr", &incr },
+    { "decr", &decr },
 };
 
-std::string encodeKey(const std::string &key)
+std::string encodeKey(const leveldb::Slice &key)
 {
-    return 'K' + key;
+    std::string newKey(1, 'K');
+    newKey.append(key.data(), key.size());
+    return newKey;
 }
 
-std::string decodeKey(const std::string &codedKey)
+// Read the keys in blocks[1...] from one snapshot. KV pairs share a single
+// key space with no count to judge density by, so they are read by Get.
+Status getM_(const CatchDBPtr db, const RequestPtr req,
+             std::vector<std::string> *values, std::vector<bool> *found)
 {
-    return codedKey.substr(1, std::string::npos);
+    std::vector<std::string> keys;
+    keys.reserve(req->blocks.size() - 1);
+    for (size_t i = 1; i < req->blocks.size(); ++i)
+        keys.push_back(encodeKey(req->blocks[i]));
+    return db->getM(keys, false, values, found);
+}
+
+Status scan_(const CatchDBPtr db, const RequestPtr req, ResponsePtr resp,
+             Iterator::Direction direction)
+{
+    size_t limit;
+    if (!Iterator::ParseLimit(req->blocks[3], &limit)) {
+        resp->push_back("limit should be a positive integer");
+        return Status::InvalidParameter;
+    }
+
+    std::unique_ptr<Iterator> it(db->newIterator("K", direction));
+    it->page(req->blocks[1], req->blocks[2], limit, resp);
+    if (it->status() != Status::OK)
+        return Status::Error;
+    return Status::OK;
+}
+
+Status incr_(const CatchDBPtr db, const RequestPtr req, ResponsePtr resp, bool negate)
+{
+    int64_t delta;
+    if (!ParseInt64(req->blocks[2].ToString(), &delta) ||
+        (negate && delta == INT64_MIN)) {
+        resp->push_back("delta should be an integer");
+        return Status::InvalidParameter;
+    }
+
+    int64_t value;
+    auto s = db->incr(encodeKey(req->blocks[1]), negate ? -delta : delta, &value);
+    if (s == Status::InvalidParameter) {
+        resp->push_back("value is not an integer or out of range");
+        return s;
+    }
+    if (s != Status::OK)
+        return s;
+    resp->push_back(std::to_string(value));
+    return Status::OK;
 }
 
 } // namespace
 
 Status process(const CatchDBPtr db, const RequestPtr req, ResponsePtr resp)
 {
-    std::string &cmd = req->blocks[0];
-    if (procMap.find(cmd) == procMap.end())
+    auto it = procMap.find(req->blocks[0].ToString());
+    if (it == procMap.end())
         return Status::NotImplemented;
-    auto func = procMap[cmd];
+    auto func = it->second;
     return (*func)(db, req, resp);
 }
 
@@ -50,7 +106,7 @@ Status get(const CatchDBPtr db, const RequestPtr req, ResponsePtr resp)
     auto key = encodeKey(req->blocks[1]);
     std::string val;
     auto s =  db->get(key, &val);
-    resp->push_back(val);
+    resp->push_back(std::move(val));
     return s;
 }
 
@@ -70,9 +126,9 @@ Status setM(const CatchDBPtr db, const RequestPtr req, ResponsePtr resp)
         return Status::InvalidParameter;
     }
 
-    std::map<std::string, std::string> kvs; // to remove duplicate in a multi_set
+    std::map<std::string, leveldb::Slice> kvs; // to remove duplicate in a multi_set
     for (int i = 1; i < size; i += 2) {
-        kvs[req->blocks[i]] = req->blocks[i + 1];
+        kvs[req->blocks[i].ToString()] = req->blocks[i + 1];
     }
 
     leveldb::WriteBatch batch;
@@ -86,31 +142,46 @@ Status setM(const CatchDBPtr db, const RequestPtr req, ResponsePtr resp)
 
 Status keys(const CatchDBPtr db, const RequestPtr req, ResponsePtr resp)
 {
-    std::unique_ptr<Iterator> it(db->newIterator("K", "K"));
-    auto keys = it->keys("K", "", 0);
+    std::unique_ptr<Iterator> it(db->newIterator("K"));
+    for (it->seek(); it->valid(); it->next()) {
+        resp->push_back(it->field().ToString());
+    }
     if (it->status() != Status::OK)
         return Status::Error;
-
-    for (auto &key : keys) {
-        resp->push_back(decodeKey(key));
-    }
     return Status::OK;
 }
 
 Status getall(const CatchDBPtr db, const RequestPtr req, ResponsePtr resp)
 {
-    std::unique_ptr<Iterator> it(db->newIterator("K", "K"));
-    auto kvs = it->range("K", "", 0);
+    std::unique_ptr<Iterator> it(db->newIterator("K"));
+    for (it->seek(); it->valid(); it->next()) {
+        resp->push_back(it->field().ToString());
+        resp->push_back(it->value().ToString());
+    }
     if (it->status() != Status::OK)
         return Status::Error;
-
-    for (auto &kv : kvs) {
-        resp->push_back(decodeKey(kv.key));
-        resp->push_back(kv.value);
-    }
     return Status::OK;
 }
 
+Status scan(const CatchDBPtr db, const RequestPtr req, ResponsePtr resp)
+{
+    return scan_(db, req, resp, Iterator::Direction::Forward);
+}
+
+Status rscan(const CatchDBPtr db, const RequestPtr req, ResponsePtr resp)
+{
+    return scan_(db, req, resp, Iterator::Direction::Reverse);
+}
+
+Status incr(const CatchDBPtr db, const RequestPtr req, ResponsePtr resp)
+{
+    return incr_(db, req, resp, false);
+}
+
+Status decr(const CatchDBPtr db, const RequestPtr req, ResponsePtr resp)
+{
+    return incr_(db, req, resp, true);
+}
 
 Status del(const CatchDBPtr db, const RequestPtr req, ResponsePtr resp)
 {
@@ -122,6 +193,7 @@ Status del(const CatchDBPtr db, const RequestPtr req, ResponsePtr resp)
 Status exists(const CatchDBPtr db, const RequestPtr req, ResponsePtr resp)
 {
     auto s = get(db, req, resp);
+    resp->clear();
     if (s == Status::NotFound) {
         resp->push_back("no");
     } else {
@@ -131,6 +203,37 @@ Status exists(const CatchDBPtr db, const RequestPtr req, ResponsePtr resp)
     return Status::OK;
 }
 
+Status getM(const CatchDBPtr db, const RequestPtr req, ResponsePtr resp)
+{
+    std::vector<std::string> values;
+    std::vector<bool> found;
+    auto s = getM_(db, req, &values, &found);
+    if (s != Status::OK)
+        return s;
+
+    for (size_t i = 0; i < values.size(); ++i) {
+        if (!found[i])
+            continue;
+        resp->push_back(req->blocks[i + 1].ToString());
+        resp->push_back(std::move(values[i]));
+    }
+    return Status::OK;
+}
+
+Status existsM(const CatchDBPtr db, const RequestPtr req, ResponsePtr resp)
+{
+    std::vector<std::string> values;
+    std::vector<bool> found;
+    auto s = getM_(db, req, &values, &found);
+    if (s != Status::OK)
+        return s;
+
+    for (size_t i = 0; i < values.size(); ++i) {
+        resp->push_back(req->blocks[i + 1].ToString());
+        resp->push_back(found[i] ? "yes" : "no");
+    }
+    return Status::OK;
+}
 
 } // namespace KV
 
@@ -18,7 +18,17 @@ Status set(const CatchDBPtr db, const RequestPtr req, ResponsePtr resp);
 Status setM(const CatchDBPtr db, const RequestPtr req, ResponsePtr resp);
 Status del(const CatchDBPtr db, const RequestPtr req, ResponsePtr resp);
 Status exists(const CatchDBPtr db, const RequestPtr req, ResponsePtr resp);
+// multi_get key ... -> key value ..., for the keys that exist
+Status getM(const CatchDBPtr db, const RequestPtr req, ResponsePtr resp);
+// multi_exists key ... -> key yes|no ...
+Status existsM(const CatchDBPtr db, const RequestPtr req, ResponsePtr resp);
 Status keys(const CatchDBPtr db, const RequestPtr req, ResponsePtr resp);
+// scan cursor end limit -> cursor key value ...
+Status scan(const CatchDBPtr db, const RequestPtr req, ResponsePtr resp);
+Status rscan(const CatchDBPtr db, const RequestPtr req, ResponsePtr resp);
+// incr key delta -> the new value, from 0 if key does not exist
+Status incr(const CatchDBPtr db, const RequestPtr req, ResponsePtr resp);
+Status decr(const CatchDBPtr db, const RequestPtr req, ResponsePtr resp);
 
 } // namespace KV
 
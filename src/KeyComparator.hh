@@ -0,0 +1,87 @@
+/*
+ * Comparator of the version 2 key format.
+ *
+ * Keys sort by plain memcmp, exactly as leveldb's bytewise comparator, and
+ * the comparator keeps its name so databases open with either of them.
+ * What differs is how SSTable index entries are shortened: leveldb gives
+ * up when the first differing bytes of two neighbouring keys are adjacent
+ * values, e.g. fields "item:10017" and "item:10020", or the names of
+ * consecutive containers, and then stores the whole key. Here the
+ * separator takes the rest of the left key until a byte can be raised
+ * instead.
+ *
+ * Every layout (K, H, Q, Z) orders by the same bytes, so a separator cut
+ * anywhere in the type, the name size, the name or the tail still falls
+ * between the two keys and no per type rule is needed.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <algorithm>
+#include "leveldb/comparator.h"
+#include "leveldb/slice.h"
+
+namespace catchdb
+{
+
+class KeyComparator : public leveldb::Comparator
+{
+public:
+    int Compare(const leveldb::Slice& a, const leveldb::Slice& b) const
+    {
+        return a.compare(b);
+    }
+
+    // same order as leveldb's bytewise comparator
+    const char* Name() const
+    {
+        return "leveldb.BytewiseComparator";
+    }
+
+    // Shorten @start to a key in [*start, limit).
+    void FindShortestSeparator(std::string* start, const leveldb::Slice& limit) const
+    {
+        size_t minLength = std::min(start->size(), limit.size());
+        size_t diff = 0;
+        while (diff < minLength && (*start)[diff] == limit[diff])
+            ++diff;
+        // one is a prefix of the other
+        if (diff >= minLength)
+            return;
+
+        uint8_t diffByte = static_cast<uint8_t>((*start)[diff]);
+        if (diffByte + 1 < static_cast<uint8_t>(limit[diff])) {
+            (*start)[diff]++;
+            start->resize(diff + 1);
+            return;
+        }
+
+        // start[diff] is just below limit[diff], anything longer than
+        // start[0..diff] stays below limit; raise the first byte after it
+        // that can be raised
+        for (size_t i = diff + 1; i < start->size(); ++i) {
+            if (static_cast<uint8_t>((*start)[i]) < 0xff) {
+                (*start)[i]++;
+                start->resize(i + 1);
+                return;
+            }
+        }
+    }
+
+    // Shorten @key to a key >= *key.
+    void FindShortSuccessor(std::string* key) const
+    {
+        for (size_t i = 0; i < key->size(); ++i) {
+            if (static_cast<uint8_t>((*key)[i]) != 0xff) {
+                (*key)[i]++;
+                key->resize(i + 1);
+                return;
+            }
+        }
+        // all 0xff, leave it
+    }
+};
+
+} // namespace catchdb
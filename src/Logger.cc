@@ -1,6 +1,7 @@
 #include "Logger.h"
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 #include <cassert>
 
 #define MAX_LOG_MESSAGE_LENGTH 1024
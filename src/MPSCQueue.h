@@ -0,0 +1,77 @@
+/*
+ * Unbounded lock-free multi-producer single-consumer queue.
+ *
+ * Producers link nodes with a single atomic exchange, the consumer walks
+ * the list without synchronizing with other consumers (there are none).
+ * Adapted from Dmitry Vyukov's intrusive MPSC node-based queue.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+namespace catchdb
+{
+
+template<typename T>
+class MPSCQueue
+{
+public:
+    MPSCQueue()
+    {
+        Node *stub = new Node;
+        head_.store(stub, std::memory_order_relaxed);
+        tail_ = stub;
+    }
+
+    ~MPSCQueue()
+    {
+        T value;
+        while (pop(&value));
+        delete tail_;
+    }
+
+    // may be called from any thread
+    void push(const T &value)
+    {
+        Node *node = new Node;
+        node->value = value;
+        Node *prev = head_.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    // must only be called from the consumer thread. A push that has not
+    // finished linking its node is not visible yet; the producer is
+    // expected to signal the consumer after push returns.
+    bool pop(T *value)
+    {
+        Node *tail = tail_;
+        Node *next = tail->next.load(std::memory_order_acquire);
+        if (next == nullptr)
+            return false;
+
+        *value = std::move(next->value);
+        tail_ = next;
+        delete tail;
+        return true;
+    }
+
+    // non-copyable
+    MPSCQueue(const MPSCQueue&) = delete;
+    MPSCQueue& operator=(const MPSCQueue&) = delete;
+
+private:
+    struct Node
+    {
+        std::atomic<Node*> next;
+        T value;
+
+        Node() : next(nullptr) {}
+    };
+
+    std::atomic<Node*> head_; // last pushed node, shared by producers
+    Node *tail_;              // stub node owned by the consumer
+};
+
+} // namespace catchdb
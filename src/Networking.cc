@@ -44,7 +44,8 @@ int SetNonBlocking(int fd)
     return 0;
 }
 
-int Listen(const std::string &ip, const std::string &port, int backlog)
+int Listen(const std::string &ip, const std::string &port, int backlog,
+           bool reusePort)
 {
     const char *ipstr = nullptr;
     if (!ip.empty())
@@ -74,6 +75,13 @@ int Listen(const std::string &ip, const std::string &port, int backlog)
         close(sockfd);
         return -1;
     }
+
+    if (reusePort &&
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) == -1) {
+        LogError("setsockopt SO_REUSEPORT: %s", ErrorDescription(errno));
+        close(sockfd);
+        return -1;
+    }
     
     if (bind(sockfd, res->ai_addr, res->ai_addrlen) == -1) {
         LogError("bind: %s", ErrorDescription(errno));
@@ -9,6 +9,9 @@ int SetTcpKeepAlive(int fd);
 
 int SetNonBlocking(int fd);
 
-int Listen(const std::string &ip, const std::string &port, int backlog);
+// with @reusePort set, several sockets may bind the same address and the
+// kernel balances incoming connections between them
+int Listen(const std::string &ip, const std::string &port, int backlog,
+           bool reusePort = false);
 
 } // namespace catchdb
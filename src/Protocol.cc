@@ -3,77 +3,122 @@
 #include <cstdlib>
 #include <cstring>
 #include <cctype>
+#include <cstdint>
+#include <limits>
+#include <algorithm>
 
 namespace catchdb
 {
 
+namespace
+{
+// the longest size line: INT_MAX, '\r' and '\n'
+const int MAX_SIZE_LINE = 12;
+} // namespace
+
 /******************** Request **********************/
 
-RequestPtr Request::ParseRequest(char *data, int *length, RequestPtr req)
+Request::Request()
+    : state(State::Partial), length(0),
+      base_(nullptr), parsed_(0), blockSize_(-1)
+{}
+
+void Request::reset()
 {
-    for (int i = 0; i < *length; ++i) {
-        putchar(*(data + i));
-    }
-    putchar('\n');
-    RequestPtr r;
-
-    if (req != nullptr) {
-        if (req->state != State::Partial)
-            return req;
-        r = req;
-    } else {
-        r = RequestPtr(new Request);
-    }
+    state = State::Partial;
+    blocks.clear(); // keeps capacity
+    length = 0;
+    base_ = nullptr;
+    parsed_ = 0;
+    blockSize_ = -1;
+}
 
-    int len = *length;
-    char *ptr = data;
-    while (len > 0) {
-        char *d = (char *)memchr(ptr, '\n', len);
-        if (d == nullptr) {
-            break;
-        }
-        ++d;
-
-        int num = d - ptr;
-        if(num == 1 || (num == 2 && ptr[0] == '\r')){
-            // Packet received.
-            len -= num;
-            *length -= len;
-            r->state = State::Complete;
-            return r;
-        }
+int Request::expected() const
+{
+    if (blockSize_ >= 0)
+        return parsed_ + blockSize_ + 2; // block, its '\n' and the final '\n'
+    return parsed_ + 1;
+}
 
-        if (!isdigit(ptr[0]))
-            goto error;
+Request::State Request::parse(const char *data, int size)
+{
+    if (state != State::Partial)
+        return state;
 
-        // Size received
-        int size = (int)strtol(ptr, nullptr, 10);
+    if (base_ != nullptr && base_ != data) {
+        // the buffer moved the request, rebase blocks parsed so far
+        for (auto &block : blocks) {
+            block = leveldb::Slice(data + (block.data() - base_), block.size());
+        }
+    }
+    base_ = data;
+
+    while (parsed_ < size) {
+        const char *ptr = data + parsed_;
+        int len = size - parsed_;
+
+        if (blockSize_ < 0) {
+            const char *nl = (const char *)memchr(ptr, '\n', std::min(len, MAX_SIZE_LINE));
+            if (nl == nullptr) {
+                // no size line is that long, don't wait for its end
+                if (len >= MAX_SIZE_LINE)
+                    goto error;
+                break;
+            }
+            int num = nl - ptr + 1;
+
+            if (num == 1 || (num == 2 && ptr[0] == '\r')) {
+                // Packet received.
+                parsed_ += num;
+                length = parsed_;
+                state = State::Complete;
+                return state;
+            }
+
+            // Size received
+            int64_t blockSize = 0;
+            int i = 0;
+            for (; i < num - 1 && isdigit(ptr[i]); ++i) {
+                blockSize = blockSize * 10 + (ptr[i] - '0');
+                if (blockSize > std::numeric_limits<int>::max())
+                    goto error;
+            }
+            if (i == 0 || !(i == num - 1 || (i == num - 2 && ptr[i] == '\r')))
+                goto error;
+
+            blockSize_ = static_cast<int>(blockSize);
+            parsed_ += num;
+            continue;
+        }
 
-        if (size < 0)
+        // Data received, followed by "\n" or "\r\n"
+        if (len < blockSize_ + 1)
+            break;
+        int tail;
+        if (ptr[blockSize_] == '\n') {
+            tail = 1;
+        } else if (ptr[blockSize_] == '\r') {
+            if (len < blockSize_ + 2)
+                break;
+            if (ptr[blockSize_ + 1] != '\n')
+                goto error;
+            tail = 2;
+        } else {
             goto error;
-
-        len -= num + size;
-        ptr += num + size;
-        if(len >= 1 && ptr[0] == '\n'){
-            len -= 1;
-            ptr += 1;
-        }else if(len >= 2 && ptr[0] == '\r' && ptr[1] == '\n'){
-            len -= 2;
-            ptr += 2;
-        }else{
-            len += num + size;
-            *length -= len;
-            r->state = State::Partial;
-            return r;
         }
-        // Data received
-        r->blocks.push_back(std::string(d, size));
+
+        blocks.push_back(leveldb::Slice(ptr, blockSize_));
+        parsed_ += blockSize_ + tail;
+        blockSize_ = -1;
     }
 
+    // the rest has not arrived yet
+    return state;
+
   error:
     // bad format
-    r->state = State::Error;
-    return r;
+    state = State::Error;
+    return state;
 }
 
 /*************** Command ********************/
@@ -92,17 +137,17 @@ std::map<std::string, CmdInfo> cmdMap = {
     { "rscan", { Category::KV, 4, Property::Read } },
     { "keys", { Category::KV, 1, Property::Read } },
     { "exists", { Category::KV, 2, Property::Read } },
-    // { "multi_exists", { Category::KV, 3, Property::Read } },
-    // { "multi_get", { Category::KV, 3, Property::Read } },
+    { "multi_exists", { Category::KV, 2, Property::Read } },
+    { "multi_get", { Category::KV, 2, Property::Read } },
     { "multi_set", { Category::KV, 3, Property::Write } },
-    // { "multi_del", { Category::KV, 3, Property::Read } },
+    // { "multi_del", { Category::KV, 3, Property::Write } },
 
     { "hsize", { Category::HashMap, 2, Property::Read } },
     { "hget", { Category::HashMap, 3, Property::Read } },
     { "hset", { Category::HashMap, 4, Property::Write } },
     { "hdel", { Category::HashMap, 3, Property::Write } },
     { "hincr", { Category::HashMap, 4, Property::Write } },
-    { "hdecr", { Category::HashMap, 3, Property::Write } },
+    { "hdecr", { Category::HashMap, 4, Property::Write } },
     { "hclear", { Category::HashMap, 2, Property::Write } },
     { "hgetall", { Category::HashMap, 2, Property::Read } },
     { "hscan", { Category::HashMap, 5, Property::Read } },
@@ -112,6 +157,7 @@ std::map<std::string, CmdInfo> cmdMap = {
     { "hlist", { Category::HashMap, 4, Property::Read } },
     { "hexists", { Category::HashMap, 3, Property::Read } },
     { "multi_hset", { Category::HashMap, 3, Property::Write } },
+    { "multi_hget", { Category::HashMap, 3, Property::Read } },
     // { "multi_hsize", { Category::HashMap, 3, Property::Read } },
 
     { "zget", { Category::ZSet, 3, Property::Read } },
@@ -127,18 +173,23 @@ std::map<std::string, CmdInfo> cmdMap = {
     { "zcount", { Category::ZSet, 4, Property::Read } },
     { "zsum", { Category::ZSet, 4, Property::Read } },
     { "zavg", { Category::ZSet, 4, Property::Read } },
-    { "zremrangebyrank", { Category::ZSet, 4, Property::Read } },
-    { "zremrangebyscore", { Category::ZSet, 4, Property::Read } },
+    { "zremrangebyrank", { Category::ZSet, 4, Property::Write } },
+    { "zremrangebyscore", { Category::ZSet, 4, Property::Write } },
+    { "zrank", { Category::ZSet, 3, Property::Read } },
+    { "zrrank", { Category::ZSet, 3, Property::Read } },
+    { "zrange", { Category::ZSet, 4, Property::Read } },
+    { "zrrange", { Category::ZSet, 4, Property::Read } },
     { "zexists", { Category::ZSet, 3, Property::Read } },
     { "zsize", { Category::ZSet, 2, Property::Read } },
     { "zmod", { Category::ZSet, 4, Property::Write } },
     { "ztopn", { Category::ZSet, 3, Property::Read } },
+    { "zrtopn", { Category::ZSet, 3, Property::Read } },
     { "zgetall", { Category::ZSet, 2, Property::Read } },
     { "multi_zexists", { Category::ZSet, 3, Property::Read } },
     { "multi_zsize", { Category::ZSet, 3, Property::Read } },
     { "multi_zget", { Category::ZSet, 3, Property::Read } },
-    { "multi_zset", { Category::ZSet, 3, Property::Read } },
-    { "multi_zdel", { Category::ZSet, 3, Property::Read } },
+    { "multi_zset", { Category::ZSet, 3, Property::Write } },
+    { "multi_zdel", { Category::ZSet, 3, Property::Write } },
 
     { "qsize", { Category::Queue, 2, Property::Read } },
     { "qfront", { Category::Queue, 2, Property::Read } },
@@ -153,7 +204,12 @@ std::map<std::string, CmdInfo> cmdMap = {
     { "qlist", { Category::Queue, 2, Property::Read } },
     { "qslice", { Category::Queue, 4, Property::Read } },
     { "qrange", { Category::Queue, 3, Property::Read } },
-    { "qget", { Category::Queue, 3, Property::Read } } 
+    { "qget", { Category::Queue, 3, Property::Read } },
+
+    { "durability", { Category::Server, 2, Property::Read } },
+    { "info", { Category::Server, 1, Property::Read } },
+    { "snapshot", { Category::Server, 1, Property::Read } },
+    { "release", { Category::Server, 1, Property::Read } }
 };
 
 
@@ -9,6 +9,7 @@
 #include <string>
 #include <memory>
 #include <map>
+#include "leveldb/slice.h"
 
 namespace catchdb
 {
@@ -21,17 +22,37 @@ struct Request
 
     State state;
 
-    std::vector<std::string> blocks;
+    // Non-owning views of the blocks inside the query buffer. They stay
+    // valid until the buffer consumes the request.
+    std::vector<leveldb::Slice> blocks;
 
-    // Parse received @data into blocks. If @req with partial state is supplied, then
-    // append blocks to req and return req. Otherwise a new Request is allocated.
-    // pass @length to be the size of data available, after parsing, it is the length
-    // of the bytes that has been parsed.
-    static RequestPtr ParseRequest(char *data, int *length, RequestPtr req);
+    // number of bytes the complete request spans
+    int length;
 
+    Request();
+
+    // Parse the request that starts at @data, @size bytes of which are
+    // available. A Partial request resumes where the last call stopped,
+    // so @data must be the start of the same request again, although it
+    // may have been moved in memory meanwhile. Nothing is allocated once
+    // blocks has grown to the usual number of blocks.
+    State parse(const char *data, int size);
+
+    // make the request ready to parse the next one
+    void reset();
+
+    // least number of bytes a Partial request spans, judging from what
+    // has been parsed so far
+    int expected() const;
+
+private:
+    const char *base_; // @data of the last parse call
+    int parsed_;       // bytes parsed so far
+    int blockSize_;    // size of the block being received, -1 if none
 };
 
-enum class Category { KV, Queue, HashMap, ZSet };
+// Server commands concern the connection or the server, not a key
+enum class Category { KV, Queue, HashMap, ZSet, Server };
 enum class Property { Read, Write };
 struct CmdInfo {
     Category category;
@@ -1,6 +1,7 @@
 #include "Queue.h"
 #include "Logger.h"
 #include "Util.h"
+#include "Iterator.h"
 #include "leveldb/db.h"
 #include "leveldb/options.h"
 #include "leveldb/write_batch.h"
@@ -8,6 +9,8 @@
 #include <limits>
 #include <stdexcept>
 #include <cstdio>
+#include <utility>
+#include <algorithm>
 
 namespace catchdb
 {
@@ -22,63 +25,47 @@ const uint64_t ITEM_SEQ_INIT = ITEM_MAX_SEQ / 2;
 } // namespace
 
 
+const std::map<std::string, Queue::proc_t> Queue::procMap = {
+    { "qsize", &Queue::size },
+    { "qfront", &Queue::front },
+    { "qback", &Queue::back },
+    { "qpush", &Queue::pushBack },
+    { "qpush_front", &Queue::pushFront },
+    { "qpush_back", &Queue::pushBack },
+    { "multi-qpush", &Queue::pushBackM },
+    { "multi-qpush_front", &Queue::pushFrontM },
+    { "multi-qpush_back", &Queue::pushBackM },
+    { "qpop", &Queue::popFront },
+    { "qpop_front", &Queue::popFront },
+    { "qpop_back", &Queue::popBack },
+    { "qclear", &Queue::clear },
+    { "qlist", &Queue::list },
+    { "qslice", &Queue::slice },
+    { "qget", &Queue::get }
+};
+
 Queue::Queue(const CatchDBPtr db, const std::string &queueName)
-    : db_(db), name_(queueName), size_(0)
+    : db_(db), name_(queueName), size_(0), loaded_(false)
 {
-    procMap = { { "qsize", &Queue::size },
-                { "qfront", &Queue::front },
-                { "qback", &Queue::back },
-                { "qpush", &Queue::pushBack },
-                { "qpush_front", &Queue::pushFront },
-                { "qpush_back", &Queue::pushBack },
-                { "multi-qpush", &Queue::pushBackM },
-                { "multi-qpush_front", &Queue::pushFrontM },
-                { "multi-qpush_back", &Queue::pushBackM },
-                { "qpop", &Queue::popFront },
-                { "qpop_front", &Queue::popFront },
-                { "qpop_back", &Queue::popBack },
-                { "qclear", &Queue::clear },
-                { "qlist", &Queue::list },
-                { "qslice", &Queue::slice },
-                { "qget", &Queue::get } };
-
-    keyTemplate_.append(1, QUEUE_TYPE_INDENTIFIRE);
-    uint16_t keySize = static_cast<uint16_t>(queueName.size());
-    keyTemplate_.append((char *)&keySize, sizeof (uint16_t));
-    keyTemplate_.append(queueName.data(), keySize);
-
-    Response resp;
-    (void) size(nullptr, &resp); // do not care whether succeed
+    EncodeName(&keyTemplate_, QUEUE_TYPE_INDENTIFIRE, queueName);
 }
 
 Status Queue::process(const RequestPtr req, ResponsePtr resp)
 {
-    std::string &cmd = req->blocks[0];
-    if (procMap.find(cmd) == procMap.end())
+    auto it = procMap.find(req->blocks[0].ToString());
+    if (it == procMap.end())
         return Status::NotImplemented;
-    auto func = procMap[cmd];
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!loaded_ && load() != Status::OK)
+        return Status::Error;
+    auto func = it->second;
     return (this->*func)(req, resp);
 }
 
 Status Queue::size(const RequestPtr &req, ResponsePtr resp)
 {
     (void) req;
-    if (size_ == 0) {
-        std::string val;
-        auto s = get_(META_RECORD_SEQ, &val);
-        if (s == Status::OK) {
-            auto v = decodeMetaValue(val);
-            size_ = std::get<0>(v);
-            frontSeq_ = std::get<1>(v);
-            backSeq_ = std::get<2>(v);
-        } else if (s == Status::NotFound){
-            size_ = 0;
-            frontSeq_ = ITEM_SEQ_INIT - 1;
-            backSeq_ = ITEM_SEQ_INIT;
-        } else {
-            return Status::Error;
-        }
-    }
     resp->push_back(std::to_string(size_));
     return Status::OK;
 }
@@ -93,7 +80,7 @@ Status Queue::front(const RequestPtr &req, ResponsePtr resp)
     (void) req;
     std::string val;
     auto s = get_(frontSeq_ + 1, &val);
-    resp->push_back(val);
+    resp->push_back(std::move(val));
     return s;
 }
 
@@ -102,7 +89,7 @@ Status Queue::back(const RequestPtr &req, ResponsePtr resp)
     (void) req;
     std::string val;
     auto s =  get_(backSeq_ - 1, &val);
-    resp->push_back(val);
+    resp->push_back(std::move(val));
     return s;
 }
 
@@ -110,7 +97,7 @@ Status Queue::get(const RequestPtr &req, ResponsePtr resp)
 {
     int64_t index;
     try {
-        index = std::stoll(req->blocks[2]);
+        index = std::stoll(req->blocks[2].ToString());
     } catch(...) {
         return Status::InvalidParameter;
     }
@@ -120,20 +107,18 @@ Status Queue::get(const RequestPtr &req, ResponsePtr resp)
 
     std::string val;
     auto s = get_(frontSeq_ + 1 + idx, &val);
-    resp->push_back(val);
+    resp->push_back(std::move(val));
     return s;
 }
 
 Status Queue::slice(const RequestPtr &req, ResponsePtr resp)
 {
-    // TODO IMPLEMENTED USING ITERATOR
-
     int64_t start;
     int64_t num;
 
     try {
-        start = std::stoll(req->blocks[2]);
-        num = std::stoll(req->blocks[3]);
+        start = std::stoll(req->blocks[2].ToString());
+        num = std::stoll(req->blocks[3].ToString());
     } catch(...) {
         return Status::InvalidParameter;
     }
@@ -145,42 +130,32 @@ Status Queue::slice(const RequestPtr &req, ResponsePtr resp)
     if (idx < 0 || idx >= size_)
         return Status::InvalidParameter;
 
-    for (auto i = 0; i < num; ++i) {
-        std::string val;
-        auto s = get_(frontSeq_ + 1 + i, &val);
-        if (s != Status::OK)
-            return s;
-        resp->push_back(val);
-    }
-
-    return Status::OK;
+    return range(frontSeq_ + 1 + idx, std::min<uint64_t>(num, size_ - idx), resp);
 }
 
 Status Queue::pushFront(const RequestPtr &req, ResponsePtr resp)
 {
     (void) resp;
-    std::string &value = req->blocks[2];
-    return push(Direction::Front, value);
+    return push(Direction::Front, req->blocks[2]);
 }
 
 Status Queue::pushFrontM(const RequestPtr &req, ResponsePtr resp)
 {
     (void) resp;
-    std::vector<std::string> values(resp->begin() + 2, resp->end());
+    std::vector<leveldb::Slice> values(req->blocks.begin() + 2, req->blocks.end());
     return pushM(Direction::Front, values);
 }
 
 Status Queue::pushBack(const RequestPtr &req, ResponsePtr resp)
 {
     (void) resp;
-    std::string &value = req->blocks[2];
-    return push(Direction::Back, value);
+    return push(Direction::Back, req->blocks[2]);
 }
 
 Status Queue::pushBackM(const RequestPtr &req, ResponsePtr resp)
 {
     (void) resp;
-    std::vector<std::string> values(resp->begin() + 2, resp->end());
+    std::vector<leveldb::Slice> values(req->blocks.begin() + 2, req->blocks.end());
     return pushM(Direction::Back, values);
 }
 
@@ -218,26 +193,39 @@ Status Queue::clear(const RequestPtr &req, ResponsePtr resp)
 
 Status Queue::list(const RequestPtr &req, ResponsePtr resp)
 {
-    for (uint64_t i = frontSeq_ + 1; i < backSeq_; ++i) {
-        std::string val;
-        auto s = get_(i, &val);
-        if (s != Status::OK)
-            return s;
-        resp->push_back(val);
-    }
-
-    return Status::OK;
+    return range(frontSeq_ + 1, size_, resp);
 }
 
 
 /*************** private member functions *******************/
+
+Status Queue::load()
+{
+    std::string val;
+    auto s = get_(META_RECORD_SEQ, &val);
+    if (s == Status::OK) {
+        auto v = decodeMetaValue(val);
+        size_ = std::get<0>(v);
+        frontSeq_ = std::get<1>(v);
+        backSeq_ = std::get<2>(v);
+    } else if (s == Status::NotFound){
+        size_ = 0;
+        frontSeq_ = ITEM_SEQ_INIT - 1;
+        backSeq_ = ITEM_SEQ_INIT;
+    } else {
+        return Status::Error;
+    }
+    loaded_ = true;
+    return Status::OK;
+}
+
 Status Queue::get_(uint64_t seq, std::string *ret)
 {
     auto key = encodeKey(seq);
     return db_->get(key, ret);
 }
 
-Status Queue::push(Direction direction, const std::string &value)
+Status Queue::push(Direction direction, const leveldb::Slice &value)
 {
     uint64_t seq, fseq, bseq;
     if (direction == Direction::Front) {
@@ -265,7 +253,7 @@ Status Queue::push(Direction direction, const std::string &value)
     return Status::Error;
 }
 
-Status Queue::pushM(Direction direction, const std::vector<std::string> &values)
+Status Queue::pushM(Direction direction, const std::vector<leveldb::Slice> &values)
 {
     uint64_t seq;
     int step;
@@ -338,10 +326,24 @@ Status Queue::pop(Direction direction)
     return Status::Error;
 }
 
+Status Queue::range(uint64_t seq, uint64_t count, ResponsePtr resp)
+{
+    std::string start;
+    EncodeUint64(&start, seq);
+    std::unique_ptr<Iterator> it(db_->newIterator(keyTemplate_));
+    it->seek(start);
+    for (uint64_t i = 0; i < count && it->valid(); ++i, it->next()) {
+        resp->push_back(it->value().ToString());
+    }
+    if (it->status() != Status::OK)
+        return Status::Error;
+    return Status::OK;
+}
+
 std::string Queue::encodeKey(uint64_t seq)
 {
     std::string key(keyTemplate_);
-    key.append((char *)&seq, sizeof (uint64_t));
+    EncodeUint64(&key, seq);
     return key;
 }
 
@@ -360,10 +362,8 @@ std::tuple<uint64_t, uint64_t, uint64_t> Queue::decodeMetaValue(const std::strin
 {
     const char *v = val.data();
     uint64_t queueSize = *((uint64_t *)v);
-    uint64_t frontSeq = *((uint64_t *)(v + sizeof (uint64_t)));
-    frontSeq = ToLittleEndian(frontSeq);
-    uint64_t backSeq = *((uint64_t *)(v + sizeof (uint64_t) + sizeof (uint64_t)));
-    backSeq = ToLittleEndian(backSeq);
+    uint64_t frontSeq = DecodeUint64(v + sizeof (uint64_t));
+    uint64_t backSeq = DecodeUint64(v + sizeof (uint64_t) + sizeof (uint64_t));
 
     return std::make_tuple(queueSize, frontSeq, backSeq);
 }
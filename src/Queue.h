@@ -3,15 +3,16 @@
  * consists of one write. 
  * 
  * With better design of key, records of the same type, same structure
- * will be stored contiguously, or at least nearby. Here I rely on the 
- * custom comparator function to achieve this goal. See AggregateComparator.hh
+ * will be stored contiguously, or at least nearby. Keys are encoded so
+ * that leveldb's bytewise order achieves this goal, see EncodeName.
  *
  * The idea is adapted from SSDB, with modification.
  * record format:
  * 'Q' | key_size | key | value
  * item record: key := SizeQueueName + QueueName + Sequence [ITEM_MIN_SEQ, ITEM_MAX_SEQ]; value := ItemValue
  * meta record: key := SizeQueueName + QueueName + Sequence 0; value := SIZE +QUEUE_FRONT_SEQ + QUEUE_BACK_SEQ
- * SizeQueueName : 2 bytes, i.e. key size is limited to 65536
+ * SizeQueueName : 2 bytes big-endian, i.e. key size is limited to 65536
+ * Sequence : 8 bytes big-endian
  */
 
 #pragma once
@@ -21,7 +22,10 @@
 #include <utility>
 #include <tuple>
 #include <memory>
+#include <mutex>
+#include <map>
 #include <cstdint>
+#include <chrono>
 #include "CatchDB.h"
 #include "Status.h"
 #include "Protocol.h"
@@ -37,6 +41,10 @@ public:
 
     Status process(const RequestPtr req, ResponsePtr resp);
 
+    // queues make no blind writes, nothing to fold or follow, see HashMap
+    Status foldOlder(std::chrono::steady_clock::duration age) { (void) age; return Status::OK; }
+    void follow(const std::shared_ptr<Queue> &shared) { (void) shared; }
+
     Status size(const RequestPtr &req, ResponsePtr resp);
 
     bool empty();
@@ -70,27 +78,36 @@ private:
     // std::map<std::string, 
     //          std::function<Status (const RequestPtr&, ResponsePtr)>> procMap;
 
-    std::map<std::string, proc_t> procMap;
+    static const std::map<std::string, proc_t> procMap;
 
     Status get_(uint64_t seq, std::string *ret);
+    // values of @count items from @seq on
+    Status range(uint64_t seq, uint64_t count, ResponsePtr resp);
 
     enum class Direction { Front, Back };
-    Status push(Direction direction, const std::string &ret);
-    Status pushM(Direction direction, const std::vector<std::string> &ret);
+    Status push(Direction direction, const leveldb::Slice &value);
+    Status pushM(Direction direction, const std::vector<leveldb::Slice> &values);
     Status pop(Direction direction);
 
     std::string encodeKey(uint64_t seq);
     std::string encodeMetaValue(uint64_t queueSize, uint64_t frontSeq, uint64_t backSeq);
     std::tuple<uint64_t, uint64_t, uint64_t> decodeMetaValue(const std::string &val);
 
+    // read the metadata record, once per object
+    Status load();
+
     CatchDBPtr db_;
     std::string name_;
     std::string keyTemplate_;
     uint64_t size_;
     uint64_t frontSeq_; // points to where TO BE insertd NEXT
     uint64_t backSeq_;
+
+    // one object per container is shared by all connections, see Registry
+    std::mutex mutex_;
+    bool loaded_;
 };
 
-typedef std::unique_ptr<Queue> QueuePtr;
+typedef std::shared_ptr<Queue> QueuePtr;
 
 } // namespace catchdb
@@ -0,0 +1,113 @@
+/*
+ * Server wide registry of container objects (HashMap, Queue, ZSet).
+ *
+ * A container object caches the metadata of its container, e.g. size and
+ * sequence numbers, which it reads once when first used. All connections
+ * share one object per container, serialized by the object's own mutex,
+ * so their view of the metadata never diverges and a connection touching
+ * a container pays no metadata read as long as the object stays here.
+ * The least recently used objects are dropped beyond @capacity, unless
+ * some connection still uses them. Blind writes an object left pending are
+ * folded before it is dropped, under the registry lock, so the next object
+ * of the container reads an exact size record.
+ */
+
+#pragma once
+
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include <chrono>
+#include "CatchDB.h"
+#include "Status.h"
+
+namespace catchdb
+{
+
+template <typename T>
+class Registry
+{
+public:
+    Registry(size_t capacity) : capacity_(capacity) {}
+
+    // the object of container @name, created when not cached
+    std::shared_ptr<T> get(const CatchDBPtr &db, const std::string &name)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        auto it = index_.find(name);
+        if (it != index_.end()) {
+            lru_.splice(lru_.begin(), lru_, it->second);
+            return it->second->second;
+        }
+
+        std::shared_ptr<T> obj(new T(db, name));
+        lru_.push_front(std::make_pair(name, obj));
+        index_[name] = lru_.begin();
+        evict();
+        return obj;
+    }
+
+    // the object of container @name if cached, else null; not made recent
+    std::shared_ptr<T> find(const std::string &name)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = index_.find(name);
+        if (it == index_.end())
+            return nullptr;
+        return it->second->second;
+    }
+
+    // calls @f on every cached object, outside the registry lock
+    template <typename F>
+    void forEach(F f)
+    {
+        std::vector<std::shared_ptr<T>> objs;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            objs.reserve(lru_.size());
+            for (auto &entry : lru_)
+                objs.push_back(entry.second);
+        }
+        for (auto &obj : objs)
+            f(*obj);
+    }
+
+    size_t size()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return lru_.size();
+    }
+
+    // non-copyable
+    Registry(const Registry&) = delete;
+    Registry& operator=(const Registry&) = delete;
+
+private:
+    typedef std::list<std::pair<std::string, std::shared_ptr<T>>> List;
+
+    void evict()
+    {
+        auto it = lru_.end();
+        while (lru_.size() > capacity_ && it != lru_.begin()) {
+            --it;
+            // objects in use are skipped, they go once released
+            if (it->second.use_count() > 1 ||
+                it->second->foldOlder(std::chrono::steady_clock::duration::zero()) != Status::OK)
+                continue;
+            index_.erase(it->first);
+            it = lru_.erase(it);
+        }
+    }
+
+    std::mutex mutex_;
+    size_t capacity_;
+    List lru_; // most recently used first
+    std::unordered_map<std::string, typename List::iterator> index_;
+};
+
+} // namespace catchdb
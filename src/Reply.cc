@@ -0,0 +1,150 @@
+#include "Reply.h"
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <climits>
+#include <algorithm>
+
+namespace catchdb
+{
+
+ReplyBuffer::ReplyBuffer()
+    : chunkIdx_(0), chunkUsed_(0), pos_(0)
+{}
+
+void ReplyBuffer::append(const char *data, size_t len)
+{
+    if (len == 0)
+        return;
+
+    if (len > ARENA_CHUNK_SIZE) {
+        pinned_.push_back(std::string(data, len));
+        addIov(pinned_.back().data(), len);
+        return;
+    }
+
+    if (chunks_.empty() || ARENA_CHUNK_SIZE - chunkUsed_ < len) {
+        if (!chunks_.empty())
+            ++chunkIdx_;
+        if (chunkIdx_ == chunks_.size())
+            chunks_.push_back(std::unique_ptr<char[]>(new char[ARENA_CHUNK_SIZE]));
+        chunkUsed_ = 0;
+    }
+
+    char *dst = chunks_[chunkIdx_].get() + chunkUsed_;
+    memcpy(dst, data, len);
+    chunkUsed_ += len;
+    addIov(dst, len);
+}
+
+void ReplyBuffer::appendStatic(const char *data, size_t len)
+{
+    addIov(data, len);
+}
+
+void ReplyBuffer::appendBlock(const leveldb::Slice &block)
+{
+    appendLength(block.size());
+    if (block.size() + 1 <= MAX_INLINE_BLOCK) {
+        append(block.data(), block.size());
+    } else {
+        pinned_.push_back(block.ToString());
+        addIov(pinned_.back().data(), block.size());
+    }
+    append("\n", 1);
+}
+
+void ReplyBuffer::appendBlock(std::string &&block)
+{
+    size_t len = block.size();
+    appendLength(len);
+    if (len + 1 <= MAX_INLINE_BLOCK) {
+        append(block.data(), len);
+    } else {
+        pinned_.push_back(std::move(block));
+        addIov(pinned_.back().data(), len);
+    }
+    append("\n", 1);
+}
+
+Status ReplyBuffer::send(int fd)
+{
+    while (pos_ < iov_.size()) {
+        int cnt = static_cast<int>(std::min<size_t>(iov_.size() - pos_, IOV_MAX));
+        ssize_t n = ::writev(fd, &iov_[pos_], cnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return Status::Progress;
+            return Status::Error;
+        }
+
+        advance(n);
+    }
+
+    clear();
+    return Status::OK;
+}
+
+const struct iovec* ReplyBuffer::pending(size_t *count) const
+{
+    *count = iov_.size() - pos_;
+    return iov_.data() + pos_;
+}
+
+void ReplyBuffer::advance(size_t len)
+{
+    while (len > 0 && len >= iov_[pos_].iov_len) {
+        len -= iov_[pos_].iov_len;
+        ++pos_;
+    }
+    if (len > 0) {
+        iov_[pos_].iov_base = static_cast<char*>(iov_[pos_].iov_base) + len;
+        iov_[pos_].iov_len -= len;
+    }
+    if (pos_ == iov_.size())
+        clear();
+}
+
+void ReplyBuffer::clear()
+{
+    if (chunks_.size() > 1)
+        chunks_.resize(1);
+    chunkIdx_ = 0;
+    chunkUsed_ = 0;
+    pinned_.clear();
+    iov_.clear();
+    pos_ = 0;
+}
+
+/***************** private ***********************/
+
+void ReplyBuffer::appendLength(size_t len)
+{
+    char buf[24];
+    int n = snprintf(buf, sizeof buf, "%zu\n", len);
+    append(buf, n);
+}
+
+void ReplyBuffer::addIov(const char *base, size_t len)
+{
+    if (len == 0)
+        return;
+
+    // pieces copied one after another into the same chunk share an iovec
+    if (iov_.size() > pos_) {
+        auto &last = iov_.back();
+        if (static_cast<char*>(last.iov_base) + last.iov_len == base) {
+            last.iov_len += len;
+            return;
+        }
+    }
+
+    struct iovec iov;
+    iov.iov_base = const_cast<char*>(base);
+    iov.iov_len = len;
+    iov_.push_back(iov);
+}
+
+} // namespace catchdb
@@ -0,0 +1,71 @@
+/*
+ * Reply buffer sent with writev.
+ *
+ * Small pieces, i.e. block lengths, separators and short blocks, are
+ * copied into an arena of fixed chunks, adjacent pieces share an iovec.
+ * Large blocks are moved into the buffer and referenced in place, so a
+ * reply of several MB is never copied again after the command produced
+ * it. A partial write resumes at the first byte not sent yet.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <sys/uio.h>
+#include "leveldb/slice.h"
+#include "Status.h"
+
+namespace catchdb
+{
+
+class ReplyBuffer
+{
+public:
+    // blocks up to this size are copied into the arena
+    static const size_t MAX_INLINE_BLOCK = 512;
+    static const size_t ARENA_CHUNK_SIZE = 4096;
+
+    ReplyBuffer();
+
+    bool empty() const { return pos_ == iov_.size(); }
+
+    // copy raw bytes
+    void append(const char *data, size_t len);
+    // reference raw bytes that live as long as the process, e.g. literals
+    void appendStatic(const char *data, size_t len);
+
+    // add a block framed as "<len>\n<data>\n"
+    void appendBlock(const leveldb::Slice &block);
+    void appendBlock(std::string &&block);
+
+    // write as much as the socket takes; OK when everything has been
+    // written, Progress once writev returned EAGAIN
+    Status send(int fd);
+
+    // for a caller writing the reply itself: the iovecs not written yet,
+    // then how many bytes of them were, which clear()s once all were
+    const struct iovec* pending(size_t *count) const;
+    void advance(size_t len);
+
+    // drop everything, the first arena chunk is kept for the next reply
+    void clear();
+
+private:
+    void appendLength(size_t len);
+    void addIov(const char *base, size_t len);
+
+    std::vector<std::unique_ptr<char[]>> chunks_;
+    size_t chunkIdx_;  // chunk being filled
+    size_t chunkUsed_; // bytes used in it
+
+    // large blocks moved in; a deque never moves its elements
+    std::deque<std::string> pinned_;
+
+    std::vector<struct iovec> iov_;
+    size_t pos_; // first iovec not completely written
+};
+
+} // namespace catchdb
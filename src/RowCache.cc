@@ -0,0 +1,122 @@
+#include "RowCache.h"
+#include "Util.h"
+
+namespace catchdb
+{
+
+RowCache::RowCache(size_t capacity)
+    : capacity_(capacity), stripeCapacity_(capacity / NUM_STRIPES)
+{
+    for (size_t i = 0; i < NUM_STRIPES; ++i)
+        stripes_.push_back(std::unique_ptr<Stripe>(new Stripe()));
+}
+
+bool RowCache::lookup(const leveldb::Slice &key, std::string *value, uint64_t *ticket)
+{
+    Stripe &stripe = stripeOf(key);
+    std::lock_guard<std::mutex> lock(stripe.mutex);
+
+    auto it = stripe.index.find(key);
+    if (it == stripe.index.end()) {
+        *ticket = stripe.erases;
+        ++stripe.misses;
+        return false;
+    }
+    it->second->referenced = true;
+    value->assign(it->second->value);
+    ++stripe.hits;
+    return true;
+}
+
+void RowCache::insert(const leveldb::Slice &key, const leveldb::Slice &value, uint64_t ticket)
+{
+    size_t charge = key.size() + value.size() + ENTRY_OVERHEAD;
+    if (charge > stripeCapacity_)
+        return;
+
+    Stripe &stripe = stripeOf(key);
+    std::lock_guard<std::mutex> lock(stripe.mutex);
+
+    // written since it was read, or cached meanwhile by another reader
+    if (stripe.erases != ticket || stripe.index.count(key) > 0)
+        return;
+
+    while (stripe.bytes + charge > stripeCapacity_ && !stripe.ring.empty()) {
+        if (stripe.hand == stripe.ring.end())
+            stripe.hand = stripe.ring.begin();
+        if (stripe.hand->referenced) {
+            stripe.hand->referenced = false;
+            ++stripe.hand;
+        } else {
+            remove(stripe, stripe.hand++);
+        }
+    }
+
+    auto it = stripe.ring.insert(stripe.hand, Entry());
+    it->key.assign(key.data(), key.size());
+    it->value.assign(value.data(), value.size());
+    it->referenced = false;
+    stripe.index[leveldb::Slice(it->key)] = it;
+    stripe.bytes += charge;
+}
+
+void RowCache::erase(const leveldb::Slice &key)
+{
+    Stripe &stripe = stripeOf(key);
+    std::lock_guard<std::mutex> lock(stripe.mutex);
+
+    ++stripe.erases;
+    auto it = stripe.index.find(key);
+    if (it != stripe.index.end())
+        remove(stripe, it->second);
+}
+
+uint64_t RowCache::hits() const
+{
+    uint64_t n = 0;
+    for (auto &stripe : stripes_)
+        n += stripe->hits.load();
+    return n;
+}
+
+uint64_t RowCache::misses() const
+{
+    uint64_t n = 0;
+    for (auto &stripe : stripes_)
+        n += stripe->misses.load();
+    return n;
+}
+
+size_t RowCache::bytes()
+{
+    size_t n = 0;
+    for (auto &stripe : stripes_) {
+        std::lock_guard<std::mutex> lock(stripe->mutex);
+        n += stripe->bytes;
+    }
+    return n;
+}
+
+/***************** private ***********************/
+
+size_t RowCache::SliceHash::operator()(const leveldb::Slice &s) const
+{
+    return Hash64(s.data(), s.size());
+}
+
+RowCache::Stripe& RowCache::stripeOf(const leveldb::Slice &key)
+{
+    // the top bits, the index buckets by the low ones
+    return *stripes_[(Hash64(key.data(), key.size()) >> 60) % NUM_STRIPES];
+}
+
+void RowCache::remove(Stripe &stripe, Ring::iterator it)
+{
+    if (stripe.hand == it)
+        ++stripe.hand;
+    stripe.bytes -= it->key.size() + it->value.size() + ENTRY_OVERHEAD;
+    stripe.index.erase(leveldb::Slice(it->key));
+    stripe.ring.erase(it);
+}
+
+} // namespace catchdb
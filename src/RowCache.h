@@ -0,0 +1,93 @@
+/*
+ * Cache of hot records in front of leveldb.
+ *
+ * Values are kept as read, keyed by the full encoded key, in stripes
+ * picked by the hash of the key, each with its own mutex, so readers of
+ * different keys rarely contend. A stripe evicts by CLOCK: a hit only
+ * sets the entry's reference bit, and the hand sweeping for room spares
+ * referenced entries once, so keys read again between two sweeps stay.
+ *
+ * Writers erase the keys they wrote once their write is in leveldb. A
+ * reader that missed takes a ticket, the stripe's erase count, before it
+ * reads leveldb, and its insert is dropped if some erase came in between,
+ * so a value read before a write never lands in the cache after it.
+ */
+
+#pragma once
+
+#include <string>
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include "leveldb/slice.h"
+
+namespace catchdb
+{
+
+class RowCache
+{
+public:
+    // @capacity bytes of keys and values, shared by all stripes
+    RowCache(size_t capacity);
+
+    // On a hit copy the value to @value and return true, else set
+    // @ticket for the insert of the value read instead.
+    bool lookup(const leveldb::Slice &key, std::string *value, uint64_t *ticket);
+    void insert(const leveldb::Slice &key, const leveldb::Slice &value, uint64_t ticket);
+    void erase(const leveldb::Slice &key);
+
+    uint64_t hits() const;
+    uint64_t misses() const;
+    size_t bytes();
+    size_t capacity() const { return capacity_; }
+
+    RowCache(const RowCache&) = delete;
+    RowCache& operator=(const RowCache&) = delete;
+
+private:
+    static const size_t NUM_STRIPES = 16;
+    // per entry bookkeeping charged on top of key and value
+    static const size_t ENTRY_OVERHEAD = 64;
+
+    struct Entry
+    {
+        std::string key;
+        std::string value;
+        bool referenced;
+    };
+
+    struct SliceHash
+    {
+        size_t operator()(const leveldb::Slice &s) const;
+    };
+
+    typedef std::list<Entry> Ring;
+
+    struct Stripe
+    {
+        std::mutex mutex;
+        Ring ring; // the clock, new entries go just behind the hand
+        Ring::iterator hand;
+        std::unordered_map<leveldb::Slice, Ring::iterator, SliceHash> index; // into Entry::key
+        size_t bytes;
+        uint64_t erases; // tickets
+        std::atomic<uint64_t> hits;
+        std::atomic<uint64_t> misses;
+
+        Stripe() : hand(ring.end()), bytes(0), erases(0), hits(0), misses(0) {}
+    };
+
+    Stripe& stripeOf(const leveldb::Slice &key);
+    // unlink @it, under the stripe's mutex
+    void remove(Stripe &stripe, Ring::iterator it);
+
+    size_t capacity_;
+    size_t stripeCapacity_;
+    std::vector<std::unique_ptr<Stripe>> stripes_;
+};
+
+} // namespace catchdb
@@ -0,0 +1,383 @@
+#include "UringLoop.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <poll.h>
+#include <limits.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include "Buffer.h"
+#include "Logger.h"
+#include "Networking.h"
+#include "Util.h"
+
+namespace catchdb
+{
+
+namespace
+{
+
+const unsigned RING_ENTRIES = 4096;
+// receive buffers of a loop, a power of 2
+const int NUM_BUFFERS = 256;
+const uint16_t BUFFER_GROUP = 0;
+// sendmsg linked in one chain, a longer reply is sent by several
+const size_t MAX_CHAIN = 8;
+
+uint64_t UserData(int op, int fd)
+{
+    return (static_cast<uint64_t>(op) << 32) | static_cast<uint32_t>(fd);
+}
+
+} // namespace
+
+UringLoop::UringLoop(const CatchDBPtr &db, const ConfigPtr &config, WorkerPool *pool)
+    : db_(db), config_(config), pool_(pool), maxfds_(0), recycled_(false)
+{
+    if (pool_ != nullptr)
+        completions_.reset(new CompletionQueue);
+}
+
+UringLoop::~UringLoop()
+{
+    for (auto buf : buffers_)
+        Buffer::ReleaseSlab(buf);
+}
+
+bool UringLoop::init(const std::vector<int> &listenFds, int maxfds)
+{
+    if (!ring_.init(RING_ENTRIES))
+        return false;
+
+    for (int i = 0; i < NUM_BUFFERS; ++i)
+        buffers_.push_back(Buffer::AcquireSlab());
+    if (!ring_.provideBuffers(BUFFER_GROUP, buffers_, Buffer::SLAB_SIZE))
+        return false;
+
+    maxfds_ = maxfds;
+    for (auto fd : listenFds)
+        armAccept(fd);
+    if (pool_ != nullptr)
+        armWake();
+    return true;
+}
+
+void UringLoop::run()
+{
+    while (true) {
+        if (!ring_.submit(1)) {
+            LogFatal("io_uring_enter: %s", ErrorDescription(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = ring_.peek()) != nullptr) {
+            uint64_t data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            ring_.seen();
+
+            int fd = static_cast<int>(data & 0xffffffff);
+            switch (data >> 32) {
+                case OP_ACCEPT:
+                    onAccept(fd, res, flags);
+                    break;
+                case OP_RECV:
+                    onRecv(fd, res, flags);
+                    break;
+                case OP_SEND:
+                    onSend(fd, res);
+                    break;
+                case OP_WAKE:
+                    onWake(flags);
+                    break;
+            }
+        }
+
+        // buffers came back, receive again where they ran out
+        if (recycled_ && !starved_.empty()) {
+            std::vector<int> starved;
+            starved.swap(starved_);
+            for (auto fd : starved) {
+                Conn &conn = conns_[fd];
+                if (!conn.starved)
+                    continue;
+                conn.starved = false;
+                armRecv(fd);
+            }
+        }
+        recycled_ = false;
+    }
+}
+
+void UringLoop::armAccept(int fd)
+{
+    struct io_uring_sqe *sqe = ring_.getSqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = UserData(OP_ACCEPT, fd);
+}
+
+void UringLoop::armRecv(int fd)
+{
+    struct io_uring_sqe *sqe = ring_.getSqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = UserData(OP_RECV, fd);
+    conns_[fd].receiving = true;
+}
+
+void UringLoop::armWake()
+{
+    struct io_uring_sqe *sqe = ring_.getSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = completions_->fd();
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = UserData(OP_WAKE, completions_->fd());
+}
+
+void UringLoop::onAccept(int serverfd, int res, unsigned flags)
+{
+    if (!(flags & IORING_CQE_F_MORE))
+        armAccept(serverfd);
+    if (res < 0) {
+        LogError("accept: %s", ErrorDescription(-res));
+        return;
+    }
+
+    int clientfd = res;
+    struct sockaddr_storage sa;
+    socklen_t len = sizeof sa;
+    char ipstr[INET6_ADDRSTRLEN] = "";
+    uint16_t port = 0;
+    if (getpeername(clientfd, (struct sockaddr *)&sa, &len) == 0) {
+        if (sa.ss_family == AF_INET) {
+            struct sockaddr_in *s = (struct sockaddr_in *)&sa;
+            inet_ntop(AF_INET, (void*)&(s->sin_addr), ipstr, INET6_ADDRSTRLEN);
+            port = ntohs(s->sin_port);
+        } else {
+            struct sockaddr_in6 *s = (struct sockaddr_in6 *)&sa;
+            inet_ntop(AF_INET6, (void*)&(s->sin6_addr), ipstr, INET6_ADDRSTRLEN);
+            port = ntohs(s->sin6_port);
+        }
+    }
+    LogInfo("Accepted: %s:%d", ipstr, port);
+
+    SetTcpNoDelay(clientfd);
+    SetTcpKeepAlive(clientfd);
+
+    Client *client = nullptr;
+    if (clientfd < maxfds_)
+        client = Client::CreateClient(clientfd, ipstr, port,
+                                      config_->maxQueryBuffer * 1024 * 1024, this);
+    if (client == nullptr) {
+        LogWarning("Too many clients, refuse %s:%d", ipstr, port);
+        ::close(clientfd);
+        return;
+    }
+
+    if (clientfd >= static_cast<int>(conns_.size()))
+        conns_.resize(std::min(std::max(2 * conns_.size(), static_cast<size_t>(clientfd) + 1),
+                               static_cast<size_t>(maxfds_)));
+    Conn &conn = conns_[clientfd];
+    conn = Conn();
+    conn.client = client;
+    armRecv(clientfd);
+}
+
+void UringLoop::onRecv(int fd, int res, unsigned flags)
+{
+    Conn &conn = conns_[fd];
+    int bid = IoUring::bufferOf(flags);
+    bool more = flags & IORING_CQE_F_MORE;
+    if (!more)
+        conn.receiving = false;
+
+    if (res > 0 && !conn.closing) {
+        Input in = { bid, 0, res };
+        conn.input.push_back(in);
+        if (!more)
+            armRecv(fd);
+        pump(fd);
+        return;
+    }
+    if (bid >= 0)
+        recycle(bid);
+
+    if (conn.closing) {
+        finish(fd);
+    } else if (res == -ENOBUFS) {
+        // every buffer holds input not taken yet, wait for one to come back
+        if (!more) {
+            conn.starved = true;
+            starved_.push_back(fd);
+        }
+    } else if (res == 0) {
+        LogError("close connection %s:%d",
+                 conn.client->getRemoteIPString().c_str(),
+                 conn.client->getRemotePort());
+        close(fd);
+    } else if (res < 0) {
+        LogError("recv error: %s. close connection %s:%d",
+                 ErrorDescription(-res),
+                 conn.client->getRemoteIPString().c_str(),
+                 conn.client->getRemotePort());
+        close(fd);
+    }
+}
+
+void UringLoop::onSend(int fd, int res)
+{
+    Conn &conn = conns_[fd];
+    // a failed or short sendmsg cancels the rest of its chain
+    if (res >= 0)
+        conn.sent += res;
+    else if (res != -ECANCELED && conn.error == 0)
+        conn.error = -res;
+    if (--conn.sends > 0)
+        return;
+
+    if (conn.closing) {
+        finish(fd);
+        return;
+    }
+    if (conn.error != 0) {
+        LogError("send error: %s. close connection %s:%d",
+                 ErrorDescription(conn.error),
+                 conn.client->getRemoteIPString().c_str(),
+                 conn.client->getRemotePort());
+        close(fd);
+        return;
+    }
+
+    conn.client->resultWritten(conn.sent);
+    send(fd);
+}
+
+void UringLoop::onWake(unsigned flags)
+{
+    if (!(flags & IORING_CQE_F_MORE))
+        armWake();
+    completions_->clearSignal();
+
+    Client *client;
+    while (completions_->pop(&client)) {
+        int fd = client->getFd();
+        Conn &conn = conns_[fd];
+        conn.atWorker = false;
+        if (conn.closing)
+            finish(fd);
+        else
+            send(fd);
+    }
+}
+
+void UringLoop::pump(int fd)
+{
+    Conn &conn = conns_[fd];
+    Client *client = conn.client;
+    while (!conn.input.empty() && conn.sends == 0 && !conn.atWorker) {
+        Input &in = conn.input.front();
+        int taken;
+        auto s = client->takeQuery(ring_.buffer(in.bid) + in.offset, in.len, &taken);
+        if (s == Status::Error) {
+            LogError("bad request. close connection %s:%d",
+                     client->getRemoteIPString().c_str(),
+                     client->getRemotePort());
+            close(fd);
+            return;
+        }
+
+        in.offset += taken;
+        in.len -= taken;
+        if (in.len == 0) {
+            recycle(in.bid);
+            conn.input.pop_front();
+        }
+        if (s == Status::Progress)
+            continue;
+
+        if (pool_ != nullptr) {
+            conn.atWorker = true;
+            pool_->submit(client, completions_.get(), client->affinity());
+            return;
+        }
+        client->executeCommand(db_);
+        send(fd);
+    }
+}
+
+void UringLoop::send(int fd)
+{
+    Conn &conn = conns_[fd];
+    size_t count;
+    const struct iovec *iov = conn.client->pendingResult(&count);
+    if (count == 0) {
+        pump(fd);
+        return;
+    }
+
+    conn.msgs.clear();
+    for (size_t i = 0; i < count && conn.msgs.size() < MAX_CHAIN; i += IOV_MAX) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov = const_cast<struct iovec*>(iov + i);
+        msg.msg_iovlen = std::min<size_t>(count - i, IOV_MAX);
+        conn.msgs.push_back(msg);
+    }
+
+    ring_.reserve(conn.msgs.size());
+    for (size_t i = 0; i < conn.msgs.size(); ++i) {
+        struct io_uring_sqe *sqe = ring_.getSqe();
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uint64_t>(&conn.msgs[i]);
+        sqe->len = 1;
+        // retried until everything is written, a short send breaks the chain
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        if (i + 1 < conn.msgs.size())
+            sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = UserData(OP_SEND, fd);
+    }
+    conn.sends = conn.msgs.size();
+    conn.sent = 0;
+    conn.error = 0;
+}
+
+void UringLoop::recycle(int bid)
+{
+    ring_.recycleBuffer(bid);
+    recycled_ = true;
+}
+
+void UringLoop::close(int fd)
+{
+    Conn &conn = conns_[fd];
+    if (conn.closing)
+        return;
+    conn.closing = true;
+    // completes the recv and the sends still in flight
+    shutdown(fd, SHUT_RDWR);
+    for (auto &in : conn.input)
+        recycle(in.bid);
+    conn.input.clear();
+    finish(fd);
+}
+
+void UringLoop::finish(int fd)
+{
+    Conn &conn = conns_[fd];
+    if (conn.client == nullptr || conn.receiving || conn.sends > 0 || conn.atWorker)
+        return;
+    Client::DestroyClient(conn.client);
+    conn = Conn();
+}
+
+} // namespace catchdb
@@ -0,0 +1,115 @@
+/*
+ * Event loop driven by io_uring completions instead of epoll readiness.
+ *
+ * A multishot accept per listening socket and a multishot recv per client
+ * stay armed for as long as they are not interrupted; the kernel receives
+ * into 16 KB slabs of a provided buffer ring, so no memory is held by a
+ * connection that has nothing to say. Requests are copied from there into
+ * the client's query buffer and executed as with epoll. A reply is sent
+ * by a chain of linked sendmsg, so one submission writes all of it in
+ * order; the client takes no new request until the chain completed.
+ *
+ * Every submission and completion of an iteration goes through a single
+ * io_uring_enter, where epoll needs one system call per read and write.
+ */
+
+#pragma once
+
+#include <deque>
+#include <vector>
+#include <sys/socket.h>
+#include "IoUring.h"
+#include "Client.h"
+#include "Config.h"
+#include "CatchDB.h"
+#include "WorkerPool.h"
+
+namespace catchdb
+{
+
+class UringLoop
+{
+public:
+    // @pool may be nullptr: commands are executed on the loop
+    UringLoop(const CatchDBPtr &db, const ConfigPtr &config, WorkerPool *pool);
+    ~UringLoop();
+
+    // false, with errno set, if io_uring can't be set up on this kernel,
+    // the caller falls back to epoll then
+    bool init(const std::vector<int> &listenFds, int maxfds);
+
+    void run();
+
+    // non-copyable
+    UringLoop(const UringLoop&) = delete;
+    UringLoop& operator=(const UringLoop&) = delete;
+
+private:
+    // what a completion is for, in the upper half of its user_data; the
+    // fd is in the lower one
+    enum Op { OP_ACCEPT = 1, OP_RECV = 2, OP_SEND = 3, OP_WAKE = 4 };
+
+    // a provided buffer received into, from @offset on @len bytes are
+    // not taken by the client yet
+    struct Input
+    {
+        int bid;
+        int offset;
+        int len;
+    };
+
+    struct Conn
+    {
+        Client *client; // nullptr: no connection on this fd
+        std::deque<Input> input;
+        std::vector<struct msghdr> msgs; // of the send chain in flight
+        int sends; // sendmsg of the chain not completed yet
+        size_t sent;
+        int error; // first error of the chain
+        bool receiving; // the multishot recv is armed
+        bool starved; // the recv stopped for lack of buffers
+        bool atWorker;
+        bool closing;
+
+        Conn()
+            : client(nullptr), sends(0), sent(0), error(0), receiving(false),
+              starved(false), atWorker(false), closing(false) {}
+    };
+
+    void armAccept(int fd);
+    void armRecv(int fd);
+    void armWake();
+
+    void onAccept(int fd, int res, unsigned flags);
+    void onRecv(int fd, int res, unsigned flags);
+    void onSend(int fd, int res);
+    void onWake(unsigned flags);
+
+    // feed the input received to the client and execute what it parsed,
+    // until a reply or a worker keeps it busy
+    void pump(int fd);
+    // send the reply queued, pump once it is all written
+    void send(int fd);
+    void recycle(int bid);
+
+    // shut the connection down, it is destroyed once no operation on it
+    // is in flight
+    void close(int fd);
+    void finish(int fd);
+
+    CatchDBPtr db_;
+    ConfigPtr config_;
+    WorkerPool *pool_;
+    std::unique_ptr<CompletionQueue> completions_;
+
+    IoUring ring_;
+    std::vector<char*> buffers_;
+    int maxfds_;
+    // fd -> Conn, grown on demand up to maxfds_; a deque, as the msghdrs
+    // of a chain in flight must stay in place
+    std::deque<Conn> conns_;
+    std::vector<int> starved_;
+    bool recycled_; // a buffer went back to the ring since starved_ was armed
+};
+
+} // namespace catchdb
@@ -1,6 +1,9 @@
 #include "Util.h"
 #include <endian.h>
 #include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <ctype.h>
 
 namespace catchdb
 {
@@ -22,6 +25,19 @@ uint64_t ToLittleEndian(uint64_t n)
     return htole64(n);
 }
 
+bool ParseInt64(const std::string &s, int64_t *n)
+{
+    if (s.empty() || isspace(static_cast<unsigned char>(s[0])))
+        return false;
+    char *end;
+    errno = 0;
+    long long v = strtoll(s.c_str(), &end, 10);
+    if (errno != 0 || end != s.c_str() + s.size())
+        return false;
+    *n = v;
+    return true;
+}
+
 
 const char *ErrorDescription(int errnum)
 {
@@ -31,86 +47,101 @@ const char *ErrorDescription(int errnum)
     return strerror_r(errnum, buf, 1024);
 }
 
-bool BeginWith(const std::string &a, const std::string &b)
+void EncodeName(std::string *key, char type, const std::string &name)
 {
-    if (a.size() < b.size()) {
-        return false;
+    uint16_t size = static_cast<uint16_t>(name.size());
+    key->push_back(type);
+    key->push_back(static_cast<char>(size >> 8));
+    key->push_back(static_cast<char>(size & 0xff));
+    key->append(name.data(), size);
+}
+
+void EncodeUint64(std::string *key, uint64_t n)
+{
+    n = htobe64(n);
+    key->append(reinterpret_cast<const char*>(&n), sizeof n);
+}
+
+uint64_t DecodeUint64(const char *p)
+{
+    uint64_t n;
+    memcpy(&n, p, sizeof n);
+    return be64toh(n);
+}
+
+void EncodeScore(std::string *key, int64_t score)
+{
+    EncodeUint64(key, static_cast<uint64_t>(score) ^ (1ull << 63));
+}
+
+int64_t DecodeScore(const char *p)
+{
+    return static_cast<int64_t>(DecodeUint64(p) ^ (1ull << 63));
+}
+
+std::string EncodeSize(uint64_t size, bool stale, uint64_t base)
+{
+    std::string value = NumberToString(size);
+    if (stale) {
+        value.push_back(1);
+        value.append(reinterpret_cast<const char*>(&base), sizeof base);
     }
+    return value;
+}
 
-    if (memcmp(a.data(), b.data(), b.size()) == 0) {
-        return true;
-    } else {
+bool DecodeSize(const std::string &value, uint64_t *size, bool *stale, uint64_t *base)
+{
+    if (value.size() < sizeof *size)
         return false;
+    memcpy(size, value.data(), sizeof *size);
+    *stale = value.size() > sizeof *size;
+    // records flagged before the id was added have none
+    if (base != nullptr) {
+        *base = 0;
+        if (value.size() >= 2 * sizeof *size + 1)
+            memcpy(base, value.data() + sizeof *size + 1, sizeof *base);
     }
+    return true;
 }
 
-int CatchDBCompare(const std::string& a, const std::string& b)
-{
-    if (a[0] != b[0])
-        return a[0] - b[0];
-
-    switch (a[0]) {
-        case 'K':
-            return a.compare(b);
-        case 'H': {
-            uint16_t sizea = *((uint16_t*)(a.data() + 1));
-            uint16_t sizeb = *((uint16_t*)(b.data() + 1));
-            if (sizea != sizeb)
-                return sizea - sizeb;
-            if (a.size() != b.size())
-                return a.size() - b.size();
-            return memcmp(a.data() + 3 + sizea,
-                          b.data() + 3 + sizea,
-                          a.size() - 3 - sizea);
-        }
-        case 'Q': {
-            uint16_t sizea = *((uint16_t*)(a.data() + 1));
-            uint16_t sizeb = *((uint16_t*)(b.data() + 1));
-            if (sizea != sizeb)
-                return sizea - sizeb;
-            return memcmp(a.data() + 3, b.data() + 3, 8);
-        }
-        case 'Z': {
-            // check name first
-            uint16_t sizea = *((uint16_t*)(a.data() + 2));
-            uint16_t sizeb = *((uint16_t*)(b.data() + 2));
-            if (sizea != sizeb)
-                return sizea - sizeb;
-            int ret = memcmp(a.data() + 4, b.data() + 4, sizea);
-            if (ret != 0) {
-                return ret;
-            }
-
-            // Key or Score
-            if (a[1] != b[1])
-                return a[1] - b[1];
-
-            const char *aa = a.data() + 4 + sizea;
-            const char *bb = b.data() + 4 + sizea;
-
-            if (a[1] == 'S') {
-                int64_t scorea = *((int64_t*)aa);
-                int64_t scoreb = *((int64_t*)bb);
-                if (scorea != scoreb)
-                    return scorea - scoreb;
-                if (a.size() == b.size()) {
-                    return memcmp(aa + sizeof (int64_t), 
-                                  bb + sizeof (int64_t), 
-                                  a.size() - 4 - sizea - sizeof (int64_t));
-                }
-                return a.size() - b.size();
-
-            } else {
-                if (a.size() == b.size()) {
-                    return memcmp(aa, bb, a.size() - 4 - sizea);
-                }
-                return a.size() - b.size();
-            }
+std::string PrefixSuccessor(const std::string &prefix)
+{
+    std::string succ(prefix);
+    while (!succ.empty()) {
+        if (static_cast<unsigned char>(succ.back()) != 0xff) {
+            ++succ[succ.size() - 1];
+            return succ;
         }
-        default:
-            return a.compare(b);
+        succ.pop_back();
     }
+    return succ;
 }
 
+size_t ContainerHeaderSize(const leveldb::Slice &key)
+{
+    if (key.size() < 3 || (key[0] != 'H' && key[0] != 'Q' && key[0] != 'Z'))
+        return 0;
+    size_t size = 3 + (static_cast<unsigned char>(key[1]) << 8 |
+                       static_cast<unsigned char>(key[2]));
+    return size <= key.size() ? size : 0;
+}
+
+size_t ShardIndex(const leveldb::Slice &key, size_t shards)
+{
+    if (shards == 1)
+        return 0;
+    size_t header = ContainerHeaderSize(key);
+    return Hash64(key.data(), header > 0 ? header : key.size()) % shards;
+}
+
+uint64_t Hash64(const char *data, size_t n)
+{
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < n; ++i) {
+        h ^= static_cast<unsigned char>(data[i]);
+        h *= 1099511628211ull;
+    }
+    return h;
+}
 
 } // namespace catchdb
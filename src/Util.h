@@ -1,6 +1,8 @@
 #pragma once
 
 #include <string>
+#include <cstdint>
+#include "leveldb/slice.h"
 
 namespace catchdb
 {
@@ -27,9 +29,43 @@ Num StringToNumber(const std::string &s)
 
 const char *ErrorDescription(int errnum);
 
-bool BeginWith(const std::string &a, const std::string &b);
+// parse all of @s as a decimal int64_t; false if it is not one or out of
+// range
+bool ParseInt64(const std::string &s, int64_t *n);
 
-// the same as Comapare function in AggregateComparator
-int CatchDBCompare(const std::string& a, const std::string& b);
+// Key encoding. Keys sort by plain memcmp: numbers are stored big-endian,
+// scores with their sign bit flipped, and container names behind their
+// size.
+
+// append @type, the 2 byte size of @name and @name
+void EncodeName(std::string *key, char type, const std::string &name);
+
+void EncodeUint64(std::string *key, uint64_t n);
+uint64_t DecodeUint64(const char *p);
+
+void EncodeScore(std::string *key, int64_t score);
+int64_t DecodeScore(const char *p);
+
+// The size record of a HashMap or ZSet: the size, host order, then a
+// flag byte while blind writes since the size was counted may have added
+// members, and the id of the snapshot they are folded from, see
+// Snapshot::id.
+std::string EncodeSize(uint64_t size, bool stale, uint64_t base = 0);
+// false if @value is no size record; @base is 0 if the record has none
+bool DecodeSize(const std::string &value, uint64_t *size, bool *stale,
+                uint64_t *base = nullptr);
+
+// size of the type, name size and name heading the record of a
+// HashMap, Queue or ZSet, 0 if @key is no such record
+size_t ContainerHeaderSize(const leveldb::Slice &key);
+// The shard of @key out of @shards: a container stays on one shard,
+// picked by its header, a KV record by its whole key.
+size_t ShardIndex(const leveldb::Slice &key, size_t shards);
+
+// the smallest key past all keys starting with @prefix, empty if none
+std::string PrefixSuccessor(const std::string &prefix);
+
+// 64-bit FNV-1a, stable across builds and platforms
+uint64_t Hash64(const char *data, size_t n);
 
 } // namespace catchdb
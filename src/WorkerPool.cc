@@ -0,0 +1,112 @@
+#include "WorkerPool.h"
+#include "Logger.h"
+#include "Util.h"
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstdint>
+#include <cstdlib>
+
+namespace catchdb
+{
+
+namespace
+{
+
+int CreateEventFd(int flags)
+{
+    int efd = eventfd(0, EFD_CLOEXEC | flags);
+    if (efd < 0) {
+        LogFatal("eventfd create error: %s", ErrorDescription(errno));
+        exit(EXIT_FAILURE);
+    }
+    return efd;
+}
+
+void Signal(int efd)
+{
+    uint64_t one = 1;
+    while (write(efd, &one, sizeof (one)) < 0 && errno == EINTR);
+}
+
+} // namespace
+
+/****************** CompletionQueue *****************/
+
+CompletionQueue::CompletionQueue()
+    : efd_(CreateEventFd(EFD_NONBLOCK))
+{}
+
+CompletionQueue::~CompletionQueue()
+{
+    close(efd_);
+}
+
+void CompletionQueue::push(Client *client)
+{
+    queue_.push(client);
+    Signal(efd_);
+}
+
+void CompletionQueue::clearSignal()
+{
+    uint64_t count;
+    while (read(efd_, &count, sizeof (count)) < 0 && errno == EINTR);
+}
+
+bool CompletionQueue::pop(Client **client)
+{
+    return queue_.pop(client);
+}
+
+/****************** WorkerPool *****************/
+
+WorkerPool::WorkerPool(int numWorkers, const CatchDBPtr &db)
+    : db_(db), stop_(false)
+{
+    for (int i = 0; i < numWorkers; ++i) {
+        Worker *worker = new Worker;
+        worker->efd = CreateEventFd(0);
+        workers_.push_back(std::unique_ptr<Worker>(worker));
+    }
+    for (auto &worker : workers_) {
+        worker->thread = std::thread(&WorkerPool::work, this, worker.get());
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    stop_.store(true);
+    for (auto &worker : workers_) {
+        Signal(worker->efd);
+        worker->thread.join();
+        close(worker->efd);
+    }
+}
+
+void WorkerPool::submit(Client *client, CompletionQueue *done, size_t affinity)
+{
+    Worker *worker = workers_[affinity % workers_.size()].get();
+    worker->inbox.push(Task(client, done));
+    Signal(worker->efd);
+}
+
+void WorkerPool::work(Worker *worker)
+{
+    Task task;
+    while (!stop_.load()) {
+        while (worker->inbox.pop(&task)) {
+            (void) task.client->executeCommand(db_);
+            task.done->push(task.client);
+            task.client = nullptr;
+        }
+
+        // blocks until the next submit
+        uint64_t count;
+        if (read(worker->efd, &count, sizeof (count)) < 0 && errno != EINTR) {
+            LogError("worker eventfd read: %s", ErrorDescription(errno));
+        }
+    }
+}
+
+} // namespace catchdb
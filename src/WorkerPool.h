@@ -0,0 +1,88 @@
+/*
+ * Command execution stage decoupled from network I/O.
+ *
+ * Event loops parse requests and hand the client to a worker through the
+ * worker's lock-free inbox. The worker runs the command against leveldb
+ * and returns the client through the submitting loop's CompletionQueue,
+ * whose eventfd wakes the loop up to send the reply. A slow read that
+ * misses the block cache therefore only stalls its own worker.
+ */
+
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include "MPSCQueue.h"
+#include "Client.h"
+#include "CatchDB.h"
+
+namespace catchdb
+{
+
+class CompletionQueue
+{
+public:
+    CompletionQueue();
+    ~CompletionQueue();
+
+    // eventfd readable whenever clients were pushed
+    int fd() const { return efd_; }
+
+    // worker side
+    void push(Client *client);
+
+    // event loop side, reset the eventfd before draining with pop
+    void clearSignal();
+    bool pop(Client **client);
+
+    // non-copyable
+    CompletionQueue(const CompletionQueue&) = delete;
+    CompletionQueue& operator=(const CompletionQueue&) = delete;
+
+private:
+    int efd_;
+    MPSCQueue<Client*> queue_;
+};
+
+class WorkerPool
+{
+public:
+    WorkerPool(int numWorkers, const CatchDBPtr &db);
+    ~WorkerPool();
+
+    // Execute the pending command of @client on a worker, then push the
+    // client to @done. Commands with the same @affinity run on the same
+    // worker, in submission order.
+    void submit(Client *client, CompletionQueue *done, size_t affinity);
+
+    // non-copyable
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+private:
+    struct Task
+    {
+        Client *client;
+        CompletionQueue *done;
+
+        Task() : client(nullptr), done(nullptr) {}
+        Task(Client *c, CompletionQueue *d) : client(c), done(d) {}
+    };
+
+    struct Worker
+    {
+        int efd;
+        MPSCQueue<Task> inbox;
+        std::thread thread;
+    };
+
+    void work(Worker *worker);
+
+    CatchDBPtr db_;
+    std::atomic<bool> stop_;
+    std::vector<std::unique_ptr<Worker>> workers_;
+};
+
+} // namespace catchdb
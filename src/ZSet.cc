@@ -7,6 +7,7 @@
 #include "leveldb/write_batch.h"
 #include <cstring>
 #include <limits>
+#include <algorithm>
 #include <memory>
 #include <stdexcept>
 #include <cstdio>
@@ -14,57 +15,96 @@
 namespace catchdb
 {
 
+namespace
+{
+const char ZSET_TYPE_INDENTIFIRE = 'Z';
+
+// multi_zget walks an iterator once it asks for 1/DENSE_RATIO of the keys
+const size_t DENSE_RATIO = 8;
+
+// blind writes fold in their keys once this many are pending
+const size_t MAX_PENDING = 4096;
+
+// blocks of the rank index are split past MAX_BLOCK score records, into
+// blocks of MAX_BLOCK / 2, and merged with their predecessor once both
+// fit in MAX_BLOCK / 2
+const uint64_t MAX_BLOCK = 256;
+
+// where the first block starts, the field of the lowest score
+const std::string MIN_BOUNDARY(sizeof(int64_t), '\0');
+} // namespace
+
+const std::map<std::string, ZSet::proc_t> ZSet::procMap = {
+    { "zsize", &ZSet::size },
+    { "zset", &ZSet::set },
+    { "zmod", &ZSet::mod },
+    { "zincr", &ZSet::incr },
+    { "zdecr", &ZSet::decr },
+    { "multi_zset", &ZSet::setM },
+    { "zget", &ZSet::get },
+    { "zdel", &ZSet::del },
+    { "ztopn", &ZSet::topn },
+    { "zrtopn", &ZSet::rtopn },
+    { "zgetall", &ZSet::getall },
+    { "zscan", &ZSet::scan },
+    { "zrscan", &ZSet::rscan },
+    { "zkeys", &ZSet::keys },
+    { "zcount", &ZSet::count },
+    { "zsum", &ZSet::sum },
+    { "zavg", &ZSet::avg },
+    { "zremrangebyscore", &ZSet::removeByScore },
+    { "zremrangebyrank", &ZSet::removeByRank },
+    { "zrank", &ZSet::rank },
+    { "zrrank", &ZSet::rrank },
+    { "zrange", &ZSet::range },
+    { "zrrange", &ZSet::rrange },
+    { "zexists", &ZSet::exists },
+    { "multi_zget", &ZSet::getM },
+    { "multi_zexists", &ZSet::existsM }
+};
+
 ZSet::ZSet(const CatchDBPtr db, const std::string &zsetName)
-    : db_(db), name_(zsetName), size_(0)
-{
-    procMap = { { "zsize", &ZSet::size },
-                { "zset", &ZSet::set },
-                { "zmod", &ZSet::mod },
-                { "multi_zset", &ZSet::setM },
-                { "zget", &ZSet::get },
-                { "zdel", &ZSet::del },
-                { "ztopn", &ZSet::topn },
-                { "zgetall", &ZSet::getall },
-                { "zexists", &ZSet::exists } };
-
-    sizeTemplate_.append("ZN");
-    uint16_t nameSize = static_cast<uint16_t>(zsetName.size());
-    sizeTemplate_.append((char *)&nameSize, sizeof (uint16_t));
-    sizeTemplate_.append(zsetName.data(), nameSize);
-    keyTemplate_.append("ZK");
-    keyTemplate_.append((char *)&nameSize, sizeof (uint16_t));
-    keyTemplate_.append(zsetName.data(), nameSize);
-    scoreTemplate_.append("ZS");
-    scoreTemplate_.append((char *)&nameSize, sizeof (uint16_t));
-    scoreTemplate_.append(zsetName.data(), nameSize);
-
-    Response resp;
-    (void) size(nullptr, &resp); // do not care whether succeed
+    : db_(db), name_(zsetName), size_(0), stale_(false), indexed_(false), loaded_(false)
+{
+    EncodeName(&sizeTemplate_, ZSET_TYPE_INDENTIFIRE, zsetName);
+    keyTemplate_ = sizeTemplate_ + 'K';
+    scoreTemplate_ = sizeTemplate_ + 'S';
+    blockTemplate_ = sizeTemplate_ + 'B';
+    sizeTemplate_.push_back('N');
 }
 
 Status ZSet::process(const RequestPtr req, ResponsePtr resp)
 {
-    std::string &cmd = req->blocks[0];
-    if (procMap.find(cmd) == procMap.end())
+    auto it = procMap.find(req->blocks[0].ToString());
+    if (it == procMap.end())
         return Status::NotImplemented;
-    auto func = procMap[cmd];
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!loaded_ && load() != Status::OK)
+        return Status::Error;
+    auto func = it->second;
     return (this->*func)(req, resp);
 }
 
+Status ZSet::foldOlder(std::chrono::steady_clock::duration age)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!base_ || std::chrono::steady_clock::now() - baseTime_ < age)
+        return Status::OK;
+    return fold();
+}
+
+void ZSet::follow(const std::shared_ptr<ZSet> &shared)
+{
+    shared_ = shared;
+}
+
 Status ZSet::size(const RequestPtr req, ResponsePtr resp)
 {
     (void) req;
-    if (size_ == 0) {
-        std::string val;
-        auto s = db_->get(sizeTemplate_, &val);
-        if (s == Status::OK) {
-            size_ = *((uint64_t*) val.data());
-        } else if (s == Status::NotFound){
-            size_ = 0;
-        } else {
-            return Status::Error;
-        }
-    }
+    auto s = fold();
+    if (s != Status::OK)
+        return s;
     resp->push_back(std::to_string(size_));
     return Status::OK;
 }
@@ -75,237 +115,1109 @@ bool ZSet::empty()
 }
 
 Status ZSet::set(const RequestPtr req, ResponsePtr resp)
+{
+    int64_t score;
+    auto s = parseScore(req->blocks[3], &score, resp);
+    if (s != Status::OK)
+        return s;
+    return put({ { req->blocks[2].ToString(), score } });
+}
+
+Status ZSet::mod(const RequestPtr req, ResponsePtr resp)
+{
+    return set(req, resp);
+}
+
+Status ZSet::incr(const RequestPtr req, ResponsePtr resp)
+{
+    return incr_(req, resp, false);
+}
+
+Status ZSet::decr(const RequestPtr req, ResponsePtr resp)
+{
+    return incr_(req, resp, true);
+}
+
+Status ZSet::setM(const RequestPtr req, ResponsePtr resp)
+{
+    int size = req->blocks.size();
+    if ((size - 2) % 2) {
+        resp->push_back("arguments insufficient to make up key-score pairs");
+        return Status::InvalidParameter;
+    }
+
+    std::map<std::string, leveldb::Slice> kvs; // to remove duplicate in a multi_set
+    for (int i = 2; i < size; i += 2) {
+        kvs[req->blocks[i].ToString()] = req->blocks[i + 1];
+    }
+
+    std::map<std::string, int64_t> kss; // key-score pairs
+    for (auto &kv : kvs) {
+        auto s = parseScore(kv.second, &kss[kv.first], resp);
+        if (s != Status::OK)
+            return s;
+    }
+    return put(kss);
+}
+
+Status ZSet::get(const RequestPtr req, ResponsePtr resp)
 {
     auto key = encodeKey(req->blocks[2]);
-    int size;
     std::string val;
     auto s = db_->get(key, &val);
+    int64_t score = *((int64_t*) val.data());
+    resp->push_back(std::to_string(score));
+    return s;
+}
+
+Status ZSet::exists(const RequestPtr req, ResponsePtr resp)
+{
+    auto s = get(req, resp);
+    resp->clear();
     if (s == Status::NotFound) {
-        size = size_ + 1;
-    } else if (s == Status::OK) {
-        size = size_;
+        resp->push_back("no");
     } else {
+        resp->push_back("yes");
+    }
+
+    return Status::OK;
+}
+
+Status ZSet::getM(const RequestPtr req, ResponsePtr resp)
+{
+    std::vector<std::string> values;
+    std::vector<bool> found;
+    auto s = getM_(req, &values, &found);
+    if (s != Status::OK)
+        return s;
+
+    for (size_t i = 0; i < values.size(); ++i) {
+        if (!found[i])
+            continue;
+        int64_t score;
+        memcpy(&score, values[i].data(), sizeof score);
+        resp->push_back(req->blocks[i + 2].ToString());
+        resp->push_back(std::to_string(score));
+    }
+    return Status::OK;
+}
+
+Status ZSet::existsM(const RequestPtr req, ResponsePtr resp)
+{
+    std::vector<std::string> values;
+    std::vector<bool> found;
+    auto s = getM_(req, &values, &found);
+    if (s != Status::OK)
         return s;
+
+    for (size_t i = 0; i < values.size(); ++i) {
+        resp->push_back(req->blocks[i + 2].ToString());
+        resp->push_back(found[i] ? "yes" : "no");
     }
+    return Status::OK;
+}
+
+Status ZSet::del(const RequestPtr req, ResponsePtr resp)
+{
+    (void) resp;
+    std::string val;
+    auto s = db_->get(encodeKey(req->blocks[2]), &val);
+    if (s == Status::NotFound || s != Status::OK)
+        return s;
 
     int64_t score;
+    memcpy(&score, val.data(), sizeof score);
+    return putChanges({ Change{ req->blocks[2].ToString(), true, score, false, 0 } });
+}
+
+Status ZSet::topn(const RequestPtr req, ResponsePtr resp)
+{
+    return topn_(req, resp, Iterator::Direction::Forward);
+}
+
+Status ZSet::rtopn(const RequestPtr req, ResponsePtr resp)
+{
+    return topn_(req, resp, Iterator::Direction::Reverse);
+}
+
+Status ZSet::getall(const RequestPtr req, ResponsePtr resp)
+{
+    std::unique_ptr<Iterator> it(db_->newIterator(keyTemplate_));
+    for (it->seek(); it->valid(); it->next()) {
+        int64_t score;
+        memcpy(&score, it->value().data(), sizeof score);
+        resp->push_back(it->field().ToString());
+        resp->push_back(std::to_string(score));
+    }
+    if (it->status() == Status::Error)
+        return Status::Error;
+
+    return Status::OK;
+}
+
+Status ZSet::scan(const RequestPtr req, ResponsePtr resp)
+{
+    return scan_(req, resp, Iterator::Direction::Forward);
+}
+
+Status ZSet::rscan(const RequestPtr req, ResponsePtr resp)
+{
+    return scan_(req, resp, Iterator::Direction::Reverse);
+}
+
+Status ZSet::keys(const RequestPtr req, ResponsePtr resp)
+{
+    return scan_(req, resp, Iterator::Direction::Forward, false);
+}
+
+Status ZSet::count(const RequestPtr req, ResponsePtr resp)
+{
+    int64_t start, end;
+    auto s = parseRange(req, 2, &start, &end, resp);
+    if (s != Status::OK)
+        return s;
+
+    uint64_t n = 0;
+    s = walkRange(start, end, [&](const leveldb::Slice &) { ++n; });
+    if (s != Status::OK)
+        return s;
+    resp->push_back(std::to_string(n));
+    return Status::OK;
+}
+
+Status ZSet::sum(const RequestPtr req, ResponsePtr resp)
+{
+    int64_t start, end;
+    auto s = parseRange(req, 2, &start, &end, resp);
+    if (s != Status::OK)
+        return s;
+
+    int64_t total = 0;
+    bool overflow = false;
+    s = walkRange(start, end, [&](const leveldb::Slice &field) {
+        if (!overflow && __builtin_add_overflow(total, DecodeScore(field.data()), &total))
+            overflow = true;
+    });
+    if (s != Status::OK)
+        return s;
+    if (overflow)
+        return Status::OutOfRange;
+    resp->push_back(std::to_string(total));
+    return Status::OK;
+}
+
+Status ZSet::avg(const RequestPtr req, ResponsePtr resp)
+{
+    int64_t start, end;
+    auto s = parseRange(req, 2, &start, &end, resp);
+    if (s != Status::OK)
+        return s;
+
+    // exact in 128 bits, a sum of large scores may not fit int64_t
+    __int128 total = 0;
+    uint64_t n = 0;
+    s = walkRange(start, end, [&](const leveldb::Slice &field) {
+        total += DecodeScore(field.data());
+        ++n;
+    });
+    if (s != Status::OK)
+        return s;
+    if (n == 0) {
+        resp->push_back("0");
+        return Status::OK;
+    }
+    // quotient and remainder apart, so the average of huge scores keeps
+    // its fraction; %.17g round-trips a double, without trailing zeros
+    double avg = static_cast<double>(static_cast<int64_t>(total / n)) +
+                 static_cast<double>(static_cast<int64_t>(total % n)) / n;
+    char buf[32];
+    snprintf(buf, sizeof buf, "%.17g", avg);
+    resp->push_back(buf);
+    return Status::OK;
+}
+
+Status ZSet::removeByScore(const RequestPtr req, ResponsePtr resp)
+{
+    int64_t start, end;
+    auto s = parseRange(req, 2, &start, &end, resp);
+    if (s != Status::OK)
+        return s;
+
+    std::string target;
+    EncodeScore(&target, start);
+    std::unique_ptr<Iterator> it(db_->newIterator(scoreTemplate_));
+    it->seek(target);
+    return removeUntil(it.get(), [&]() {
+        return DecodeScore(it->field().data()) > end;
+    }, resp);
+}
+
+Status ZSet::removeByRank(const RequestPtr req, ResponsePtr resp)
+{
+    int64_t start, end;
     try {
-        score = std::stoll(req->blocks[3]);
+        start = std::stoll(req->blocks[2].ToString());
+        end = std::stoll(req->blocks[3].ToString());
     } catch(...) {
-        resp->push_back("score should be an integer");
+        resp->push_back("rank should be an integer");
         return Status::InvalidParameter;
     }
-    auto scoreKey = encodeScore(score, req->blocks[2]);
+    if (index() != Status::OK)
+        return Status::Error;
 
-    leveldb::WriteBatch batch;
-    batch.Put(key, NumberToString(score));
-    batch.Put(scoreKey, "");
-    batch.Put(sizeTemplate_, NumberToString(size));
-    s = db_->putM(&batch);
-    if (s == Status::OK) {
-        size_ = size;
+    int64_t size = static_cast<int64_t>(size_);
+    if (start < 0)
+        start = std::max<int64_t>(start + size, 0);
+    if (end < 0)
+        end += size;
+    end = std::min(end, size - 1);
+    if (start > end) {
+        resp->push_back("0");
         return Status::OK;
     }
-    return Status::Error;
+
+    std::string field;
+    if (fieldAt(start, &field) != Status::OK)
+        return Status::Error;
+    std::unique_ptr<Iterator> it(db_->newIterator(scoreTemplate_));
+    it->seek(field);
+    uint64_t left = end - start + 1;
+    return removeUntil(it.get(), [&]() { return left-- == 0; }, resp);
 }
 
-Status ZSet::mod(const RequestPtr req, ResponsePtr resp)
+Status ZSet::rank(const RequestPtr req, ResponsePtr resp)
 {
-    auto key = encodeKey(req->blocks[2]);
+    return rank_(req, resp, false);
+}
 
-    int64_t score;
+Status ZSet::rrank(const RequestPtr req, ResponsePtr resp)
+{
+    return rank_(req, resp, true);
+}
+
+Status ZSet::range(const RequestPtr req, ResponsePtr resp)
+{
+    return range_(req, resp, false);
+}
+
+Status ZSet::rrange(const RequestPtr req, ResponsePtr resp)
+{
+    return range_(req, resp, true);
+}
+
+
+/************ private *********************/
+std::string ZSet::encodeKey(const leveldb::Slice &key)
+{
+    std::string newKey(keyTemplate_);
+    newKey.append(key.data(), key.size());
+    return newKey;
+}
+
+std::string ZSet::encodeScore(int64_t score, const leveldb::Slice &key)
+{
+    std::string newKey(scoreTemplate_);
+    EncodeScore(&newKey, score);
+    newKey.append(key.data(), key.size());
+    return newKey;
+}
+
+Status ZSet::scan_(const RequestPtr req, ResponsePtr resp,
+                   Iterator::Direction direction, bool withScores)
+{
+    bool reverse = direction == Iterator::Direction::Reverse;
+    int64_t start, end;
+    auto s = parseRange(req, 3, &start, &end, resp);
+    if (s != Status::OK)
+        return s;
+    // no bound runs the other way
+    if (reverse && req->blocks[3].empty())
+        start = std::numeric_limits<int64_t>::max();
+    if (reverse && req->blocks[4].empty())
+        end = std::numeric_limits<int64_t>::min();
+    size_t limit;
+    if (!Iterator::ParseLimit(req->blocks[5], &limit)) {
+        resp->push_back("limit should be a positive integer");
+        return Status::InvalidParameter;
+    }
+
+    auto scoreOf = [](const leveldb::Slice &field) {
+        return DecodeScore(field.data());
+    };
+
+    std::unique_ptr<Iterator> it(db_->newIterator(scoreTemplate_, direction));
+    if (!req->blocks[2].empty()) {
+        it->seekAfter(req->blocks[2]);
+    } else if (!reverse) {
+        std::string target;
+        EncodeScore(&target, start);
+        it->seek(target);
+    } else {
+        // a reverse seek lands before the members of its score
+        if (start == std::numeric_limits<int64_t>::max()) {
+            it->seek();
+        } else {
+            std::string target;
+            EncodeScore(&target, start + 1);
+            it->seek(target);
+        }
+        while (it->valid() && scoreOf(it->field()) > start)
+            it->next();
+    }
+    skipReplaced(it.get());
+
+    auto inRange = [&]() {
+        int64_t score = scoreOf(it->field());
+        return reverse ? score >= end : score <= end;
+    };
+
+    std::string last;
+    resp->push_back(std::string());
+    for (size_t i = 0; i < limit && it->valid() && inRange();
+         ++i, it->next(), skipReplaced(it.get())) {
+        auto ks = decodeScoreKey(it->field());
+        last.assign(it->field().data(), it->field().size());
+        resp->push_back(std::move(ks.first));
+        if (withScores)
+            resp->push_back(std::to_string(ks.second));
+    }
+    if (it->status() != Status::OK)
+        return Status::Error;
+    if (resp->size() > 1 && it->valid() && inRange())
+        resp->front() = std::move(last);
+
+    return Status::OK;
+}
+
+Status ZSet::parseRange(const RequestPtr req, size_t first, int64_t *start, int64_t *end,
+                        ResponsePtr resp)
+{
+    *start = std::numeric_limits<int64_t>::min();
+    *end = std::numeric_limits<int64_t>::max();
     try {
-        score = std::stoll(req->blocks[3]);
+        if (!req->blocks[first].empty())
+            *start = std::stoll(req->blocks[first].ToString());
+        if (!req->blocks[first + 1].empty())
+            *end = std::stoll(req->blocks[first + 1].ToString());
     } catch(...) {
         resp->push_back("score should be an integer");
         return Status::InvalidParameter;
     }
-    auto scoreKey = encodeScore(score, req->blocks[2]);
+    return Status::OK;
+}
 
-    leveldb::WriteBatch batch;
-    batch.Put(key, NumberToString(score));
-    batch.Put(scoreKey, "");
-    Status s = db_->putM(&batch);
+Status ZSet::walkRange(int64_t start, int64_t end,
+                       const std::function<void(const leveldb::Slice&)> &visit)
+{
+    std::string target;
+    EncodeScore(&target, start);
+    std::unique_ptr<Iterator> it(db_->newIterator(scoreTemplate_));
+    it->seek(target);
+    for (skipReplaced(it.get()); it->valid(); it->next(), skipReplaced(it.get())) {
+        if (DecodeScore(it->field().data()) > end)
+            break;
+        visit(it->field());
+    }
+    if (it->status() != Status::OK)
+        return Status::Error;
+    return Status::OK;
+}
 
-    return s;
+Status ZSet::removeUntil(Iterator *it, const std::function<bool()> &stop, ResponsePtr resp)
+{
+    uint64_t removed = 0;
+    std::vector<Change> changes;
+    auto flush = [&]() {
+        if (changes.empty())
+            return true;
+        if (putChanges(changes) != Status::OK)
+            return false;
+        removed += changes.size();
+        changes.clear();
+        return true;
+    };
+
+    for (skipReplaced(it); it->valid() && !stop(); it->next(), skipReplaced(it)) {
+        auto ks = decodeScoreKey(it->field());
+        changes.push_back(Change{ std::move(ks.first), true, ks.second, false, 0 });
+        if (changes.size() == Iterator::CHUNK_SIZE && !flush())
+            return Status::Error;
+    }
+    if (it->status() != Status::OK || !flush())
+        return Status::Error;
+    resp->push_back(std::to_string(removed));
+    return Status::OK;
 }
 
+Status ZSet::getM_(const RequestPtr req, std::vector<std::string> *values,
+                   std::vector<bool> *found)
+{
+    std::vector<std::string> keys;
+    keys.reserve(req->blocks.size() - 2);
+    for (size_t i = 2; i < req->blocks.size(); ++i)
+        keys.push_back(encodeKey(req->blocks[i]));
+
+    bool dense = keys.size() * DENSE_RATIO >= size_;
+    return db_->getM(keys, dense, values, found);
+}
 
-Status ZSet::setM(const RequestPtr req, ResponsePtr resp)
+std::pair<std::string, int64_t> ZSet::decodeScoreKey(const leveldb::Slice &field)
 {
-    int size = req->blocks.size();
-    if ((size - 2) % 2) {
-        resp->push_back("arguments insufficient to make up key-score pairs");
+    int64_t score = DecodeScore(field.data());
+    std::string key(field.data() + sizeof score, field.size() - sizeof score);
+    return std::make_pair(std::move(key), score);
+}
+
+Status ZSet::parseScore(const leveldb::Slice &block, int64_t *score, ResponsePtr resp)
+{
+    try {
+        *score = std::stoll(block.ToString());
+    } catch(...) {
+        resp->push_back("score should be an integer");
         return Status::InvalidParameter;
     }
+    return Status::OK;
+}
 
-    std::map<std::string, std::string> kvs; // to remove duplicate in a multi_set
-    for (int i = 2; i < size; i += 2) {
-        kvs[req->blocks[i]] = req->blocks[i + 1];
+Status ZSet::put(const std::map<std::string, int64_t> &kss)
+{
+    if (!indexed_)
+        return putBlind(kss);
+
+    // the scores replaced leave their blocks in the same batch
+    std::vector<std::string> keys;
+    for (auto &ks : kss)
+        keys.push_back(encodeKey(ks.first));
+    std::vector<std::string> values;
+    std::vector<bool> found;
+    bool dense = keys.size() * DENSE_RATIO >= size_;
+    if (db_->getM(keys, dense, &values, &found) != Status::OK)
+        return Status::Error;
+
+    std::vector<Change> changes;
+    size_t i = 0;
+    for (auto &ks : kss) {
+        int64_t before = 0;
+        if (found[i])
+            memcpy(&before, values[i].data(), sizeof before);
+        changes.push_back(Change{ ks.first, found[i], before, true, ks.second });
+        ++i;
     }
+    return putChanges(changes);
+}
 
-    std::map<std::string, int64_t> kss; // key-score pairs
-    for (auto &kv : kvs) {
-        int64_t score;
-        try {
-            score = std::stoll(kv.second);
-        } catch(...) {
-            resp->push_back("score should be an integer");
-            return Status::InvalidParameter;
+Status ZSet::putChanges(const std::vector<Change> &changes)
+{
+    leveldb::WriteBatch batch;
+    Deltas deltas;
+    int64_t grown = 0;
+    for (auto &c : changes) {
+        bool moved = c.existed != c.exists || c.before != c.after;
+        if (c.existed && moved) {
+            auto field = encodeScore(c.before, c.key);
+            batch.Delete(field);
+            if (indexed_)
+                stage(&deltas, field.substr(scoreTemplate_.size()), -1);
+        }
+        if (c.exists) {
+            batch.Put(encodeKey(c.key), NumberToString(c.after));
+            if (moved) {
+                auto field = encodeScore(c.after, c.key);
+                batch.Put(field, "");
+                if (indexed_)
+                    stage(&deltas, field.substr(scoreTemplate_.size()), 1);
+            }
+        } else {
+            batch.Delete(encodeKey(c.key));
         }
-        kss[kv.first] = score;
+        grown += static_cast<int64_t>(c.exists) - static_cast<int64_t>(c.existed);
+    }
+    uint64_t size = size_ + grown;
+    if (!stale_ && grown != 0) {
+        if (size == 0)
+            batch.Delete(sizeTemplate_);
+        else
+            batch.Put(sizeTemplate_, EncodeSize(size, false));
+    }
+    putDeltas(&batch, deltas);
+    if (db_->putM(&batch) != Status::OK)
+        return Status::Error;
+
+    if (stale_) {
+        for (auto &c : changes)
+            pending_[c.key] = Pending{ c.exists, c.after };
+        if (pending_.size() >= MAX_PENDING)
+            return fold();
+    } else {
+        size_ = size;
     }
+    std::set<std::string> touched;
+    applyDeltas(deltas, &touched);
+    return rebalance(touched);
+}
 
-    int newSize = 0;
+Status ZSet::putBlind(const std::map<std::string, int64_t> &kss)
+{
     leveldb::WriteBatch batch;
     for (auto &ks : kss) {
-        auto key = encodeKey(ks.first);
-        std::string val;
-        auto s = db_->get(key, &val);
-        if (s == Status::NotFound) {
-            ++newSize;
-        } else if (s != Status::OK) {
-            return s;
-        }
+        // the live score record of a pending key is known and goes now,
+        // the one at base_ goes at fold()
+        auto p = pending_.find(ks.first);
+        if (p != pending_.end() && p->second.exists && p->second.score != ks.second)
+            batch.Delete(encodeScore(p->second.score, ks.first));
+        batch.Put(encodeKey(ks.first), NumberToString(ks.second));
+        batch.Put(encodeScore(ks.second, ks.first), "");
+    }
+    // the first blind write marks the size record, so a restart knows
+    // to check
+    if (!stale_) {
+        base_ = db_->snapshot();
+        baseTime_ = std::chrono::steady_clock::now();
+        batch.Put(sizeTemplate_, EncodeSize(size_, true, base_->id));
+    }
+    if (db_->putM(&batch) != Status::OK) {
+        if (!stale_)
+            base_.reset();
+        return Status::Error;
+    }
+
+    stale_ = true;
+    for (auto &ks : kss)
+        pending_[ks.first] = Pending{ true, ks.second };
+    if (pending_.size() >= MAX_PENDING)
+        return fold();
+    return Status::OK;
+}
 
-        batch.Put(key, NumberToString(ks.second));
+Status ZSet::fold()
+{
+    if (!stale_)
+        return Status::OK;
+
+    uint64_t size = size_;
+    leveldb::WriteBatch batch;
+    std::set<std::string> replaced;
+    if (base_) {
+        // a pending key replaced its score record at base_, if any,
+        // unless it still has that score
+        std::vector<std::string> keys;
+        for (auto &p : pending_)
+            keys.push_back(encodeKey(p.first));
+        std::vector<std::string> values;
+        std::vector<bool> found;
+        bool dense = keys.size() * DENSE_RATIO >= size_;
+        if (db_->getM(keys, dense, &values, &found, base_.get()) != Status::OK)
+            return Status::Error;
+
+        size_t i = 0;
+        for (auto &p : pending_) {
+            if (found[i]) {
+                int64_t score;
+                memcpy(&score, values[i].data(), sizeof score);
+                if (!p.second.exists || p.second.score != score)
+                    replaced.insert(encodeScore(score, p.first));
+            }
+            if (p.second.exists && !found[i])
+                ++size;
+            else if (!p.second.exists && found[i])
+                --size;
+            ++i;
+        }
+    } else {
+        // keep the score records that match their key record
+        size = 0;
+        std::unique_ptr<Iterator> it(db_->newIterator(scoreTemplate_));
+        std::vector<std::pair<std::string, int64_t>> chunk;
+        auto check = [&]() {
+            std::vector<std::string> keys;
+            for (auto &ks : chunk)
+                keys.push_back(encodeKey(ks.first));
+            std::vector<std::string> values;
+            std::vector<bool> found;
+            if (db_->getM(keys, false, &values, &found) != Status::OK)
+                return false;
+            for (size_t i = 0; i < chunk.size(); ++i) {
+                int64_t score = 0;
+                if (found[i])
+                    memcpy(&score, values[i].data(), sizeof score);
+                if (found[i] && score == chunk[i].second)
+                    ++size;
+                else
+                    replaced.insert(encodeScore(chunk[i].second, chunk[i].first));
+            }
+            chunk.clear();
+            return true;
+        };
+        for (it->seek(); it->valid(); it->next()) {
+            chunk.push_back(decodeScoreKey(it->field()));
+            if (chunk.size() == Iterator::CHUNK_SIZE && !check())
+                return Status::Error;
+        }
+        if (it->status() != Status::OK || !check())
+            return Status::Error;
     }
-    for (auto &ks : kss) {
-        auto scoreKey = encodeScore(ks.second, ks.first);
-        batch.Put(scoreKey, "");
+
+    // reads at a snapshot must not write, they skip the replaced records
+    if (CatchDB::threadSnapshot == nullptr) {
+        for (auto &key : replaced)
+            batch.Delete(key);
+        if (size == 0)
+            batch.Delete(sizeTemplate_);
+        else
+            batch.Put(sizeTemplate_, EncodeSize(size, false));
+        if (db_->putM(&batch) != Status::OK)
+            return Status::Error;
+    } else {
+        hidden_.insert(replaced.begin(), replaced.end());
     }
+    size_ = size;
+    pending_.clear();
+    base_.reset();
+    stale_ = false;
+    return Status::OK;
+}
 
-    batch.Put(sizeTemplate_, NumberToString(size_ + newSize));
-    Status s = db_->putM(&batch);
-    if (s == Status::OK) {
-        size_ += newSize;
+Status ZSet::takePending(uint64_t base)
+{
+    auto shared = shared_.lock();
+    if (!shared)
         return Status::OK;
+    {
+        std::lock_guard<std::mutex> lock(shared->mutex_);
+        if (!shared->base_ || shared->base_->id != base)
+            return Status::OK;
+        base_ = shared->base_;
+        pending_ = shared->pending_;
     }
-    return Status::Error;
 
+    // the keys as they are at the snapshot, fold() compares with base_
+    std::vector<std::string> keys;
+    for (auto &p : pending_)
+        keys.push_back(encodeKey(p.first));
+    std::vector<std::string> values;
+    std::vector<bool> found;
+    bool dense = keys.size() * DENSE_RATIO >= size_;
+    if (db_->getM(keys, dense, &values, &found) != Status::OK)
+        return Status::Error;
+    size_t i = 0;
+    for (auto &p : pending_) {
+        p.second.exists = found[i];
+        if (found[i])
+            memcpy(&p.second.score, values[i].data(), sizeof p.second.score);
+        ++i;
+    }
+    return Status::OK;
 }
 
-Status ZSet::get(const RequestPtr req, ResponsePtr resp)
+void ZSet::skipReplaced(Iterator *it)
 {
-    auto key = encodeKey(req->blocks[2]);
-    std::string val;
-    auto s = db_->get(key, &val);
-    int64_t score = *((int64_t*) val.data());
-    resp->push_back(std::to_string(score));
-    return s;
+    if (pending_.empty() && hidden_.empty())
+        return;
+    for (; it->valid(); it->next()) {
+        auto field = it->field();
+        if (!pending_.empty()) {
+            auto p = pending_.find(std::string(field.data() + sizeof(int64_t),
+                                               field.size() - sizeof(int64_t)));
+            if (p != pending_.end()) {
+                if (p->second.exists && p->second.score == DecodeScore(field.data()))
+                    return;
+                continue;
+            }
+        }
+        if (hidden_.count(it->key().ToString()) == 0)
+            return;
+    }
 }
 
-Status ZSet::exists(const RequestPtr req, ResponsePtr resp)
+Status ZSet::load()
 {
-    auto s = get(req, resp);
-    resp->clear();
-    if (s == Status::NotFound) {
-        resp->push_back("no");
+    std::string val;
+    uint64_t base = 0;
+    auto s = db_->get(sizeTemplate_, &val);
+    if (s == Status::OK) {
+        if (!DecodeSize(val, &size_, &stale_, &base))
+            return Status::Error;
+    } else if (s == Status::NotFound){
+        size_ = 0;
     } else {
-        resp->push_back("yes");
+        return Status::Error;
+    }
+    if (loadBlocks() != Status::OK)
+        return Status::Error;
+    // left stale by blind writes that were never folded, or still pending
+    if (stale_ && CatchDB::threadSnapshot != nullptr && takePending(base) != Status::OK)
+        return Status::Error;
+    if (fold() != Status::OK)
+        return Status::Error;
+    // e.g. blocks written before a zset was written blindly only unranked
+    if (indexed_ && ranksBefore(counts_.size()) != size_ && buildBlocks() != Status::OK)
+        return Status::Error;
+    loaded_ = true;
+    return Status::OK;
+}
+
+Status ZSet::topn_(const RequestPtr req, ResponsePtr resp, Iterator::Direction direction)
+{
+    int n;
+    try {
+        n = std::stoi(req->blocks[2].ToString());
+    } catch(...) {
+        resp->push_back("number should be an integer");
+        return Status::InvalidParameter;
+    }
+
+    // a reverse cursor starts at the last score record, the highest
+    // score since scores encode in memcmp order
+    std::unique_ptr<Iterator> it(db_->newIterator(scoreTemplate_, direction));
+    it->seek();
+    skipReplaced(it.get());
+    for (int i = 0; i < n && it->valid(); ++i, it->next(), skipReplaced(it.get())) {
+        auto ks = decodeScoreKey(it->field());
+        resp->push_back(std::move(ks.first));
+        resp->push_back(std::to_string(ks.second));
     }
+    if (it->status() == Status::Error)
+        return Status::Error;
 
     return Status::OK;
 }
 
-Status ZSet::del(const RequestPtr req, ResponsePtr resp)
+// The object's mutex makes the read and the write one step.
+Status ZSet::incr_(const RequestPtr req, ResponsePtr resp, bool negate)
 {
-    (void) resp;
+    int64_t delta;
+    if (!ParseInt64(req->blocks[3].ToString(), &delta) ||
+        (negate && delta == INT64_MIN)) {
+        resp->push_back("delta should be an integer");
+        return Status::InvalidParameter;
+    }
+    if (negate)
+        delta = -delta;
+
     auto key = encodeKey(req->blocks[2]);
     std::string val;
+    int64_t score = 0;
     auto s = db_->get(key, &val);
-    if (s == Status::NotFound || s != Status::OK)
+    if (s == Status::OK)
+        memcpy(&score, val.data(), sizeof score);
+    else if (s != Status::NotFound)
         return s;
-
-    leveldb::WriteBatch batch;
-    batch.Delete(key);
-    std::string scoreKey(scoreTemplate_);
-    scoreKey.append(val);
-    scoreKey.append(req->blocks[2]);
-    batch.Delete(scoreKey);
-    if (size_ == 1) {
-        batch.Delete(keyTemplate_);
-    } else {
-        batch.Put(keyTemplate_, NumberToString(size_ - 1));
+    bool found = s == Status::OK;
+    int64_t newScore;
+    if (__builtin_add_overflow(score, delta, &newScore)) {
+        resp->push_back("score out of range");
+        return Status::InvalidParameter;
     }
 
-    s = db_->putM(&batch);
-    if (s == Status::OK) {
-        --size_;
-        return Status::OK;
-    }
-    return Status::Error;
+    s = putChanges({ Change{ req->blocks[2].ToString(), found, score, true, newScore } });
+    if (s != Status::OK)
+        return s;
+    resp->push_back(std::to_string(newScore));
+    return Status::OK;
 }
 
-Status ZSet::topn(const RequestPtr req, ResponsePtr resp)
+Status ZSet::rank_(const RequestPtr req, ResponsePtr resp, bool reverse)
 {
-    int n;
+    if (index() != Status::OK)
+        return Status::Error;
+
+    std::string val;
+    auto s = db_->get(encodeKey(req->blocks[2]), &val);
+    if (s != Status::OK)
+        return s;
+    int64_t score;
+    memcpy(&score, val.data(), sizeof score);
+    std::string field;
+    EncodeScore(&field, score);
+    field.append(req->blocks[2].data(), req->blocks[2].size());
+
+    uint64_t rank;
+    if (rankOf(field, &rank) != Status::OK)
+        return Status::Error;
+    resp->push_back(std::to_string(reverse ? size_ - 1 - rank : rank));
+    return Status::OK;
+}
+
+Status ZSet::range_(const RequestPtr req, ResponsePtr resp, bool reverse)
+{
+    int64_t offset;
     try {
-        n = std::stoi(req->blocks[2]);
+        offset = std::stoll(req->blocks[2].ToString());
     } catch(...) {
-        resp->push_back("number should be an integer");
+        offset = -1;
+    }
+    if (offset < 0) {
+        resp->push_back("offset should be a non-negative integer");
         return Status::InvalidParameter;
     }
-
-    std::unique_ptr<Iterator> it(db_->newIterator(scoreTemplate_));
-    auto keys = it->keys(scoreTemplate_, "", n);
-    if (it->status() == Status::Error)
+    size_t limit;
+    if (!Iterator::ParseLimit(req->blocks[3], &limit)) {
+        resp->push_back("limit should be a positive integer");
+        return Status::InvalidParameter;
+    }
+    if (index() != Status::OK)
         return Status::Error;
+    if (static_cast<uint64_t>(offset) >= size_)
+        return Status::OK;
 
-    for (auto &key : keys) {
-        auto ks = decodeScoreKey(key);
-        resp->push_back(ks.first);
+    std::string field;
+    if (fieldAt(reverse ? size_ - 1 - offset : offset, &field) != Status::OK)
+        return Status::Error;
+    auto direction = reverse ? Iterator::Direction::Reverse : Iterator::Direction::Forward;
+    std::unique_ptr<Iterator> it(db_->newIterator(scoreTemplate_, direction));
+    it->seek(field);
+    skipReplaced(it.get());
+    for (size_t i = 0; i < limit && it->valid(); ++i, it->next(), skipReplaced(it.get())) {
+        auto ks = decodeScoreKey(it->field());
+        resp->push_back(std::move(ks.first));
         resp->push_back(std::to_string(ks.second));
     }
+    if (it->status() != Status::OK)
+        return Status::Error;
+    return Status::OK;
+}
 
+Status ZSet::index()
+{
+    if (indexed_)
+        return Status::OK;
+    if (fold() != Status::OK || buildBlocks() != Status::OK)
+        return Status::Error;
+    indexed_ = true;
     return Status::OK;
 }
 
-Status ZSet::getall(const RequestPtr req, ResponsePtr resp)
+Status ZSet::loadBlocks()
 {
-    std::unique_ptr<Iterator> it(db_->newIterator(keyTemplate_));
-    auto kvs = it->range(keyTemplate_, "", 0);
-    if (it->status() == Status::Error)
+    boundaries_.clear();
+    counts_.clear();
+    std::unique_ptr<Iterator> it(db_->newIterator(blockTemplate_));
+    for (it->seek(); it->valid(); it->next()) {
+        uint64_t count;
+        if (it->value().size() != sizeof count)
+            return Status::Error;
+        memcpy(&count, it->value().data(), sizeof count);
+        boundaries_.push_back(it->field().ToString());
+        counts_.push_back(count);
+    }
+    if (it->status() != Status::OK)
         return Status::Error;
+    indexed_ = !boundaries_.empty();
 
-    for (auto &kv : kvs) {
-        auto key = decodeKey(kv.key);
-        int64_t score = *((int64_t*) kv.value.data());
-        resp->push_back(key);
-        resp->push_back(std::to_string(score));
+    // an empty first block has no record
+    if (boundaries_.empty() || boundaries_[0] != MIN_BOUNDARY) {
+        boundaries_.insert(boundaries_.begin(), MIN_BOUNDARY);
+        counts_.insert(counts_.begin(), 0);
+    }
+    buildTree();
+    return Status::OK;
+}
+
+Status ZSet::buildBlocks()
+{
+    std::vector<std::string> boundaries(1, MIN_BOUNDARY);
+    std::vector<uint64_t> counts(1, 0);
+    std::unique_ptr<Iterator> it(db_->newIterator(scoreTemplate_));
+    it->seek();
+    for (skipReplaced(it.get()); it->valid(); it->next(), skipReplaced(it.get())) {
+        if (counts.back() == MAX_BLOCK / 2) {
+            boundaries.push_back(it->field().ToString());
+            counts.push_back(0);
+        }
+        ++counts.back();
     }
+    if (it->status() != Status::OK)
+        return Status::Error;
 
+    // reads at a snapshot keep them in memory
+    if (CatchDB::threadSnapshot == nullptr) {
+        leveldb::WriteBatch batch;
+        for (auto &boundary : boundaries_)
+            batch.Delete(blockKey(boundary));
+        for (size_t i = 0; i < boundaries.size(); ++i) {
+            if (counts[i] > 0)
+                batch.Put(blockKey(boundaries[i]), NumberToString(counts[i]));
+        }
+        if (db_->putM(&batch) != Status::OK)
+            return Status::Error;
+    }
+    boundaries_.swap(boundaries);
+    counts_.swap(counts);
+    buildTree();
     return Status::OK;
 }
 
+size_t ZSet::blockOf(const std::string &field) const
+{
+    return std::upper_bound(boundaries_.begin(), boundaries_.end(), field) -
+           boundaries_.begin() - 1;
+}
 
-/************ private *********************/
-std::string ZSet::encodeKey(const std::string &key)
+uint64_t ZSet::ranksBefore(size_t block) const
 {
-    std::string newKey(keyTemplate_);
-    newKey.append(key);
-    return newKey;
+    uint64_t n = 0;
+    for (size_t i = block; i > 0; i -= i & -i)
+        n += tree_[i];
+    return n;
 }
 
-std::string ZSet::encodeScore(int64_t score, const std::string &key)
+size_t ZSet::blockAt(uint64_t rank, uint64_t *skip) const
 {
-    std::string newKey(scoreTemplate_);
-    newKey.append(NumberToString(score));
-    newKey.append(key);
-    return newKey;
+    // descend the tree to the last block whose predecessors hold <= rank
+    size_t step = 1;
+    while (step * 2 <= counts_.size())
+        step *= 2;
+    size_t block = 0;
+    for (; step > 0; step /= 2) {
+        if (block + step <= counts_.size() && tree_[block + step] <= rank) {
+            block += step;
+            rank -= tree_[block];
+        }
+    }
+    *skip = rank;
+    return block;
+}
+
+void ZSet::buildTree()
+{
+    tree_.assign(counts_.size() + 1, 0);
+    for (size_t i = 1; i <= counts_.size(); ++i) {
+        tree_[i] += counts_[i - 1];
+        size_t parent = i + (i & -i);
+        if (parent <= counts_.size())
+            tree_[parent] += tree_[i];
+    }
+}
+
+void ZSet::stage(Deltas *deltas, const std::string &field, int64_t delta)
+{
+    (*deltas)[blockOf(field)] += delta;
+}
+
+void ZSet::putDeltas(leveldb::WriteBatch *batch, const Deltas &deltas)
+{
+    for (auto &d : deltas) {
+        uint64_t count = counts_[d.first] + d.second;
+        if (count == 0)
+            batch->Delete(blockKey(boundaries_[d.first]));
+        else
+            batch->Put(blockKey(boundaries_[d.first]), NumberToString(count));
+    }
 }
 
-std::pair<std::string, int64_t> ZSet::decodeScoreKey(const std::string &scoreKey)
+void ZSet::applyDeltas(const Deltas &deltas, std::set<std::string> *touched)
 {
-    int len = scoreTemplate_.size();
-    int64_t score = *((int64_t*)(scoreKey.data() + len));
-    std::string key = scoreKey.substr(len + sizeof (int64_t), std::string::npos);
-    return std::make_pair(key, score);
+    for (auto &d : deltas) {
+        counts_[d.first] += d.second;
+        for (size_t i = d.first + 1; i < tree_.size(); i += i & -i)
+            tree_[i] += d.second;
+        touched->insert(boundaries_[d.first]);
+    }
+}
+
+Status ZSet::rebalance(const std::set<std::string> &touched)
+{
+    for (auto &boundary : touched) {
+        auto pos = std::lower_bound(boundaries_.begin(), boundaries_.end(), boundary);
+        // merged away
+        if (pos == boundaries_.end() || *pos != boundary)
+            continue;
+        size_t block = pos - boundaries_.begin();
+        Status s = Status::OK;
+        if (counts_[block] > MAX_BLOCK) {
+            s = split(block);
+        } else if (block > 0 && (counts_[block] == 0 ||
+                                 counts_[block - 1] + counts_[block] <= MAX_BLOCK / 2)) {
+            s = merge(block);
+        }
+        if (s != Status::OK)
+            return s;
+    }
+    return Status::OK;
 }
 
-std::string ZSet::decodeKey(const std::string &codedKey)
+Status ZSet::split(size_t block)
 {
-    return codedKey.substr(keyTemplate_.size(), std::string::npos);
+    std::vector<std::string> boundaries;
+    std::vector<uint64_t> counts(1, 0);
+    std::unique_ptr<Iterator> it(db_->newIterator(scoreTemplate_));
+    it->seek(boundaries_[block]);
+    uint64_t i = 0;
+    for (; i < counts_[block] && it->valid(); ++i, it->next()) {
+        if (counts.back() == MAX_BLOCK / 2) {
+            boundaries.push_back(it->field().ToString());
+            counts.push_back(0);
+        }
+        ++counts.back();
+    }
+    if (it->status() != Status::OK || i < counts_[block])
+        return Status::Error;
+
+    leveldb::WriteBatch batch;
+    batch.Put(blockKey(boundaries_[block]), NumberToString(counts[0]));
+    for (size_t j = 0; j < boundaries.size(); ++j)
+        batch.Put(blockKey(boundaries[j]), NumberToString(counts[j + 1]));
+    if (db_->putM(&batch) != Status::OK)
+        return Status::Error;
+
+    counts_[block] = counts[0];
+    boundaries_.insert(boundaries_.begin() + block + 1, boundaries.begin(), boundaries.end());
+    counts_.insert(counts_.begin() + block + 1, counts.begin() + 1, counts.end());
+    buildTree();
+    return Status::OK;
+}
+
+Status ZSet::merge(size_t block)
+{
+    uint64_t count = counts_[block - 1] + counts_[block];
+    leveldb::WriteBatch batch;
+    batch.Delete(blockKey(boundaries_[block]));
+    if (count > 0)
+        batch.Put(blockKey(boundaries_[block - 1]), NumberToString(count));
+    if (db_->putM(&batch) != Status::OK)
+        return Status::Error;
+
+    counts_[block - 1] = count;
+    boundaries_.erase(boundaries_.begin() + block);
+    counts_.erase(counts_.begin() + block);
+    buildTree();
+    return Status::OK;
+}
+
+std::string ZSet::blockKey(const std::string &boundary)
+{
+    return blockTemplate_ + boundary;
+}
+
+Status ZSet::rankOf(const std::string &field, uint64_t *rank)
+{
+    size_t block = blockOf(field);
+    *rank = ranksBefore(block);
+    std::unique_ptr<Iterator> it(db_->newIterator(scoreTemplate_));
+    it->seek(boundaries_[block]);
+    for (skipReplaced(it.get()); it->valid() && it->field().compare(field) < 0;
+         it->next(), skipReplaced(it.get()))
+        ++*rank;
+    if (it->status() != Status::OK)
+        return Status::Error;
+    return Status::OK;
+}
+
+Status ZSet::fieldAt(uint64_t rank, std::string *field)
+{
+    uint64_t skip;
+    size_t block = blockAt(rank, &skip);
+    if (block >= boundaries_.size())
+        return Status::Error;
+
+    std::unique_ptr<Iterator> it(db_->newIterator(scoreTemplate_));
+    it->seek(boundaries_[block]);
+    skipReplaced(it.get());
+    for (; skip > 0 && it->valid(); --skip, it->next(), skipReplaced(it.get())) {}
+    if (it->status() != Status::OK || !it->valid())
+        return Status::Error;
+    field->assign(it->field().data(), it->field().size());
+    return Status::OK;
 }
 
 } // namespace catchdb
@@ -1,11 +1,25 @@
 /*
- * Record := SizeRecord | KeyScoreRecord | ScoreKeyRecord
- * SizeRecord := ['ZN' + sizeof(Name) + Name][size of ZSet]
- * KeyScoreRecord := ['ZK' + sizeof(Name) + Name + Key][Score]
- * ScoreKeyRecord := ['ZS' + sizeof(Name) + Name + Score + Key][]
- * 
- * size of sizeof(Name): 2 bytes
- * size of Score: sizeof(int64_t) = 8 bytes
+ * Record := SizeRecord | KeyScoreRecord | ScoreKeyRecord | BlockRecord
+ * SizeRecord := ['Z' + sizeof(Name) + Name + 'N'][size of ZSet]
+ * KeyScoreRecord := ['Z' + sizeof(Name) + Name + 'K' + Key][Score]
+ * ScoreKeyRecord := ['Z' + sizeof(Name) + Name + 'S' + Score + Key][]
+ * BlockRecord := ['Z' + sizeof(Name) + Name + 'B' + Score + Key][count]
+ *
+ * The ScoreKeyRecords are cut into blocks of consecutive records, each
+ * with a BlockRecord keyed by where it starts and holding how many records
+ * it has, 8 bytes host order. The first block starts at the lowest score.
+ * With a Fenwick tree over the counts in memory a rank is found in
+ * O(log blocks) plus a walk of at most MAX_BLOCK records. The blocks are
+ * cut by the first rank command on a zset; from then on every write reads
+ * the scores it replaces and updates the counts in the same batch as the
+ * ScoreKeyRecords. A zset never ranked has no BlockRecords and is written
+ * blindly, see putBlind.
+ *
+ * size of sizeof(Name): 2 bytes, big-endian
+ * size of ZSet: see EncodeSize, flagged stale while blind writes since the
+ * last fold may have added keys or left replaced ScoreKeyRecords
+ * size of Score: sizeof(int64_t) = 8 bytes, in keys big-endian with the
+ * sign bit flipped so that memcmp orders scores (see EncodeScore)
  */
 
 
@@ -16,8 +30,14 @@
 #include <utility>
 #include <tuple>
 #include <memory>
+#include <mutex>
+#include <map>
+#include <set>
+#include <functional>
 #include <cstdint>
+#include <chrono>
 #include "CatchDB.h"
+#include "Iterator.h"
 #include "Status.h"
 #include "Protocol.h"
 
@@ -28,10 +48,18 @@ class ZSet
 {
 public:
     ZSet(const CatchDBPtr db, const std::string &zsetName);
-    ~ZSet() {}
 
     Status process(const RequestPtr req, ResponsePtr resp);
 
+    // Fold the blind writes if their base snapshot is older than @age, so
+    // a container left idle does not keep old versions from compaction.
+    Status foldOlder(std::chrono::steady_clock::duration age);
+
+    // Make this object, reading at a snapshot, take the blind writes still
+    // pending there from @shared, the object of the latest data, rather
+    // than recount the container when it finds them, see load().
+    void follow(const std::shared_ptr<ZSet> &shared);
+
     Status size(const RequestPtr req, ResponsePtr resp);
 
     bool empty();
@@ -39,24 +67,145 @@ public:
     Status set(const RequestPtr req, ResponsePtr resp);
     Status setM(const RequestPtr req, ResponsePtr resp);
     Status mod(const RequestPtr req, ResponsePtr resp);
+    // zincr name key delta -> the new score, from 0 if key does not exist
+    Status incr(const RequestPtr req, ResponsePtr resp);
+    Status decr(const RequestPtr req, ResponsePtr resp);
     Status get(const RequestPtr req, ResponsePtr resp);
     Status del(const RequestPtr req, ResponsePtr resp);
     Status exists(const RequestPtr req, ResponsePtr resp);
+    // multi_zget name key ... -> key score ..., for the keys that exist
+    Status getM(const RequestPtr req, ResponsePtr resp);
+    // multi_zexists name key ... -> key yes|no ...
+    Status existsM(const RequestPtr req, ResponsePtr resp);
+    // ztopn name n -> key score ..., the n lowest scores first
     Status topn(const RequestPtr req, ResponsePtr resp);
+    // zrtopn name n -> key score ..., the n highest scores first
+    Status rtopn(const RequestPtr req, ResponsePtr resp);
     Status getall(const RequestPtr req, ResponsePtr resp);
+    // zscan name cursor score_start score_end limit -> cursor key score ...
+    // Members ordered by score, from score_start or, if given, the cursor
+    // a previous page returned; empty scores are no bound.
+    Status scan(const RequestPtr req, ResponsePtr resp);
+    Status rscan(const RequestPtr req, ResponsePtr resp);
+    // zkeys name cursor score_start score_end limit -> cursor key ...
+    Status keys(const RequestPtr req, ResponsePtr resp);
+
+    // Aggregates over the members with score_start <= score <= score_end,
+    // computed in one walk of the score records; empty scores are no
+    // bound.
+    // zcount name score_start score_end -> count
+    Status count(const RequestPtr req, ResponsePtr resp);
+    // zsum name score_start score_end -> sum of the scores
+    Status sum(const RequestPtr req, ResponsePtr resp);
+    // zavg name score_start score_end -> mean of the scores, 0 if none
+    Status avg(const RequestPtr req, ResponsePtr resp);
+    // zremrangebyscore name score_start score_end -> number removed
+    Status removeByScore(const RequestPtr req, ResponsePtr resp);
+    // zremrangebyrank name rank_start rank_end -> number removed
+    // Ranks count from 0 at the lowest score, negative ones from the
+    // highest; both ends are included.
+    Status removeByRank(const RequestPtr req, ResponsePtr resp);
+
+    // zrank name key -> rank from the lowest score, from 0
+    Status rank(const RequestPtr req, ResponsePtr resp);
+    // zrrank name key -> rank from the highest score, from 0
+    Status rrank(const RequestPtr req, ResponsePtr resp);
+    // zrange name offset limit -> key score ..., from rank offset on
+    Status range(const RequestPtr req, ResponsePtr resp);
+    // zrrange name offset limit -> key score ..., highest scores first
+    Status rrange(const RequestPtr req, ResponsePtr resp);
 
     // non-copyable
     ZSet(const ZSet&) = delete;
     ZSet& operator=(const ZSet&) = delete;
 
 private:
-    std::string encodeKey(const std::string &key);
-    std::string encodeScore(int64_t score, const std::string &key);
-    std::pair<std::string, int64_t> decodeScoreKey(const std::string &scoreKey);
-    std::string decodeKey(const std::string &codedKey);
+    std::string encodeKey(const leveldb::Slice &key);
+    std::string encodeScore(int64_t score, const leveldb::Slice &key);
+    // @field is a score record key without scoreTemplate_
+    std::pair<std::string, int64_t> decodeScoreKey(const leveldb::Slice &field);
+    Status scan_(const RequestPtr req, ResponsePtr resp, Iterator::Direction direction,
+                 bool withScores = true);
+    // parse blocks[@first] and blocks[@first + 1] into a score range
+    Status parseRange(const RequestPtr req, size_t first, int64_t *start, int64_t *end,
+                      ResponsePtr resp);
+    // call @visit with the score record fields of the range, lowest first
+    Status walkRange(int64_t start, int64_t end,
+                     const std::function<void(const leveldb::Slice&)> &visit);
+    // delete the members @it points at, up to and excluding the first for
+    // which @stop() holds, in batches that each keep the size record right
+    Status removeUntil(Iterator *it, const std::function<bool()> &stop, ResponsePtr resp);
+    // read the key records of blocks[2...] from one snapshot
+    Status getM_(const RequestPtr req, std::vector<std::string> *values,
+                 std::vector<bool> *found);
+    // parse the score in @block into @score
+    Status parseScore(const leveldb::Slice &block, int64_t *score, ResponsePtr resp);
+    // a key's score before and after a write, none if !existed / !exists
+    struct Change
+    {
+        std::string key;
+        bool existed;
+        int64_t before;
+        bool exists;
+        int64_t after;
+    };
+    // set the scores of @kss, blindly unless the zset has a rank index
+    Status put(const std::map<std::string, int64_t> &kss);
+    // Write the key and score records of @kss without looking whether the
+    // keys exist or had another score; fold() does that.
+    Status putBlind(const std::map<std::string, int64_t> &kss);
+    // Write @changes with the block counts and the size they make; the
+    // size is left to fold() while blind writes are pending.
+    Status putChanges(const std::vector<Change> &changes);
+    // Make size_ exact, delete the score records the blind writes
+    // replaced and store the size, unless reading at a snapshot.
+    Status fold();
+    // At a snapshot, take base_ and the pending keys from shared_ if its
+    // blind writes are those of the size record, from snapshot @base.
+    Status takePending(uint64_t base);
+    // skip the score records blind writes replaced, those of pending_ keys
+    // but the current one and those in hidden_
+    void skipReplaced(Iterator *it);
+
+    Status topn_(const RequestPtr req, ResponsePtr resp, Iterator::Direction direction);
+    Status incr_(const RequestPtr req, ResponsePtr resp, bool negate);
+    Status rank_(const RequestPtr req, ResponsePtr resp, bool reverse);
+    Status range_(const RequestPtr req, ResponsePtr resp, bool reverse);
+
+    // block -> change of its count
+    typedef std::map<size_t, int64_t> Deltas;
+    // cut the blocks unless there are, once blind writes are folded
+    Status index();
+    // read the BlockRecords
+    Status loadBlocks();
+    // replace the BlockRecords with blocks cut from the score records
+    Status buildBlocks();
+    // the block holding score record @field
+    size_t blockOf(const std::string &field) const;
+    // the number of score records in the blocks before @block
+    uint64_t ranksBefore(size_t block) const;
+    // the block holding @rank, and the rank within it in @skip
+    size_t blockAt(uint64_t rank, uint64_t *skip) const;
+    void buildTree();
+    void stage(Deltas *deltas, const std::string &field, int64_t delta);
+    // put the counts after @deltas into @batch
+    void putDeltas(leveldb::WriteBatch *batch, const Deltas &deltas);
+    // once their batch is written, take @deltas on and note the blocks
+    void applyDeltas(const Deltas &deltas, std::set<std::string> *touched);
+    // split the @touched blocks grown past MAX_BLOCK, merge the shrunk ones
+    Status rebalance(const std::set<std::string> &touched);
+    Status split(size_t block);
+    Status merge(size_t block);
+    std::string blockKey(const std::string &boundary);
+    Status rankOf(const std::string &field, uint64_t *rank);
+    // the score record field at @rank
+    Status fieldAt(uint64_t rank, std::string *field);
 
     typedef Status (ZSet::*proc_t) (const RequestPtr, ResponsePtr);
-    std::map<std::string, proc_t> procMap;
+    static const std::map<std::string, proc_t> procMap;
+
+    // read the metadata record, once per object
+    Status load();
 
     CatchDBPtr db_;
     std::string name_;
@@ -64,8 +213,37 @@ private:
     std::string keyTemplate_;
     std::string scoreTemplate_;
     uint64_t size_;
+    // Keys written since the first blind write after the last fold, as
+    // they are now, and the database just before that write, where fold()
+    // finds whether a key is new and the score record it replaced. Each
+    // write of a pending key deletes the score record its last one left.
+    // Without base_, e.g. after a restart, fold() checks every score
+    // record against its key.
+    struct Pending
+    {
+        bool exists;
+        int64_t score;
+    };
+    std::map<std::string, Pending> pending_;
+    SnapshotPtr base_;
+    std::chrono::steady_clock::time_point baseTime_;
+    bool stale_; // the size record is marked stale
+    // not owned, so snapshot objects never keep a shared one from eviction
+    std::weak_ptr<ZSet> shared_;
+    // score records replaced but still in a snapshot being read
+    std::set<std::string> hidden_;
+
+    std::string blockTemplate_;
+    bool indexed_; // the blocks exist and writes count in them
+    std::vector<std::string> boundaries_; // first field of each block
+    std::vector<uint64_t> counts_;
+    std::vector<uint64_t> tree_; // Fenwick tree over counts_, from 1
+
+    // one object per container is shared by all connections, see Registry
+    std::mutex mutex_;
+    bool loaded_;
 };
 
-typedef std::unique_ptr<ZSet> ZSetPtr;
+typedef std::shared_ptr<ZSet> ZSetPtr;
 
 } // namespace catchdb
@@ -0,0 +1,1136 @@
+/*
+ * Microbenchmarks of catchdb internals.
+ *
+ * Usage: catchdb-bench <mode> [options]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <map>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "leveldb/db.h"
+#include "leveldb/env.h"
+#include "leveldb/cache.h"
+#include "leveldb/filter_policy.h"
+#include "leveldb/write_batch.h"
+#include "Protocol.h"
+#include "Networking.h"
+#include "KeyComparator.hh"
+#include "RowCache.h"
+#include "CatchDB.h"
+#include "Config.h"
+#include "Util.h"
+#include "HashMap.h"
+#include "ZSet.h"
+#include "Registry.h"
+
+using namespace catchdb;
+
+namespace
+{
+
+typedef std::chrono::steady_clock Clock;
+
+double SecondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+void AppendBlock(std::string *buf, const std::string &block)
+{
+    buf->append(std::to_string(block.size()));
+    buf->append(1, '\n');
+    buf->append(block);
+    buf->append(1, '\n');
+}
+
+int Connect(const std::string &host, const std::string &port)
+{
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0)
+        return -1;
+
+    int fd = -1;
+    for (auto p = res; p != nullptr; p = p->ai_next) {
+        fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (fd == -1)
+            continue;
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd != -1)
+        SetTcpNoDelay(fd);
+    return fd;
+}
+
+bool SendAll(int fd, const std::string &buf)
+{
+    size_t sent = 0;
+    while (sent < buf.size()) {
+        ssize_t n = send(fd, buf.data() + sent, buf.size() - sent, 0);
+        if (n <= 0)
+            return false;
+        sent += n;
+    }
+    return true;
+}
+
+struct NetOptions
+{
+    std::string host;
+    std::string port;
+    int connections;
+    int threads;
+    int requests;
+    int pipeline;
+    int valueSize;
+    std::string command; // set, get, hset or zset
+
+    NetOptions()
+        : host("127.0.0.1"), port("7777"), connections(50), threads(1),
+          requests(200000), pipeline(1), valueSize(100), command("set") {}
+};
+
+struct NetConn
+{
+    int fd;
+    std::string in;
+    Request reply;
+    int next; // key of the next request
+};
+
+// Every round sends a batch of @pipeline requests on each connection of
+// the thread, then waits for all the replies. Replies have the same
+// framing as requests, so they are read with the request parser.
+void RunNetClient(const NetOptions &opts, int id, int numConns, int rounds,
+                  std::atomic<long> *done, std::atomic<bool> *failed)
+{
+    std::vector<NetConn> conns(numConns);
+    for (int i = 0; i < numConns; ++i) {
+        conns[i].fd = Connect(opts.host, opts.port);
+        if (conns[i].fd == -1) {
+            fprintf(stderr, "connect to %s:%s failed\n", opts.host.c_str(), opts.port.c_str());
+            failed->store(true);
+            return;
+        }
+        conns[i].next = 0;
+    }
+
+    std::string value(opts.valueSize, 'v');
+    std::string out;
+    char buf[64 * 1024];
+    for (int r = 0; r < rounds && !failed->load(); ++r) {
+        for (int i = 0; i < numConns; ++i) {
+            auto &c = conns[i];
+            out.clear();
+            for (int k = 0; k < opts.pipeline; ++k) {
+                // hset and zset fill one container per connection
+                std::string name = "bench:" + std::to_string(id) + ":" + std::to_string(i);
+                std::string seq = std::to_string(c.next++);
+                AppendBlock(&out, opts.command);
+                if (opts.command == "hset") {
+                    AppendBlock(&out, name);
+                    AppendBlock(&out, seq);
+                    AppendBlock(&out, value);
+                } else if (opts.command == "zset") {
+                    AppendBlock(&out, name);
+                    AppendBlock(&out, "m" + seq);
+                    AppendBlock(&out, seq);
+                } else {
+                    AppendBlock(&out, name + ":" + seq);
+                    if (opts.command == "set")
+                        AppendBlock(&out, value);
+                }
+                out.append(1, '\n');
+            }
+            if (!SendAll(c.fd, out)) {
+                failed->store(true);
+                return;
+            }
+        }
+
+        for (int i = 0; i < numConns; ++i) {
+            auto &c = conns[i];
+            int replies = 0;
+            while (replies < opts.pipeline) {
+                auto state = c.reply.parse(c.in.data(), c.in.size());
+                if (state == Request::State::Complete) {
+                    c.in.erase(0, c.reply.length);
+                    c.reply.reset();
+                    ++replies;
+                    continue;
+                }
+                ssize_t n = state == Request::State::Partial ? recv(c.fd, buf, sizeof buf, 0) : -1;
+                if (n <= 0) {
+                    fprintf(stderr, "bad reply or connection closed\n");
+                    failed->store(true);
+                    return;
+                }
+                c.in.append(buf, n);
+            }
+        }
+        done->fetch_add(static_cast<long>(numConns) * opts.pipeline);
+    }
+
+    for (auto &c : conns)
+        close(c.fd);
+}
+
+
+// Block cache counting lookups that hit.
+class CountingCache : public leveldb::Cache
+{
+public:
+    CountingCache(size_t capacity)
+        : base_(leveldb::NewLRUCache(capacity)), hits_(0), misses_(0) {}
+    ~CountingCache() { delete base_; }
+
+    Handle* Insert(const leveldb::Slice &key, void *value, size_t charge,
+                   void (*deleter)(const leveldb::Slice &key, void *value))
+    {
+        return base_->Insert(key, value, charge, deleter);
+    }
+
+    Handle* Lookup(const leveldb::Slice &key)
+    {
+        auto handle = base_->Lookup(key);
+        if (handle != nullptr)
+            ++hits_;
+        else
+            ++misses_;
+        return handle;
+    }
+
+    void Release(Handle *handle) { base_->Release(handle); }
+    void* Value(Handle *handle) { return base_->Value(handle); }
+    void Erase(const leveldb::Slice &key) { base_->Erase(key); }
+    uint64_t NewId() { return base_->NewId(); }
+
+    double hitRate() const
+    {
+        long total = hits_.load() + misses_.load();
+        return total == 0 ? 0 : static_cast<double>(hits_.load()) / total;
+    }
+
+private:
+    leveldb::Cache *base_;
+    std::atomic<long> hits_;
+    std::atomic<long> misses_;
+};
+
+class PreadFile : public leveldb::RandomAccessFile
+{
+public:
+    PreadFile(int fd) : fd_(fd) {}
+    ~PreadFile() { close(fd_); }
+
+    leveldb::Status Read(uint64_t offset, size_t n, leveldb::Slice *result,
+                         char *scratch) const
+    {
+        ssize_t r = pread(fd_, scratch, n, static_cast<off_t>(offset));
+        *result = leveldb::Slice(scratch, r < 0 ? 0 : r);
+        if (r < 0)
+            return leveldb::Status::IOError("pread", ErrorDescription(errno));
+        return leveldb::Status::OK();
+    }
+
+private:
+    int fd_;
+};
+
+// leveldb 1.15 mmaps tables, and blocks read from a mapping never enter
+// the block cache; read tables with pread as leveldb does past its mmap
+// limit so the cache is used.
+class PreadEnv : public leveldb::EnvWrapper
+{
+public:
+    PreadEnv() : leveldb::EnvWrapper(leveldb::Env::Default()) {}
+
+    leveldb::Status NewRandomAccessFile(const std::string &fname,
+                                        leveldb::RandomAccessFile **result)
+    {
+        int fd = open(fname.c_str(), O_RDONLY);
+        if (fd < 0) {
+            *result = nullptr;
+            return leveldb::Status::IOError(fname, ErrorDescription(errno));
+        }
+        *result = new PreadFile(fd);
+        return leveldb::Status::OK();
+    }
+};
+
+bool GetVarint64(const char **p, const char *limit, uint64_t *v)
+{
+    *v = 0;
+    for (int shift = 0; shift <= 63 && *p < limit; shift += 7) {
+        uint64_t byte = static_cast<unsigned char>(*(*p)++);
+        *v |= (byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+            return true;
+    }
+    return false;
+}
+
+// Sum the sizes of the index blocks of all tables of @dbName, read from
+// the table footers: the metaindex and the index block handles, padded
+// to 40 bytes, then an 8 byte magic number.
+bool IndexBytes(const std::string &dbName, uint64_t *indexBytes, uint64_t *tableBytes)
+{
+    const size_t FOOTER_SIZE = 48;
+    const size_t BLOCK_TRAILER_SIZE = 5;
+
+    auto env = leveldb::Env::Default();
+    std::vector<std::string> children;
+    if (!env->GetChildren(dbName, &children).ok())
+        return false;
+
+    *indexBytes = *tableBytes = 0;
+    for (auto &child : children) {
+        auto dot = child.rfind('.');
+        if (dot == std::string::npos ||
+            (child.compare(dot, 4, ".ldb") != 0 && child.compare(dot, 4, ".sst") != 0))
+            continue;
+        std::string path = dbName + "/" + child;
+        uint64_t size;
+        leveldb::RandomAccessFile *file;
+        if (!env->GetFileSize(path, &size).ok() || size < FOOTER_SIZE ||
+            !env->NewRandomAccessFile(path, &file).ok())
+            return false;
+
+        char scratch[FOOTER_SIZE];
+        leveldb::Slice footer;
+        auto s = file->Read(size - FOOTER_SIZE, FOOTER_SIZE, &footer, scratch);
+        bool ok = s.ok() && footer.size() == FOOTER_SIZE;
+        // @footer may point into the file's mapping
+        const char *p = footer.data();
+        const char *limit = p + FOOTER_SIZE - 8;
+        uint64_t metaOffset, metaSize, indexOffset, indexSize;
+        ok = ok && GetVarint64(&p, limit, &metaOffset) && GetVarint64(&p, limit, &metaSize) &&
+             GetVarint64(&p, limit, &indexOffset) && GetVarint64(&p, limit, &indexSize);
+        delete file;
+        if (!ok)
+            return false;
+        *indexBytes += indexSize + BLOCK_TRAILER_SIZE;
+        *tableBytes += size;
+    }
+    return true;
+}
+
+// A keyset shaped like a catchdb database: user profiles in hashes,
+// leaderboards in zsets (member and score records), job queues and
+// session keys, with the long, similar names real applications use.
+void MakeKeys(int scale, std::vector<std::string> *keys)
+{
+    std::mt19937 rng(1);
+    for (int i = 0; i < scale; ++i) {
+        std::string name = "app:users:profile:" + std::to_string(100000 + i);
+        std::string header;
+        EncodeName(&header, 'H', name);
+        keys->push_back(header);
+        for (int f = 0; f < 20; ++f)
+            keys->push_back(header + "attribute:" + std::to_string(1000 + f * 3));
+    }
+
+    for (int i = 0; i < scale / 50 + 1; ++i) {
+        std::string header;
+        EncodeName(&header, 'Z', "app:leaderboard:season:" + std::to_string(i));
+        keys->push_back(header + "N");
+        for (int m = 0; m < 500; ++m) {
+            std::string member = "player:" + std::to_string(rng() % 10000000);
+            keys->push_back(header + "K" + member);
+            std::string scoreKey = header + "S";
+            EncodeScore(&scoreKey, rng() % 100000);
+            keys->push_back(scoreKey + member);
+        }
+    }
+
+    for (int i = 0; i < scale / 100 + 1; ++i) {
+        std::string header;
+        EncodeName(&header, 'Q', "app:jobs:pending:" + std::to_string(i));
+        for (uint64_t seq = 0; seq < 1000; ++seq) {
+            std::string key = header;
+            EncodeUint64(&key, seq);
+            keys->push_back(key);
+        }
+    }
+
+    for (int i = 0; i < scale * 5; ++i)
+        keys->push_back("Kapp:session:" + std::to_string(rng()) + std::to_string(rng()));
+
+    std::sort(keys->begin(), keys->end());
+    keys->erase(std::unique(keys->begin(), keys->end()), keys->end());
+}
+
+struct IndexResult
+{
+    uint64_t indexBytes;
+    uint64_t tableBytes;
+    double hitRate;
+    double readSecs;
+};
+
+// Load @keys into a fresh database with @comparator, compact it, then
+// reopen it and read random keys through a block cache of @cacheSize.
+bool RunIndex(const std::string &dbName, const leveldb::Comparator *comparator,
+              const std::vector<std::string> &keys, int valueSize, int reads,
+              size_t cacheSize, IndexResult *result)
+{
+    std::unique_ptr<const leveldb::FilterPolicy> filter(leveldb::NewBloomFilterPolicy(10));
+    PreadEnv env;
+    leveldb::Options options;
+    options.env = &env;
+    options.create_if_missing = true;
+    options.error_if_exists = true;
+    options.comparator = comparator;
+    options.filter_policy = filter.get();
+    leveldb::DestroyDB(dbName, options);
+
+    leveldb::DB *db;
+    auto s = leveldb::DB::Open(options, dbName, &db);
+    if (!s.ok()) {
+        fprintf(stderr, "%s\n", s.ToString().c_str());
+        return false;
+    }
+    std::string value(valueSize, 'v');
+    leveldb::WriteBatch batch;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        batch.Put(keys[i], value);
+        if (i % 1000 == 999 || i + 1 == keys.size()) {
+            db->Write(leveldb::WriteOptions(), &batch);
+            batch.Clear();
+        }
+    }
+    db->CompactRange(nullptr, nullptr);
+    delete db;
+
+    if (!IndexBytes(dbName, &result->indexBytes, &result->tableBytes)) {
+        fprintf(stderr, "cannot read the tables of %s\n", dbName.c_str());
+        return false;
+    }
+
+    CountingCache cache(cacheSize);
+    options.error_if_exists = false;
+    options.block_cache = &cache;
+    s = leveldb::DB::Open(options, dbName, &db);
+    if (!s.ok()) {
+        fprintf(stderr, "%s\n", s.ToString().c_str());
+        return false;
+    }
+    std::mt19937 rng(2);
+    std::string got;
+    auto start = Clock::now();
+    for (int i = 0; i < reads; ++i)
+        db->Get(leveldb::ReadOptions(), keys[rng() % keys.size()], &got);
+    result->readSecs = SecondsSince(start);
+    result->hitRate = cache.hitRate();
+    delete db;
+    leveldb::DestroyDB(dbName, options);
+    return true;
+}
+
+// run one command on a container object, as Client::execute does
+template <typename T>
+Status RunCommand(T &obj, const std::vector<std::string> &args, Response *resp)
+{
+    RequestPtr req(new Request());
+    for (auto &arg : args)
+        req->blocks.push_back(arg);
+    resp->clear();
+    return obj.process(req, resp);
+}
+
+// the "snapshots" field of CatchDB::info
+size_t SnapshotsAlive(const CatchDBPtr &db)
+{
+    std::vector<std::string> info;
+    db->info(&info);
+    for (size_t i = 0; i + 1 < info.size(); i += 2) {
+        if (info[i] == "snapshots")
+            return strtoul(info[i + 1].c_str(), nullptr, 10);
+    }
+    return 0;
+}
+
+} // namespace
+
+void PrintUsage(const char *progName)
+{
+    printf("Usage:\n");
+    printf("    %s parse [-n requests] [-v value_size] [-r rounds]\n", progName);
+    printf("    %s net [-h host] [-p port] [-c connections] [-t threads] [-n requests]\n"
+           "        [-P pipeline] [-v value_size] [-g | -H | -Z]\n", progName);
+    printf("    %s index [-d dir] [-s scale] [-v value_size] [-n reads] [-C cache_mb]\n", progName);
+    printf("    %s rowcache [-k keys] [-v value_size] [-n reads] [-t threads] [-C cache_mb]\n", progName);
+    printf("    %s counter [-d dir] [-n increments] [-t threads] [-f counter_flush]\n", progName);
+    printf("    %s pin [-d dir] [-a age_ms]\n", progName);
+    printf("    %s rank [-d dir] [-n ops] [-k members] [-s seed]\n", progName);
+    printf("Modes:\n");
+    printf("    parse    throughput of the request parser over pipelined set commands\n");
+    printf("    net      throughput of a running server, set commands, or gets with -g,\n"
+           "             hsets with -H, zsets with -Z into one container per connection\n");
+    printf("    index    index block size and block cache hit rate of a catchdb-like\n"
+           "             keyset under leveldb's separators and under KeyComparator's\n");
+    printf("    rowcache lookups in the row cache, 80%% of them on 1%% of the keys,\n"
+           "             missed keys inserted as CatchDB::get does\n");
+    printf("    counter  CatchDB::incr of one hot key from every thread, written\n"
+           "             through and coalesced for counter_flush ms\n");
+    printf("    pin      snapshots pinned by blind hset/zset writes, released once\n"
+           "             idle for age_ms as the server does and when evicted\n");
+    printf("    rank     random zset, zincr, zdel and zremrangebyrank, zrank and\n"
+           "             zrange checked against a sorted copy, also at a snapshot\n");
+}
+
+// Parse a buffer of pipelined "set key value" requests the same way
+// Client::processQuery does and report bytes parsed per second.
+int BenchParse(int argc, char **argv)
+{
+    int numRequests = 100000;
+    int valueSize = 100;
+    int rounds = 20;
+
+    int c;
+    while ((c = getopt(argc, argv, "n:v:r:")) != -1) {
+        switch (c) {
+            case 'n':
+                numRequests = atoi(optarg);
+                break;
+            case 'v':
+                valueSize = atoi(optarg);
+                break;
+            case 'r':
+                rounds = atoi(optarg);
+                break;
+            default:
+                return EXIT_FAILURE;
+        }
+    }
+
+    std::string buf;
+    std::string value(valueSize, 'v');
+    for (int i = 0; i < numRequests; ++i) {
+        AppendBlock(&buf, "set");
+        AppendBlock(&buf, "key:" + std::to_string(i));
+        AppendBlock(&buf, value);
+        buf.append(1, '\n');
+    }
+
+    Request req;
+    uint64_t parsed = 0;
+    auto start = Clock::now();
+    for (int r = 0; r < rounds; ++r) {
+        int offset = 0;
+        int size = buf.size();
+        while (offset < size) {
+            req.reset();
+            if (req.parse(buf.data() + offset, size - offset) != Request::State::Complete) {
+                fprintf(stderr, "parse error at offset %d\n", offset);
+                return EXIT_FAILURE;
+            }
+            offset += req.length;
+            ++parsed;
+        }
+    }
+    double secs = SecondsSince(start);
+
+    double bytes = static_cast<double>(buf.size()) * rounds;
+    printf("parse: %d requests x %d rounds, %d byte values\n",
+           numRequests, rounds, valueSize);
+    printf("       %.3f GB/s, %.2f M requests/s\n",
+           bytes / secs / 1e9, parsed / secs / 1e6);
+    return EXIT_SUCCESS;
+}
+
+// Drive a running server over many connections and report requests per
+// second.
+int BenchNet(int argc, char **argv)
+{
+    NetOptions opts;
+
+    int c;
+    while ((c = getopt(argc, argv, "h:p:c:t:n:P:v:gHZ")) != -1) {
+        switch (c) {
+            case 'h':
+                opts.host = optarg;
+                break;
+            case 'p':
+                opts.port = optarg;
+                break;
+            case 'c':
+                opts.connections = atoi(optarg);
+                break;
+            case 't':
+                opts.threads = atoi(optarg);
+                break;
+            case 'n':
+                opts.requests = atoi(optarg);
+                break;
+            case 'P':
+                opts.pipeline = atoi(optarg);
+                break;
+            case 'v':
+                opts.valueSize = atoi(optarg);
+                break;
+            case 'g':
+                opts.command = "get";
+                break;
+            case 'H':
+                opts.command = "hset";
+                break;
+            case 'Z':
+                opts.command = "zset";
+                break;
+            default:
+                return EXIT_FAILURE;
+        }
+    }
+    if (opts.threads < 1 || opts.connections < opts.threads || opts.pipeline < 1) {
+        fprintf(stderr, "need connections >= threads >= 1 and pipeline >= 1\n");
+        return EXIT_FAILURE;
+    }
+
+    int rounds = std::max(1, opts.requests / (opts.connections * opts.pipeline));
+    std::atomic<long> done(0);
+    std::atomic<bool> failed(false);
+    std::vector<std::thread> threads;
+    auto start = Clock::now();
+    for (int t = 0; t < opts.threads; ++t) {
+        int numConns = opts.connections / opts.threads +
+                       (t < opts.connections % opts.threads ? 1 : 0);
+        threads.push_back(std::thread(RunNetClient, std::cref(opts), t, numConns,
+                                      rounds, &done, &failed));
+    }
+    for (auto &t : threads)
+        t.join();
+    double secs = SecondsSince(start);
+    if (failed.load())
+        return EXIT_FAILURE;
+
+    printf("net: %ld %s requests, %d connections, %d threads, pipeline %d, %d byte values\n",
+           done.load(), opts.command.c_str(), opts.connections, opts.threads,
+           opts.pipeline, opts.valueSize);
+    printf("     %.0f requests/s\n", done.load() / secs);
+    return EXIT_SUCCESS;
+}
+
+// Build the same keyset under leveldb's bytewise comparator and under
+// KeyComparator, and compare the index blocks of the tables and the block
+// cache hit rate of random reads.
+int BenchIndex(int argc, char **argv)
+{
+    std::string dir = "/tmp";
+    int scale = 20000;
+    int valueSize = 100;
+    int reads = 200000;
+    int cacheMB = 8;
+
+    int c;
+    while ((c = getopt(argc, argv, "d:s:v:n:C:")) != -1) {
+        switch (c) {
+            case 'd':
+                dir = optarg;
+                break;
+            case 's':
+                scale = atoi(optarg);
+                break;
+            case 'v':
+                valueSize = atoi(optarg);
+                break;
+            case 'n':
+                reads = atoi(optarg);
+                break;
+            case 'C':
+                cacheMB = atoi(optarg);
+                break;
+            default:
+                return EXIT_FAILURE;
+        }
+    }
+    if (scale < 1 || reads < 1) {
+        fprintf(stderr, "need scale >= 1 and reads >= 1\n");
+        return EXIT_FAILURE;
+    }
+
+    std::vector<std::string> keys;
+    MakeKeys(scale, &keys);
+    printf("index: %zu keys, %d byte values, %d reads, %d MB block cache\n",
+           keys.size(), valueSize, reads, cacheMB);
+
+    const KeyComparator keyComparator;
+    const leveldb::Comparator *comparators[] = {leveldb::BytewiseComparator(), &keyComparator};
+    const char *names[] = {"bytewise", "catchdb"};
+    for (int i = 0; i < 2; ++i) {
+        IndexResult r;
+        if (!RunIndex(dir + "/catchdb-bench-index", comparators[i], keys, valueSize,
+                      reads, cacheMB * 1048576UL, &r))
+            return EXIT_FAILURE;
+        printf("       %-8s index %8.1f KB of %8.1f KB tables, cache hit %5.1f%%, %.0f reads/s\n",
+               names[i], r.indexBytes / 1024.0, r.tableBytes / 1024.0,
+               r.hitRate * 100, reads / r.readSecs);
+    }
+    return EXIT_SUCCESS;
+}
+
+// Read keys with the skew of our traffic, 80% of the reads on the
+// hottest 1% of the keys, through a RowCache that is filled on misses.
+int BenchRowCache(int argc, char **argv)
+{
+    int numKeys = 1000000;
+    int valueSize = 100;
+    int reads = 5000000;
+    int numThreads = 1;
+    int cacheMB = 16;
+
+    int c;
+    while ((c = getopt(argc, argv, "k:v:n:t:C:")) != -1) {
+        switch (c) {
+            case 'k':
+                numKeys = atoi(optarg);
+                break;
+            case 'v':
+                valueSize = atoi(optarg);
+                break;
+            case 'n':
+                reads = atoi(optarg);
+                break;
+            case 't':
+                numThreads = atoi(optarg);
+                break;
+            case 'C':
+                cacheMB = atoi(optarg);
+                break;
+            default:
+                return EXIT_FAILURE;
+        }
+    }
+    if (numKeys < 100 || numThreads < 1 || reads < 1) {
+        fprintf(stderr, "need keys >= 100, threads >= 1 and reads >= 1\n");
+        return EXIT_FAILURE;
+    }
+
+    RowCache cache(cacheMB * 1048576UL);
+    std::string value(valueSize, 'v');
+    int hot = numKeys / 100;
+    std::vector<std::thread> threads;
+    auto start = Clock::now();
+    for (int t = 0; t < numThreads; ++t) {
+        threads.push_back(std::thread([&, t] {
+            std::mt19937 rng(t);
+            std::string key, got;
+            for (int i = 0; i < reads / numThreads; ++i) {
+                int k = rng() % 10 < 8 ? rng() % hot : rng() % numKeys;
+                key = "Kuser:" + std::to_string(k);
+                uint64_t ticket;
+                if (!cache.lookup(key, &got, &ticket))
+                    cache.insert(key, value, ticket);
+            }
+        }));
+    }
+    for (auto &t : threads)
+        t.join();
+    double secs = SecondsSince(start);
+
+    uint64_t done = cache.hits() + cache.misses();
+    printf("rowcache: %d keys, %d byte values, %d MB, %d threads\n",
+           numKeys, valueSize, cacheMB, numThreads);
+    printf("          hit rate %.1f%%, %.0f ns per read, %.2f M reads/s\n",
+           100.0 * cache.hits() / done, secs * 1e9 * numThreads / done, done / secs / 1e6);
+
+    // hits alone, on keys built beforehand
+    std::vector<std::string> hotKeys;
+    std::string got;
+    uint64_t ticket;
+    for (int k = 0; k < hot; ++k) {
+        std::string key = "Kuser:" + std::to_string(k);
+        if (cache.lookup(key, &got, &ticket))
+            hotKeys.push_back(key);
+    }
+    if (hotKeys.empty())
+        return EXIT_SUCCESS;
+    uint64_t hits = cache.hits();
+    start = Clock::now();
+    for (int i = 0; i < reads; ++i)
+        cache.lookup(hotKeys[i % hotKeys.size()], &got, &ticket);
+    secs = SecondsSince(start);
+    printf("          hot key hit %.0f ns (%.1f%% of them hit)\n",
+           secs * 1e9 / reads, 100.0 * (cache.hits() - hits) / reads);
+    return EXIT_SUCCESS;
+}
+
+// Increment one key from all threads, once with every increment written
+// and once coalesced, and check no increment got lost.
+int BenchCounter(int argc, char **argv)
+{
+    std::string dir = "/tmp";
+    int increments = 1000000;
+    int numThreads = 4;
+    int flush = 10;
+
+    int c;
+    while ((c = getopt(argc, argv, "d:n:t:f:")) != -1) {
+        switch (c) {
+            case 'd':
+                dir = optarg;
+                break;
+            case 'n':
+                increments = atoi(optarg);
+                break;
+            case 't':
+                numThreads = atoi(optarg);
+                break;
+            case 'f':
+                flush = atoi(optarg);
+                break;
+            default:
+                return EXIT_FAILURE;
+        }
+    }
+    if (increments < 1 || numThreads < 1 || flush < 1) {
+        fprintf(stderr, "need increments >= 1, threads >= 1 and counter_flush >= 1\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("counter: %d increments, %d threads\n", increments, numThreads);
+    for (int counterFlush : { 0, flush }) {
+        ConfigPtr config(new Config());
+        config->dbPath = dir + "/";
+        config->dbName = "catchdb-bench-counter";
+        config->counterFlush = counterFlush;
+        std::string dbName = config->dbPath + config->dbName;
+        leveldb::DestroyDB(dbName, leveldb::Options());
+
+        double secs;
+        std::string value;
+        {
+            CatchDBPtr db = CatchDB::Open(config);
+            if (db == nullptr) {
+                fprintf(stderr, "cannot open %s\n", dbName.c_str());
+                return EXIT_FAILURE;
+            }
+            std::vector<std::thread> threads;
+            auto start = Clock::now();
+            for (int t = 0; t < numThreads; ++t) {
+                threads.push_back(std::thread([&db, increments, numThreads] {
+                    int64_t n;
+                    for (int i = 0; i < increments / numThreads; ++i)
+                        db->incr("Khits", 1, &n);
+                }));
+            }
+            for (auto &t : threads)
+                t.join();
+            secs = SecondsSince(start);
+            db->get("Khits", &value);
+        }
+        // reopened, what the flush on close wrote
+        std::string stored;
+        {
+            CatchDBPtr db = CatchDB::Open(config);
+            if (db != nullptr)
+                db->get("Khits", &stored);
+        }
+        leveldb::DestroyDB(dbName, leveldb::Options());
+
+        int done = increments / numThreads * numThreads;
+        printf("         counter_flush %3d: %.2f M incr/s, value %s, stored %s%s\n",
+               counterFlush, done / secs / 1e6, value.c_str(), stored.c_str(),
+               value == std::to_string(done) && stored == value ? "" : " (LOST)");
+    }
+    return EXIT_SUCCESS;
+}
+
+// Blind writes pin a snapshot until folded. Check the server's idle sweep
+// (foldOlder over the registries) and eviction release them, and that the
+// sizes stay exact.
+int BenchPin(int argc, char **argv)
+{
+    std::string dir = "/tmp";
+    int ageMs = 1000;
+
+    int c;
+    while ((c = getopt(argc, argv, "d:a:")) != -1) {
+        switch (c) {
+            case 'd':
+                dir = optarg;
+                break;
+            case 'a':
+                ageMs = atoi(optarg);
+                break;
+            default:
+                return EXIT_FAILURE;
+        }
+    }
+    if (ageMs < 1) {
+        fprintf(stderr, "need age_ms >= 1\n");
+        return EXIT_FAILURE;
+    }
+
+    ConfigPtr config(new Config());
+    config->dbPath = dir + "/";
+    config->dbName = "catchdb-bench-pin";
+    std::string dbName = config->dbPath + config->dbName;
+    leveldb::DestroyDB(dbName, leveldb::Options());
+
+    bool ok = true;
+    auto check = [&ok](bool cond, const char *what) {
+        printf("         %-40s %s\n", what, cond ? "ok" : "FAILED");
+        ok = ok && cond;
+    };
+    {
+        CatchDBPtr db = CatchDB::Open(config);
+        if (db == nullptr) {
+            fprintf(stderr, "cannot open %s\n", dbName.c_str());
+            return EXIT_FAILURE;
+        }
+        std::chrono::milliseconds age(ageMs);
+        Registry<HashMap> hashMaps(1);
+        Registry<ZSet> zsets(1);
+        auto sweep = [&](std::chrono::steady_clock::duration age) {
+            hashMaps.forEach([age](HashMap &h) { (void) h.foldOlder(age); });
+            zsets.forEach([age](ZSet &z) { (void) z.foldOlder(age); });
+        };
+
+        printf("pin: blind writes, idle for %d ms\n", ageMs);
+        Response resp;
+        RunCommand(*hashMaps.get(db, "h"), { "hset", "h", "f1", "v" }, &resp);
+        RunCommand(*hashMaps.get(db, "h"), { "multi_hset", "h", "f1", "v", "f2", "v" }, &resp);
+        RunCommand(*zsets.get(db, "z"), { "zset", "z", "m1", "1" }, &resp);
+        RunCommand(*zsets.get(db, "z"), { "zset", "z", "m2", "2" }, &resp);
+        check(SnapshotsAlive(db) == 2, "pinned after the writes");
+        sweep(age);
+        check(SnapshotsAlive(db) == 2, "still pinned before age_ms");
+        std::this_thread::sleep_for(age);
+        sweep(age);
+        check(SnapshotsAlive(db) == 0, "released once idle");
+        RunCommand(*hashMaps.get(db, "h"), { "hsize", "h" }, &resp);
+        check(resp == Response{ "2" }, "hsize exact");
+        RunCommand(*zsets.get(db, "z"), { "zsize", "z" }, &resp);
+        check(resp == Response{ "2" }, "zsize exact");
+
+        // capacity 1, a second container evicts the first
+        RunCommand(*hashMaps.get(db, "h"), { "hset", "h", "f3", "v" }, &resp);
+        check(SnapshotsAlive(db) == 1, "pinned again");
+        // hdel reads the field, it leaves the blind writes pending
+        RunCommand(*hashMaps.get(db, "h"), { "hdel", "h", "f1" }, &resp);
+        check(SnapshotsAlive(db) == 1, "still pinned after hdel");
+        RunCommand(*hashMaps.get(db, "h2"), { "hsize", "h2" }, &resp);
+        check(SnapshotsAlive(db) == 0, "released on eviction");
+        RunCommand(*hashMaps.get(db, "h"), { "hsize", "h" }, &resp);
+        check(resp == Response{ "2" }, "hsize exact after eviction");
+    }
+    leveldb::DestroyDB(dbName, leveldb::Options());
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Drive one zset with random writes that split, merge and rebalance the
+// blocks of its rank index, and check zrank and zrange against a sorted
+// copy: on the shared object, on a reloaded one and at a snapshot.
+int BenchRank(int argc, char **argv)
+{
+    std::string dir = "/tmp";
+    int numOps = 20000;
+    int numMembers = 2000;
+    unsigned seed = 1;
+
+    int c;
+    while ((c = getopt(argc, argv, "d:n:k:s:")) != -1) {
+        switch (c) {
+            case 'd':
+                dir = optarg;
+                break;
+            case 'n':
+                numOps = atoi(optarg);
+                break;
+            case 'k':
+                numMembers = atoi(optarg);
+                break;
+            case 's':
+                seed = strtoul(optarg, nullptr, 10);
+                break;
+            default:
+                return EXIT_FAILURE;
+        }
+    }
+    if (numOps < 1 || numMembers < 1) {
+        fprintf(stderr, "need ops >= 1 and members >= 1\n");
+        return EXIT_FAILURE;
+    }
+
+    ConfigPtr config(new Config());
+    config->dbPath = dir + "/";
+    config->dbName = "catchdb-bench-rank";
+    std::string dbName = config->dbPath + config->dbName;
+    leveldb::DestroyDB(dbName, leveldb::Options());
+
+    std::mt19937 rng(seed);
+    std::map<std::string, int64_t> scores;
+    // ranked as the score records are, by score then member
+    auto sorted = [&scores]() {
+        std::vector<std::pair<int64_t, std::string>> ranked;
+        for (auto &ms : scores)
+            ranked.push_back(std::make_pair(ms.second, ms.first));
+        std::sort(ranked.begin(), ranked.end());
+        return ranked;
+    };
+    // zrank of a sample and zrange over everything, false on a mismatch
+    auto verify = [&](ZSet &zset) {
+        auto ranked = sorted();
+        Response resp;
+        for (size_t i = 0; i < ranked.size(); i += 1 + rng() % 16) {
+            RunCommand(zset, { "zrank", "z", ranked[i].second }, &resp);
+            if (resp != Response{ std::to_string(i) })
+                return false;
+        }
+        // in pages, zrange returns at most Iterator::CHUNK_SIZE members
+        const size_t page = 100;
+        for (size_t offset = 0; offset < ranked.size(); offset += page) {
+            Response expected;
+            for (size_t i = offset; i < std::min(offset + page, ranked.size()); ++i) {
+                expected.push_back(ranked[i].second);
+                expected.push_back(std::to_string(ranked[i].first));
+            }
+            RunCommand(zset, { "zrange", "z", std::to_string(offset), std::to_string(page) },
+                       &resp);
+            if (resp != expected)
+                return false;
+        }
+        RunCommand(zset, { "zsize", "z" }, &resp);
+        return resp == Response{ std::to_string(ranked.size()) };
+    };
+
+    bool ok = true;
+    {
+        CatchDBPtr db = CatchDB::Open(config);
+        if (db == nullptr) {
+            fprintf(stderr, "cannot open %s\n", dbName.c_str());
+            return EXIT_FAILURE;
+        }
+        std::shared_ptr<ZSet> shared(new ZSet(db, "z"));
+        ZSet &zset = *shared;
+        Response resp;
+        int checks = 0;
+        size_t most = 0;
+        printf("rank: %d ops over %d members, seed %u\n", numOps, numMembers, seed);
+        for (int op = 1; op <= numOps && ok; ++op) {
+            std::string member = "m" + std::to_string(rng() % numMembers);
+            int64_t score = static_cast<int64_t>(rng() % 1000) - 500;
+            // inserts outweigh deletes, so the zset grows past a block
+            switch (rng() % 16) {
+                case 0: case 1: case 2: case 3: case 4: case 5: case 6: case 7:
+                    RunCommand(zset, { "zset", "z", member, std::to_string(score) }, &resp);
+                    scores[member] = score;
+                    break;
+                case 8:
+                case 9:
+                    RunCommand(zset, { "zincr", "z", member, std::to_string(score) }, &resp);
+                    scores[member] += score;
+                    break;
+                case 10:
+                case 11:
+                    RunCommand(zset, { "zdel", "z", member }, &resp);
+                    scores.erase(member);
+                    break;
+                case 12: {
+                    // mostly short runs, sometimes a whole block or more
+                    int64_t size = scores.size();
+                    if (size == 0)
+                        break;
+                    int64_t start = rng() % size;
+                    int64_t end = start + (rng() % 32 == 0 ? rng() % 300 : rng() % 3);
+                    RunCommand(zset, { "zremrangebyrank", "z", std::to_string(start),
+                                       std::to_string(end) }, &resp);
+                    auto ranked = sorted();
+                    for (int64_t i = start; i <= end && i < size; ++i)
+                        scores.erase(ranked[i].second);
+                    break;
+                }
+                default:
+                    if (scores.empty())
+                        break;
+                    member = std::next(scores.begin(), rng() % scores.size())->first;
+                    RunCommand(zset, { "zrank", "z", member }, &resp);
+                    auto ranked = sorted();
+                    auto pos = std::find(ranked.begin(), ranked.end(),
+                                         std::make_pair(scores[member], member));
+                    ok = resp == Response{ std::to_string(pos - ranked.begin()) };
+                    break;
+            }
+            most = std::max(most, scores.size());
+            if (ok && op % (numOps / 10 + 1) == 0) {
+                ++checks;
+                const char *which = "shared";
+                ok = verify(zset);
+                // blocks as written, and as loaded at a snapshot following
+                // the shared object, as the objects of a connection do
+                if (ok) {
+                    which = "reloaded";
+                    ZSet reloaded(db, "z");
+                    ok = verify(reloaded);
+                }
+                if (ok) {
+                    which = "snapshot";
+                    SnapshotPtr snapshot = db->snapshot();
+                    CatchDB::threadSnapshot = snapshot.get();
+                    {
+                        ZSet atSnapshot(db, "z");
+                        atSnapshot.follow(shared);
+                        ok = verify(atSnapshot);
+                    }
+                    CatchDB::threadSnapshot = nullptr;
+                }
+                if (!ok)
+                    printf("         mismatch on the %s object after op %d\n", which, op);
+            }
+        }
+        ok = ok && verify(zset);
+        printf("         %d checks, %zu members, %zu at most: %s\n", checks, scores.size(), most,
+               ok ? "ok" : "FAILED");
+    }
+    leveldb::DestroyDB(dbName, leveldb::Options());
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        PrintUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    std::string mode = argv[1];
+    if (mode == "parse")
+        return BenchParse(argc - 1, argv + 1);
+    if (mode == "net")
+        return BenchNet(argc - 1, argv + 1);
+    if (mode == "index")
+        return BenchIndex(argc - 1, argv + 1);
+    if (mode == "rowcache")
+        return BenchRowCache(argc - 1, argv + 1);
+    if (mode == "counter")
+        return BenchCounter(argc - 1, argv + 1);
+    if (mode == "pin")
+        return BenchPin(argc - 1, argv + 1);
+    if (mode == "rank")
+        return BenchRank(argc - 1, argv + 1);
+
+    PrintUsage(argv[0]);
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,225 @@
+/*
+ * Offline conversion of a database to the current key format.
+ *
+ * Version 1 databases store name sizes, queue sequences and zset scores
+ * host-endian and rely on AggregateComparator to order them. The records
+ * are copied into a new database with the memcmp-ordered keys of version
+ * 2 (see EncodeName), which the server opens with leveldb's bytewise
+ * comparator. The source is only read; stop the server before converting.
+ *
+ * With @shards > 1 the records are routed as the server routes them
+ * (ShardIndex) into <destination db>.0 ... .<shards - 1>, the
+ * names a server with that many shards opens; set its db_name to the
+ * destination's.
+ *
+ * Usage: catchdb-migrate <source db> <destination db> [shards]
+ */
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "leveldb/db.h"
+#include "leveldb/write_batch.h"
+#include "AggregateComparator.hh"
+#include "CatchDB.h"
+#include "Util.h"
+
+using namespace catchdb;
+
+namespace
+{
+
+// records per write to the destination
+const int BATCH_RECORDS = 1000;
+
+// name of the comparator before it was versioned
+class LegacyComparator : public AggregateComparator
+{
+public:
+    const char* Name() const { return "catchdb.AggregateComparator"; }
+};
+
+// Split a version 1 key with its name size at @offset, false if too short.
+bool SplitName(const leveldb::Slice &key, size_t offset, std::string *name,
+               leveldb::Slice *rest)
+{
+    if (key.size() < offset + 2)
+        return false;
+    uint16_t size;
+    memcpy(&size, key.data() + offset, sizeof size);
+    if (key.size() < offset + 2 + size)
+        return false;
+    name->assign(key.data() + offset + 2, size);
+    *rest = leveldb::Slice(key.data() + offset + 2 + size,
+                           key.size() - offset - 2 - size);
+    return true;
+}
+
+// Version 2 key of a version 1 key, false if @key is none of ours.
+bool ConvertKey(const leveldb::Slice &key, std::string *out)
+{
+    std::string name;
+    leveldb::Slice rest;
+    out->clear();
+    if (key.empty())
+        return false;
+
+    switch (key[0]) {
+        case 'K':
+            out->assign(key.data(), key.size());
+            return true;
+        case 'H':
+            if (!SplitName(key, 1, &name, &rest))
+                return false;
+            EncodeName(out, 'H', name);
+            out->append(rest.data(), rest.size());
+            return true;
+        case 'Q': {
+            uint64_t seq;
+            if (!SplitName(key, 1, &name, &rest) || rest.size() != sizeof seq)
+                return false;
+            memcpy(&seq, rest.data(), sizeof seq);
+            EncodeName(out, 'Q', name);
+            EncodeUint64(out, seq);
+            return true;
+        }
+        case 'Z': {
+            if (key.size() < 2 || !SplitName(key, 2, &name, &rest))
+                return false;
+            EncodeName(out, 'Z', name);
+            out->push_back(key[1]);
+            if (key[1] == 'S') {
+                int64_t score;
+                if (rest.size() < sizeof score)
+                    return false;
+                memcpy(&score, rest.data(), sizeof score);
+                EncodeScore(out, score);
+                rest.remove_prefix(sizeof score);
+            } else if (key[1] != 'N' && key[1] != 'K') {
+                return false;
+            }
+            out->append(rest.data(), rest.size());
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+bool IsZSetSize(const leveldb::Slice &key)
+{
+    return key.size() >= 2 && key[0] == 'Z' && key[1] == 'N';
+}
+
+leveldb::DB* OpenSource(const std::string &path)
+{
+    static AggregateComparator comparator;
+    static LegacyComparator legacy;
+
+    leveldb::Options options;
+    leveldb::DB *db = nullptr;
+    options.comparator = &comparator;
+    auto s = leveldb::DB::Open(options, path, &db);
+    if (!s.ok()) {
+        options.comparator = &legacy;
+        s = leveldb::DB::Open(options, path, &db);
+    }
+    if (!s.ok()) {
+        fprintf(stderr, "open %s: %s\n", path.c_str(), s.ToString().c_str());
+        return nullptr;
+    }
+    return db;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "Usage: %s <source db> <destination db> [shards]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    int shards = argc == 4 ? atoi(argv[3]) : 1;
+    if (shards < 1) {
+        fprintf(stderr, "shards should be a positive integer\n");
+        return EXIT_FAILURE;
+    }
+
+    std::unique_ptr<leveldb::DB> src(OpenSource(argv[1]));
+    if (!src)
+        return EXIT_FAILURE;
+
+    // named like the shards of CatchDB::Open
+    leveldb::Options options;
+    options.create_if_missing = true;
+    options.error_if_exists = true;
+    std::vector<std::unique_ptr<leveldb::DB>> dsts;
+    for (int i = 0; i < shards; ++i) {
+        std::string path = argv[2];
+        if (shards > 1)
+            path += "." + std::to_string(i);
+        leveldb::DB *db;
+        auto s = leveldb::DB::Open(options, path, &db);
+        if (!s.ok()) {
+            fprintf(stderr, "open %s: %s\n", path.c_str(), s.ToString().c_str());
+            return EXIT_FAILURE;
+        }
+        dsts.push_back(std::unique_ptr<leveldb::DB>(db));
+    }
+
+    leveldb::ReadOptions readOptions;
+    readOptions.fill_cache = false;
+    std::unique_ptr<leveldb::Iterator> it(src->NewIterator(readOptions));
+
+    long converted = 0, skipped = 0;
+    std::vector<int> pending(shards, 0);
+    std::vector<leveldb::WriteBatch> batches(shards);
+    leveldb::Status s;
+    std::string key;
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+        if (!ConvertKey(it->key(), &key)) {
+            ++skipped;
+            continue;
+        }
+        leveldb::Slice value = it->value();
+        std::string size;
+        if (IsZSetSize(it->key()) && value.size() == sizeof (int32_t)) {
+            // older servers wrote zset sizes as 4 byte ints
+            int32_t n;
+            memcpy(&n, value.data(), sizeof n);
+            size = NumberToString(static_cast<uint64_t>(n));
+            value = size;
+        }
+        size_t shard = ShardIndex(key, shards);
+        batches[shard].Put(key, value);
+        ++converted;
+        if (++pending[shard] == BATCH_RECORDS) {
+            s = dsts[shard]->Write(leveldb::WriteOptions(), &batches[shard]);
+            if (!s.ok())
+                break;
+            batches[shard].Clear();
+            pending[shard] = 0;
+        }
+    }
+    if (s.ok() && !it->status().ok())
+        s = it->status();
+    for (int i = 0; i < shards && s.ok(); ++i) {
+        // stamped last, an interrupted conversion is refused by the server
+        batches[i].Put(SHARD_KEY, std::to_string(i) + "/" + std::to_string(shards));
+        batches[i].Put(FORMAT_VERSION_KEY, FORMAT_VERSION);
+        leveldb::WriteOptions writeOptions;
+        writeOptions.sync = true;
+        s = dsts[i]->Write(writeOptions, &batches[i]);
+    }
+    if (!s.ok()) {
+        fprintf(stderr, "conversion failed: %s\n", s.ToString().c_str());
+        return EXIT_FAILURE;
+    }
+
+    printf("%ld records converted into %d shard(s), %ld unknown records skipped\n",
+           converted, shards, skipped);
+    return EXIT_SUCCESS;
+}
@@ -1,5 +1,8 @@
+#include <algorithm>
+#include <chrono>
 #include <memory>
 #include <queue>
+#include <thread>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,9 +23,11 @@
 #include "Logger.h"
 #include "Config.h"
 #include "EventManager.h"
+#include "UringLoop.h"
 #include "Networking.h"
 #include "Protocol.h"
 #include "Client.h"
+#include "WorkerPool.h"
 
 using namespace catchdb;
 
@@ -30,6 +35,9 @@ namespace
 {
 // default values
 const std::string DEFAULT_CONFIG_FILE = "./catchdb.conf";
+// fds that are not clients: listening sockets, event loops, the log and
+// leveldb's table cache (max_open_files is 1000 by default)
+const int RESERVED_FDS = 1100;
 
 // global variables
 // std::queue<Command> commandQueue;
@@ -39,6 +47,25 @@ const std::string DEFAULT_CONFIG_FILE = "./catchdb.conf";
 void WriteResultHandler(EventManager &em, int clientfd, void *data);
 void ReadQueryHandler(EventManager &em, int clientfd, void *data);
 void AcceptHandler(EventManager &em, int serverfd, void *data);
+void CompletionHandler(EventManager &em, int efd, void *data);
+void SendReply(EventManager &em, Client *client, bool reading);
+
+// state shared by the handlers of one event loop, passed as event data
+// of the listening sockets and kept by every client of the loop
+struct LoopContext
+{
+    CatchDBPtr db;
+    ConfigPtr config;
+    WorkerPool *pool; // nullptr: commands are executed on the loop
+    std::unique_ptr<CompletionQueue> completions;
+
+    LoopContext(const CatchDBPtr &d, const ConfigPtr &c, WorkerPool *p)
+        : db(d), config(c), pool(p)
+    {
+        if (pool != nullptr)
+            completions.reset(new CompletionQueue);
+    }
+};
 
 struct ServerOptions
 {
@@ -162,19 +189,20 @@ int GetOpenFileLimits()
 
 std::vector<int> ListenToPort(const std::vector<std::string> &bindAddresses, 
                               const std::string &port,
-                              int backlog)
+                              int backlog,
+                              bool reusePort)
 {
     std::vector<int> fds;
 
     int fd;
     if (bindAddresses.empty()) {
-        if ((fd = Listen("", port, backlog)) > 0) {
+        if ((fd = Listen("", port, backlog, reusePort)) > 0) {
             fds.push_back(fd);
             LogInfo("Listening on 0.0.0.0:%s", port.c_str());
         }
     } else {
         for (auto &addr : bindAddresses) {
-            if ((fd = Listen(addr, port, backlog)) > 0) {
+            if ((fd = Listen(addr, port, backlog, reusePort)) > 0) {
                 fds.push_back(fd);
                 LogInfo("Listening on %s:%s", addr.c_str(), port.c_str());
             }
@@ -210,22 +238,56 @@ void SetupSignalHandler()
     // setitimer
 }
 
+// Send the queued replies right away and only wait for writability when
+// the socket buffer fills up. @reading tells whether the read event is
+// still registered for the client.
+void SendReply(EventManager &em, Client *client, bool reading)
+{
+    int clientfd = client->getFd();
+    auto s = client->writeResult();
+    if (s == Status::Error) {
+        LogError("send error: %s. close connection %s:%d", 
+                 ErrorDescription(errno),
+                 client->getRemoteIPString().c_str(),
+                 client->getRemotePort());
+        em.delEvent(clientfd, EVENT_ALL);
+        Client::DestroyClient(client);
+        return;
+    }
+
+    if (s == Status::Progress) {
+        em.clearReady(clientfd, EVENT_OUT);
+        if (reading)
+            em.delEvent(clientfd, EVENT_IN);
+        Event event(EVENT_OUT, WriteResultHandler, client);
+        em.addEvent(clientfd, event);
+        return;
+    }
+
+    if (!reading) {
+        Event event(EVENT_IN, ReadQueryHandler, client);
+        em.addEvent(clientfd, event);
+    }
+}
+
 void WriteResultHandler(EventManager &em, int clientfd, void *data)
 {
-    ClientPtr client = Client::GetClient(clientfd);
+    Client *client = (Client *)data;
     auto s = client->writeResult();
     if (s == Status::Error) {
         LogError("send error: %s. close connection %s:%d", 
                  ErrorDescription(errno),
                  client->getRemoteIPString().c_str(),
                  client->getRemotePort());
-        em.delEvent(clientfd, EVENT_IN);
-        Client::DestroyClient(clientfd);
+        em.delEvent(clientfd, EVENT_ALL);
+        Client::DestroyClient(client);
         return;
     }
 
-    if (s == Status::Progress)
+    if (s == Status::Progress) {
+        em.clearReady(clientfd, EVENT_OUT);
         return;
+    }
 
     em.delEvent(clientfd, EVENT_OUT);
     Event event(EVENT_IN, ReadQueryHandler, data);
@@ -234,14 +296,14 @@ void WriteResultHandler(EventManager &em, int clientfd, void *data)
 
 void ReadQueryHandler(EventManager &em, int clientfd, void *data)
 {
-    ClientPtr client = Client::GetClient(clientfd);
+    Client *client = (Client *)data;
     auto s = client->processQuery(); 
     if (s == Status::Close) {
         LogError("close connection %s:%d", 
                  client->getRemoteIPString().c_str(),
                  client->getRemotePort());
-        em.delEvent(clientfd, EVENT_IN);
-        Client::DestroyClient(clientfd);
+        em.delEvent(clientfd, EVENT_ALL);
+        Client::DestroyClient(client);
         return;
 
     } else if (s == Status::Error) {
@@ -249,30 +311,47 @@ void ReadQueryHandler(EventManager &em, int clientfd, void *data)
                  ErrorDescription(errno),
                  client->getRemoteIPString().c_str(),
                  client->getRemotePort());
-        em.delEvent(clientfd, EVENT_IN);
-        Client::DestroyClient(clientfd);
-        return;
-    } else if (s == Status::Progress) {
+        em.delEvent(clientfd, EVENT_ALL);
+        Client::DestroyClient(client);
         return;
     }
 
+    if (!client->readable())
+        em.clearReady(clientfd, EVENT_IN);
+    if (s == Status::Progress)
+        return;
+
     assert(s == Status::OK);
 
-    // temporarily delete read event
-    em.delEvent(clientfd, EVENT_IN);
+    LoopContext *ctx = (LoopContext *)client->context();
+    if (ctx->pool != nullptr) {
+        // stop reading until the worker hands the client back
+        em.delEvent(clientfd, EVENT_IN);
+        ctx->pool->submit(client, ctx->completions.get(), client->affinity());
+        return;
+    }
 
-    CatchDBPtr db = *((CatchDBPtr *)data);
-    s = client->executeCommand(db);
+    s = client->executeCommand(ctx->db);
     if (s == Status::Error) {
         // program will not reach here
     }
-    Event event(EVENT_OUT, WriteResultHandler, data);
-    em.addEvent(clientfd, event);
+    SendReply(em, client, true);
+}
+
+void CompletionHandler(EventManager &em, int efd, void *data)
+{
+    LoopContext *ctx = (LoopContext *)data;
+    ctx->completions->clearSignal();
+
+    Client *client;
+    while (ctx->completions->pop(&client)) {
+        SendReply(em, client, false);
+    }
 }
 
 void AcceptHandler(EventManager &em, int serverfd, void *data)
 {
-    // data is CatchDBPtr
+    // data is LoopContext
 
     int clientfd;
     struct sockaddr_storage sa;
@@ -310,16 +389,64 @@ void AcceptHandler(EventManager &em, int serverfd, void *data)
     SetTcpNoDelay(clientfd);
     SetTcpKeepAlive(clientfd);
 
-    (void) Client::CreateClient(clientfd, ipstr, port);
-
-    Event e(EVENT_IN, ReadQueryHandler, data);
-    if (em.addEvent(clientfd, e) == Status::Error) {
+    LoopContext *ctx = (LoopContext *)data;
+    Client *client = Client::CreateClient(clientfd, ipstr, port,
+                                          ctx->config->maxQueryBuffer * 1024 * 1024,
+                                          ctx);
+    if (client == nullptr) {
+        LogWarning("Too many clients, refuse %s:%d", ipstr, port);
         close(clientfd);
-        Client::DestroyClient(clientfd);
+        return;
+    }
+
+    int flag = EVENT_IN;
+    if (ctx->config->edgeTriggered)
+        flag |= EVENT_EDGE;
+    Event e(flag, ReadQueryHandler, client);
+    if (em.addEvent(clientfd, e) != Status::OK) {
+        Client::DestroyClient(client);
         LogError("Add Listening event for %s:%d Failed", ipstr, port);
     }
 }
 
+// Every io thread runs its own event loop over its own listening sockets
+// and the clients accepted from them; only the db and the worker pool
+// are shared.
+void RunEventLoop(const std::vector<int> &serverSocks, int maxfds,
+                  CatchDBPtr db, ConfigPtr config, WorkerPool *pool)
+{
+    if (config->eventBackend == "io_uring") {
+        UringLoop loop(db, config, pool);
+        if (loop.init(serverSocks, maxfds)) {
+            loop.run();
+            return;
+        }
+        LogWarning("io_uring unavailable: %s, falling back to epoll",
+                   ErrorDescription(errno));
+    }
+
+    EventManager eventManager(maxfds);
+    LoopContext ctx(db, config, pool);
+
+    for (auto &fd : serverSocks) {
+        Event e(EVENT_IN, AcceptHandler, &ctx);
+        if (eventManager.addEvent(fd, e) != Status::OK) {
+            LogFatal("Can't add listening event");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (pool != nullptr) {
+        Event e(EVENT_IN, CompletionHandler, &ctx);
+        if (eventManager.addEvent(ctx.completions->fd(), e) != Status::OK) {
+            LogFatal("Can't add completion event");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    eventManager.run();
+}
+
 int main(int argc, char **argv)
 {
     ServerOptions serverOptions = ParseCommandLineOptions(argc, argv);
@@ -333,13 +460,19 @@ int main(int argc, char **argv)
     // init logging
     InitLogging(config->logFile, config->logLevel);
 
-    // listening
-    auto serverSocks = ListenToPort(config->bindAddresses, 
-                                    config->port,
-                                    config->backlog);
-    if (serverSocks.empty()) {
-        LogFatal("Cannot open server sockets");
-        exit(EXIT_FAILURE);
+    // listening, one set of sockets per io thread
+    bool reusePort = config->ioThreads > 1;
+    std::vector<std::vector<int>> serverSocks;
+    for (int i = 0; i < config->ioThreads; ++i) {
+        auto socks = ListenToPort(config->bindAddresses, 
+                                  config->port,
+                                  config->backlog,
+                                  reusePort);
+        if (socks.empty()) {
+            LogFatal("Cannot open server sockets");
+            exit(EXIT_FAILURE);
+        }
+        serverSocks.push_back(socks);
     }
 
     // setup signal handler
@@ -366,19 +499,31 @@ int main(int argc, char **argv)
     CreatePidFile(config->pidFile);
 
     int maxfds = GetOpenFileLimits();
-    // Main Event Loop
-    EventManager eventManager(maxfds);
 
-    for (auto &fd : serverSocks) {
-        Event e(EVENT_IN, AcceptHandler, &db);
-        if (eventManager.addEvent(fd, e) != Status::OK) {
-            LogFatal("Can't add listening event");
-            exit(EXIT_FAILURE);
-        }
+    // client slots are indexed by fd, max_clients bounds their memory
+    Client::InitClients(std::min(maxfds, config->maxClients + RESERVED_FDS));
+    Client::InitContainers(config->containerCache,
+                           std::chrono::milliseconds(config->foldAge));
+
+    std::unique_ptr<WorkerPool> pool;
+    if (config->workerThreads > 0) {
+        LogInfo("Start %d worker(s)...", config->workerThreads);
+        pool.reset(new WorkerPool(config->workerThreads, db));
     }
 
-    LogInfo("Start event loop...");
-    eventManager.run();
+    LogInfo("Start %d event loop(s)...", config->ioThreads);
+    std::vector<std::thread> ioThreads;
+    for (int i = 1; i < config->ioThreads; ++i) {
+        ioThreads.push_back(std::thread(RunEventLoop, serverSocks[i], maxfds,
+                                        db, config, pool.get()));
+    }
+    // Main Event Loop
+    RunEventLoop(serverSocks[0], maxfds, db, config, pool.get());
+
+    for (auto &t : ioThreads) {
+        t.join();
+    }
+    Client::ReleaseContainers();
 
     // remove pidfile
     RemovePidFile(config->pidFile);